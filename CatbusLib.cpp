@@ -25,15 +25,37 @@ SOFTWARE.
 // DispatchLib.cpp : Defines the entry point for the console application.
 //
 
+#include "bridge.h"
+#include "cancel.h"
+#include "channel.h"
 #include "dispatch_utils.h"
 #include "event_bus.h"
 #include "event_sender.h"
 #include "queue_mutex.h"
 #include "queue_lock_free.h"
+#include "queue_shm.h"
+#include "journal.h"
+#include "payload.h"
+#include "queue_spill.h"
+#include "queue_deadline.h"
+#include "queue_fair.h"
+#include "io_reactor.h"
+#include "stats_page.h"
+#include "worker_pool.h"
 
+#include <algorithm>
+#include <array>
 #include <cassert>
+#include <filesystem>
+#include <functional>
 #include <iostream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
 #include <thread>
+#include <tuple>
+#include <vector>
 
 using namespace catbus;
 using namespace std::chrono_literals;
@@ -101,6 +123,40 @@ struct Event_InitProducer
   size_t data;
 };
 
+// Plain data event, can be sent through shared memory queues.
+struct Event_Trivial
+{
+  size_t data;
+};
+
+// Targeted plain data event with a sequence number, to check the order of delivery.
+struct Event_Sequenced
+{
+  size_t target;
+  size_t seq;
+};
+
+// Event of a chain of handlers that are fused, see FusedHandlers().
+struct Event_Chain
+{
+  size_t hops;
+};
+
+template<> struct catbus::fused_event<Event_Chain> : std::true_type {};
+
+// Event that has to be handled before its deadline.
+struct Event_Deadline
+{
+  uint64_t deadline_ns;
+  size_t data;
+};
+
+struct Event_Payload
+{
+  PooledVector<long> values;
+  PooledString name;
+};
+
 // TEST CONSUMERS
 
 // Used to test static dispatching of events, based on event type and handler method signature.
@@ -111,8 +167,9 @@ public:
   Consumer_NoId_Waits_NoTargetEvt(const Consumer_NoId_Waits_NoTargetEvt&) = delete;
   Consumer_NoId_Waits_NoTargetEvt(Consumer_NoId_Waits_NoTargetEvt&&) = delete;
 
-  int no_target_evt_handled{ 0 };
-  int blocker_received{ 0 };
+  // Atomic, so that tests can wait for them while the handlers run.
+  std::atomic<int> no_target_evt_handled{ 0 };
+  std::atomic<int> blocker_received{ 0 };
 
   void handle(Event_NoTarget ev, size_t)
   {
@@ -249,13 +306,285 @@ public:
   }
 };
 
+// Actor-style consumer: once pinned to a home queue its handlers never run concurrently, so it can
+// use plain non-atomic state.
+class PinnedActor
+{
+public:
+  PinnedActor() = default;
+  PinnedActor(const PinnedActor&) = delete;
+  PinnedActor(PinnedActor&&) = delete;
+
+  QueueAffinity affinity_;
+  // Atomic, so that overlapping handlers are detected rather than racing, and tests can wait for
+  // the count, which is bumped last.
+  std::atomic<int> no_target_evt_handled{ 0 };
+  std::atomic<bool> overlap_detected{ false };
+  std::atomic<bool> inside_handler{ false };
+
+  void handle(Event_NoTarget ev, size_t)
+  {
+    if (inside_handler.exchange(true))
+    {
+      overlap_detected = true;
+    }
+    inside_handler = false;
+    ++no_target_evt_handled;
+  }
+};
+
+// Pinned consumer of events with deadlines.
+class PinnedDeadline
+{
+public:
+  QueueAffinity affinity_;
+  int handled{ 0 };
+
+  void handle(Event_Deadline, size_t)
+  {
+    ++handled;
+  }
+};
+
+// Handles trivially copyable events, which can travel between processes.
+class Consumer_Trivial
+{
+public:
+  Consumer_Trivial() = default;
+  Consumer_Trivial(const Consumer_Trivial&) = delete;
+  Consumer_Trivial(Consumer_Trivial&&) = delete;
+
+  // Atomic and bumped last, so that tests can wait for it and then read the rest.
+  std::atomic<size_t> trivial_evt_handled{ 0 };
+  size_t data_sum{ 0 };
+  size_t last_data{ 0 };
+  bool out_of_order{ false };
+
+  void handle(Event_Trivial ev, size_t)
+  {
+    data_sum += ev.data;
+    out_of_order = out_of_order || ev.data < last_data;
+    last_data = ev.data;
+    ++trivial_evt_handled;
+  }
+};
+
+// Checks that its events come in the order they were sent.
+class Consumer_Sequenced
+{
+public:
+  explicit Consumer_Sequenced(size_t id) : id_{ id } {}
+
+  const size_t id_;
+  // Atomic and bumped last, so that tests can wait for it and then read the rest.
+  std::atomic<size_t> handled{ 0 };
+  size_t last_seq{ 0 };
+  bool out_of_order{ false };
+
+  void handle(Event_Sequenced ev, size_t)
+  {
+    out_of_order = out_of_order || (handled != 0 && ev.seq <= last_seq) || ev.target != id_;
+    last_seq = ev.seq;
+    ++handled;
+  }
+};
+
+// Takes runs of trivial events in one call and remembers their sizes.
+class Consumer_Batch
+{
+public:
+  std::vector<size_t> batches;
+  size_t singles{ 0 };
+  size_t data_sum{ 0 };
+  size_t last_data{ 0 };
+  bool out_of_order{ false };
+
+  void handle(Event_Trivial ev, size_t)
+  {
+    ++singles;
+    add(ev.data);
+  }
+
+  void handle_batch(Span<Event_Trivial> events, size_t)
+  {
+    batches.push_back(events.size());
+    for (auto& ev : events)
+    {
+      add(ev.data);
+    }
+  }
+
+private:
+  void add(size_t data)
+  {
+    out_of_order = out_of_order || data < last_data;
+    last_data = data;
+    data_sum += data;
+  }
+};
+
+// Remembers where the payload of the last event was, to check that the memory is reused.
+class Consumer_Payload
+{
+public:
+  std::atomic<const long*> last_values{ nullptr };
+  long sum{ 0 };
+  std::string name;
+
+  void handle(Event_Payload ev, size_t)
+  {
+    for (auto v : ev.values)
+    {
+      sum += v;
+    }
+    name.assign(ev.name.begin(), ev.name.end());
+    last_values.store(ev.values.data(), std::memory_order_release);
+  }
+};
+
+// Sends the event on until it runs out of hops, and remembers how deep the handlers nested.
+class Consumer_Chain
+{
+public:
+  EventSender<Event_Chain> sender_;
+  size_t handled{ 0 };
+  size_t depth{ 0 };
+  size_t deepest{ 0 };
+
+  void handle(Event_Chain ev, size_t q)
+  {
+    ++handled;
+    deepest = std::max(deepest, ++depth);
+    if (ev.hops > 0)
+    {
+      sender_.send(Event_Chain{ ev.hops - 1 }, q);
+    }
+    --depth;
+  }
+};
+
+// Notes the order of events with and without deadlines.
+class Consumer_Deadline
+{
+public:
+  std::vector<size_t> order;
+
+  void handle(Event_Deadline ev, size_t)
+  {
+    order.push_back(ev.data);
+  }
+
+  void handle(Event_Trivial ev, size_t)
+  {
+    order.push_back(ev.data);
+  }
+};
+
+// Writes its id to a log shared with other consumers, to check the order they are served in.
+class Consumer_Logging
+{
+public:
+  Consumer_Logging(size_t id, std::vector<size_t>& log) : id_{ id }, log_{ log } {}
+
+  const size_t id_;
+
+  void handle(Event_Trivial ev, size_t)
+  {
+    log_.push_back(id_);
+  }
+
+  void handle(Event_NoTarget ev, size_t)
+  {
+    log_.push_back(id_ + 10);
+  }
+
+private:
+  std::vector<size_t>& log_;
+};
+
+// Sends two follow-ups to its own queue for the first event, and notes the order of events.
+class Consumer_Followup
+{
+public:
+  EventSender<Event_Trivial> sender_;
+  std::vector<size_t> order;
+  // Called before the follow-ups are sent, if set.
+  std::function<void()> on_first;
+
+  void handle(Event_Trivial ev, size_t q)
+  {
+    order.push_back(ev.data);
+    if (ev.data == 0)
+    {
+      if (on_first)
+      {
+        on_first();
+      }
+      sender_.send(Event_Trivial{ 1 }, q);
+      sender_.send(Event_Trivial{ 2 }, q);
+    }
+  }
+};
+
+// Takes a while with every event, so that the threads serving it stay in their rounds.
+class Consumer_Slow
+{
+public:
+  std::atomic<int> handled{ 0 };
+
+  void handle(Event_NoTarget ev, size_t)
+  {
+    std::this_thread::sleep_for(100us);
+    ++handled;
+  }
+};
+
+// Counts its events and notes how many another consumer had handled when it got its last one.
+class Consumer_Racing
+{
+public:
+  Consumer_Racing(int total, const std::atomic<int>& other) : total_{ total }, other_{ other } {}
+
+  std::atomic<int> handled{ 0 };
+  std::atomic<int> other_at_finish{ -1 };
+
+  void handle(Event_NoTarget ev, size_t)
+  {
+    if (handled.fetch_add(1) + 1 == total_)
+    {
+      other_at_finish = other_.load();
+    }
+  }
+
+private:
+  const int total_;
+  const std::atomic<int>& other_;
+};
+
+// Waits until the condition holds or the deadline passes, and returns the condition. The deadline
+// is generous, so that tests wait for what they check instead of sleeping for a guessed time.
+template<typename Condition>
+bool wait_until(Condition condition, std::chrono::steady_clock::duration timeout = 5s)
+{
+  const auto deadline = std::chrono::steady_clock::now() + timeout;
+  while (!condition())
+  {
+    if (std::chrono::steady_clock::now() >= deadline)
+    {
+      return false;
+    }
+    std::this_thread::sleep_for(1ms);
+  }
+  return true;
+}
+
 // TEST FUNCTIONS
 
 // Static dispatch is used for events without 'target' field. Type of event and signatures of
 // potential handler methods are compared.
 bool BasicStaticDispatch()
 {
-  EventCatbus<MutexProtectedQueue, 1, 1> catbus;
+  InlineCatbus<MutexProtectedQueue> catbus;
   Consumer_NoId_Waits_NoTargetEvt A;
   Consumer_NoId_Waits_TargetEvt B;
 
@@ -270,15 +599,17 @@ bool BasicStaticDispatch()
     return false;
   }
   static_dispatch(catbus, ROUND_ROBIN, Event_NoTarget{}, B, A);
-  std::this_thread::sleep_for(100ms);
-  return ok = A.no_target_evt_handled == 1 && B.target_evt_handled == 0;
+  // The bus has no workers, nothing runs until it is polled.
+  ok = A.no_target_evt_handled == 0 && catbus.run_until_idle() == 1
+    && catbus.stats().polled.tasks == 1;
+  return ok = ok && A.no_target_evt_handled == 1 && B.target_evt_handled == 0;
 }
 
 // If event has 'target' field, it is compared against 'id' field of potential consumers which
 // has proper handler method for given event type.
 bool BasicDynamicDispatch()
 {
-  EventCatbus<SimpleLockFreeQueue<16>, 1, 1> catbus;
+  InlineCatbus<SimpleLockFreeQueue<16>> catbus;
   Consumer_Id_Waits_TargetEvt A{ 1 };
   Consumer_Id_Waits_TargetEvt B{ 2 };
 
@@ -293,14 +624,14 @@ bool BasicDynamicDispatch()
     return false;
   }
   dynamic_dispatch(catbus, ROUND_ROBIN, Event_WithTarget{ 1 }, A, B);
-  std::this_thread::sleep_for(100ms);
+  catbus.run_until_idle();
   return ok =  A.target_evt_handled == 1 && B.target_evt_handled == 0;
 }
 
 // If candidate with proper id_ does not have handler for the event, exception should be thrown.
 bool FailedDynDispatchNoHandler()
 {
-  EventCatbus<MutexProtectedQueue, 1, 1> catbus;
+  InlineCatbus<MutexProtectedQueue> catbus;
   Consumer_Id_Waits_TargetEvt A{ 1 };
   Consumer_Id_Waits_NoTargetEvt B{ 2 };
 
@@ -332,7 +663,7 @@ bool FailedDynDispatchNoHandler()
 // If all candidates have proper handlers, but wrong ids, exception should be thrown.
 bool FailedDynDispatchNoId()
 {
-  EventCatbus<SimpleLockFreeQueue<>, 1, 1> catbus;
+  InlineCatbus<SimpleLockFreeQueue<>> catbus;
   Consumer_Id_Waits_TargetEvt A{ 2 };
   Consumer_Id_Waits_TargetEvt B{ 1 };
 
@@ -348,6 +679,43 @@ bool FailedDynDispatchNoId()
   return exception_caught;
 }
 
+// Non-throwing dynamic dispatch puts unroutable events into the bus dead letter queue, from where
+// they can be inspected and dispatched again.
+bool DeadLetterQueueOnMisroute()
+{
+  InlineCatbus<MutexProtectedQueue> catbus;
+  Consumer_Id_Waits_TargetEvt A{ 1 };
+  Consumer_Id_Waits_NoTargetEvt B{ 2 };
+
+  bool ok = try_dynamic_dispatch(catbus, ROUND_ROBIN, Event_WithTarget{ 1 }, A, B)
+      == dispatch_status::delivered
+    && try_dynamic_dispatch(catbus, ROUND_ROBIN, Event_WithTarget{ 2 }, A, B)
+      == dispatch_status::dead_lettered
+    && try_dynamic_dispatch(catbus, ROUND_ROBIN, Event_WithTarget{ 3 }, A, B)
+      == dispatch_status::dead_lettered;
+  if (!ok)
+  {
+    return false;
+  }
+  catbus.dead_letters().set_capacity(1);
+  ok = catbus.dead_letters().misrouted() == 2 && catbus.dead_letters().dropped() == 1;
+
+  DeadLetter letter;
+  ok = ok && catbus.dead_letters().try_pop(letter) && letter.target == 3
+    && letter.event<Event_NoTarget>() == nullptr && letter.event<Event_WithTarget>() != nullptr;
+  if (!ok)
+  {
+    return false;
+  }
+  letter.event<Event_WithTarget>()->target = 1;
+  ok = try_dynamic_dispatch(catbus, ROUND_ROBIN, std::move(*letter.event<Event_WithTarget>()), A, B)
+    == dispatch_status::delivered;
+
+  catbus.run_until_idle();
+
+  return ok && A.target_evt_handled == 2 && !catbus.dead_letters().try_pop(letter);
+}
+
 // Event bus puts events into queues with round robin algorithm. Worker thread then checks its
 // 'primary' queue and if it's empty goes to check other queues. In this test one of the threads
 // is blocked by processing Event_BlockerNoTarget issued by Producer, but the other thread still
@@ -366,6 +734,471 @@ bool SchedulingAndTaskStealing()
   return ok;
 }
 
+// Buses without workers are served by a shared pool, which gives each bus a share of every
+// round proportional to its weight. Here the only pool thread is blocked on the first bus while
+// the other two fill up, then bus B with weight 3 drains about three times faster than A.
+bool SharedWorkerPoolWeights()
+{
+  SharedWorkerPool pool{ 1 };
+  EventCatbus<MutexProtectedQueue, 1, 0> blocking_bus;
+  EventCatbus<MutexProtectedQueue, 2, 0> bus_a;
+  EventCatbus<SimpleLockFreeQueue<1024>, 2, 0> bus_b;
+  pool.attach(blocking_bus);
+  pool.attach(bus_a, 1);
+  pool.attach(bus_b, 3);
+  Consumer_NoId_Waits_NoTargetEvt blocker;
+  std::atomic<int> none{ 0 };
+  Consumer_Racing A{ 400, none }, B{ 400, A.handled };
+  static_dispatch(blocking_bus, 0, Event_BlockerNoTarget{}, blocker);
+  bool ok = wait_until([&] { return blocker.blocker_received == 1; });
+  for (int i = 0; i < 400; ++i)
+  {
+    static_dispatch(bus_a, ROUND_ROBIN, Event_NoTarget{}, A);
+    static_dispatch(bus_b, ROUND_ROBIN, Event_NoTarget{}, B);
+  }
+  ok = ok && wait_until([&] { return A.handled == 400 && B.other_at_finish >= 0; });
+  return ok && pool.threads() == 1 && blocker.blocker_received == 1 && A.handled == 400
+    && B.handled == 400 && B.other_at_finish >= 100 && B.other_at_finish <= 200;
+}
+
+// A bus can be destroyed while the pool is busy: the threads may still go over a list of buses
+// from before the last attach(), which also has it, and detaching waits for those rounds too.
+bool SharedWorkerPoolDetach()
+{
+  SharedWorkerPool pool{ 4 };
+  std::atomic<int> none{ 0 };
+  Consumer_Racing stays_consumer{ 0, none };
+  Consumer_Slow leaves_consumer;
+  int sent = 0;
+  for (int round = 0; round < 20; ++round)
+  {
+    auto leaves = std::make_unique<EventCatbus<MutexProtectedQueue, 2, 0>>();
+    EventCatbus<MutexProtectedQueue, 2, 0> stays;
+    pool.attach(*leaves);
+    for (int i = 0; i < 100; ++i)
+    {
+      static_dispatch(*leaves, ROUND_ROBIN, Event_NoTarget{}, leaves_consumer);
+    }
+    // The threads are in rounds over the list without 'stays' now.
+    wait_until([&] { return leaves_consumer.handled != 0; });
+    pool.attach(stays);
+    for (int i = 0; i < 100; ++i)
+    {
+      static_dispatch(stays, ROUND_ROBIN, Event_NoTarget{}, stays_consumer);
+    }
+    sent += 100;
+    leaves.reset();
+    if (!wait_until([&] { return stays_consumer.handled == sent; }))
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Tasks queued one after another for the same batch handler are run with one call, up to the
+// budget of the call. The bus has no workers, so the test polls it and knows what is queued.
+bool BatchHandlers()
+{
+  EventCatbus<MutexProtectedQueue, 1, 0> catbus;
+  Consumer_Batch A, B;
+  for (size_t i = 0; i < 3; ++i)
+  {
+    static_dispatch(catbus, 0, Event_Trivial{ i }, A);
+  }
+  // Ends the first batch, it's for another consumer.
+  static_dispatch(catbus, 0, Event_Trivial{ 3 }, B);
+  for (size_t i = 4; i < 10; ++i)
+  {
+    static_dispatch(catbus, 0, Event_Trivial{ i }, A);
+  }
+  bool ok = catbus.poll(4) == 4 && A.batches == std::vector<size_t>{ 3 } && B.singles == 1;
+  ok = ok && catbus.poll(4) == 4 && catbus.poll(10) == 2 && catbus.poll(10) == 0;
+  return ok && A.batches == std::vector<size_t>{ 3, 4, 2 } && A.singles == 0 && !A.out_of_order
+    && A.data_sum == 42 && has_batch_handler<Consumer_Batch, Event_Trivial>::value
+    && !has_batch_handler<Consumer_Trivial, Event_Trivial>::value;
+}
+
+// Targeted events sent in bulk reach the consumers with matching ids in the order they were
+// sent, and the ones without a consumer end up in the dead letter queue. Small ids are looked up
+// in a table, large ones by a search.
+bool BulkDynamicDispatch()
+{
+  EventCatbus<MutexProtectedQueue, 2, 0> catbus;
+  Consumer_Sequenced A{ 1 }, B{ 2 }, C{ 1'000'000 };
+  std::vector<Event_Sequenced> events;
+  for (size_t i = 0; i < 999; ++i)
+  {
+    events.push_back(Event_Sequenced{ i % 3 == 0 ? 1u : i % 3 == 1 ? 2u : 5u, i });
+  }
+  bool ok = try_dynamic_dispatch_bulk(catbus, 1,
+    Span<Event_Sequenced>{ events.data(), events.size() }, A, B) == 666;
+  ok = ok && catbus.QueueSizes()[1] == 666 && catbus.dead_letters().misrouted() == 333;
+  while (catbus.poll(100) != 0)
+  {
+  }
+  ok = ok && A.handled == 333 && B.handled == 333;
+  events.clear();
+  for (size_t i = 0; i < 20; ++i)
+  {
+    events.push_back(Event_Sequenced{ i % 2 == 0 ? 1'000'000u : 1u, 1000 + i });
+  }
+  ok = ok && try_dynamic_dispatch_bulk(catbus, ROUND_ROBIN,
+    Span<Event_Sequenced>{ events.data(), events.size() }, A, C) == 20;
+  while (catbus.poll(100) != 0)
+  {
+  }
+  return ok && A.handled == 343 && B.handled == 333 && C.handled == 10 && !A.out_of_order
+    && !B.out_of_order && !C.out_of_order;
+}
+
+// Plain events sent through typed channels reach their consumers in order, in batches when the
+// consumer has a batch handler, both when the bus is polled and when its workers run.
+bool TypedChannels()
+{
+  Consumer_Batch A;
+  Consumer_Trivial B;
+  TypedChannel<Consumer_Batch, Event_Trivial, 128> to_a{ A };
+  TypedChannel<Consumer_Trivial, Event_Trivial, 8> to_b{ B };
+  InlineCatbus<MutexProtectedQueue> polled;
+  polled.attach_channel(to_a);
+  polled.attach_channel(to_b);
+  bool ok = !polled.has_tasks();
+  for (size_t i = 0; i < 100; ++i)
+  {
+    to_a.send(Event_Trivial{ i });
+  }
+  for (size_t i = 0; i < 8; ++i)
+  {
+    ok = ok && to_b.try_send(Event_Trivial{ i });
+  }
+  // Full, nothing is lost.
+  ok = ok && !to_b.try_send(Event_Trivial{ 8 }) && to_a.size() == 100 && polled.has_tasks();
+  ok = ok && polled.run_until_idle() == 108 && !polled.has_tasks();
+  ok = ok && A.batches == std::vector<size_t>{ 64, 36 } && A.data_sum == 4950 && !A.out_of_order
+    && B.trivial_evt_handled == 8 && B.data_sum == 28 && !B.out_of_order;
+
+  // A busy queue doesn't starve the channels, they are served first every few rounds.
+  Consumer_Trivial D, E;
+  TypedChannel<Consumer_Trivial, Event_Trivial, 16> to_e{ E };
+  InlineCatbus<MutexProtectedQueue> busy;
+  busy.attach_channel(to_e);
+  for (size_t i = 1; i <= 1000; ++i)
+  {
+    static_dispatch(busy, 0, Event_Trivial{ i }, D);
+  }
+  for (size_t i = 1; i <= 10; ++i)
+  {
+    to_e.send(Event_Trivial{ i });
+  }
+  for (int i = 0; i < 9; ++i)
+  {
+    busy.poll(8);
+  }
+  ok = ok && E.trivial_evt_handled == 10 && D.trivial_evt_handled < 1000;
+  busy.run_until_idle();
+  ok = ok && D.trivial_evt_handled == 1000 && !D.out_of_order;
+
+  // The channel must outlive the bus.
+  Consumer_Trivial C;
+  TypedChannel<Consumer_Trivial, Event_Trivial> to_c{ C };
+  // One worker, C isn't thread-safe.
+  EventCatbus<SimpleLockFreeQueue<16>, 2, 1> served;
+  served.attach_channel(to_c);
+  for (size_t i = 0; i < 1000; ++i)
+  {
+    to_c.send(Event_Trivial{ 1 });
+  }
+  ok = ok && wait_until([&] { return served.stats().workers[0].tasks == 1000; });
+  return ok && C.trivial_evt_handled == 1000 && C.data_sum == 1000;
+}
+
+// Sends of a fused event from a handler call the next handler inline, up to the depth limit of the
+// bus, then the chain goes through the queue once and goes on inline from there.
+bool FusedHandlers()
+{
+  EventCatbus<MutexProtectedQueue, 2, 0> bus;
+  Consumer_Chain A;
+  A.sender_.init(bus, A);
+  // Not sent from a handler, so it's queued.
+  static_dispatch(bus, 0, Event_Chain{ 20 }, A);
+  bool ok = A.handled == 0 && bus.has_tasks();
+  ok = ok && bus.poll(1) == 1 && A.handled == 9 && A.deepest == 9;
+  size_t polls = 1;
+  while (bus.poll(1) != 0)
+  {
+    ++polls;
+  }
+  ok = ok && A.handled == 21 && polls == 3;
+
+  // Every hop is a task when fusing is off.
+  bus.fuse_depth(0);
+  A.handled = A.deepest = 0;
+  static_dispatch(bus, 0, Event_Chain{ 3 }, A);
+  polls = 0;
+  while (bus.poll(1) != 0)
+  {
+    ++polls;
+  }
+  return ok && A.handled == 4 && A.deepest == 1 && polls == 4;
+}
+
+// With run_next_local() the latest local send runs right after the handler, and the one it
+// displaced from the slot waits in the queue.
+bool RunNextSlot()
+{
+  Consumer_Followup A, B;
+  {
+    InlineCatbus<MutexProtectedQueue> bus;
+    A.sender_.init(bus, A);
+    static_dispatch(bus, 0, Event_Trivial{ 0 }, A);
+    bus.run_until_idle();
+  }
+  {
+    EventCatbus<MutexProtectedQueue, 1, 1> bus;
+    bus.run_next_local(true);
+    B.sender_.init(bus, B);
+    static_dispatch(bus, 0, Event_Trivial{ 0 }, B);
+    wait_until([&bus] { return bus.stats().workers[0].tasks == 3; });
+  }
+  // A task still in the slot when the worker stops goes back to the queue.
+  Consumer_Followup C;
+  bool requeued = false;
+  {
+    EventCatbus<MutexProtectedQueue, 1, 1> bus;
+    bus.run_next_local(true);
+    C.sender_.init(bus, C);
+    C.on_first = [&bus] { bus.stop(); };
+    static_dispatch(bus, 0, Event_Trivial{ 0 }, C);
+    requeued = wait_until([&bus] { return bus.QueueSizes()[0] == 2; })
+      && bus.run_until_idle() == 2;
+  }
+  return A.order == std::vector<size_t>{ 0, 1, 2 } && B.order == std::vector<size_t>{ 0, 2, 1 }
+    && requeued && C.order == std::vector<size_t>{ 0, 1, 2 };
+}
+
+// A deadline queue serves events earliest deadline first, events without a deadline last, and
+// each group in the order they were sent. Late events are counted, or dropped by a shedding queue.
+bool DeadlineScheduling()
+{
+  InlineCatbus<DeadlineQueue<>> catbus;
+  Consumer_Deadline A;
+  bool ok = has_deadline<Event_Deadline>::value && !has_deadline<Event_Trivial>::value;
+  static_dispatch(catbus, 0, Event_Trivial{ 1 }, A);
+  static_dispatch(catbus, 0, Event_Trivial{ 2 }, A);
+  for (size_t i = 0; i < 20; ++i)
+  {
+    // Equal deadlines for pairs of events.
+    static_dispatch(catbus, 0, Event_Deadline{ deadline_after(1h - i / 2 * 1ms), 100 + i }, A);
+  }
+  static_dispatch(catbus, 0, Event_Trivial{ 3 }, A);
+  static_dispatch(catbus, 0, Event_Deadline{ 1, 99 }, A);
+  ok = ok && catbus.run_until_idle() == 24 && catbus.queue(0).late() == 1;
+  std::vector<size_t> expected{ 99 };
+  for (size_t i = 20; i > 0; i -= 2)
+  {
+    expected.insert(expected.end(), { 100 + i - 2, 100 + i - 1 });
+  }
+  expected.insert(expected.end(), { 1, 2, 3 });
+  ok = ok && A.order == expected;
+
+  InlineCatbus<DeadlineQueue<true>> shedding;
+  Consumer_Deadline B;
+  static_dispatch(shedding, 0, Event_Deadline{ 1, 1 }, B);
+  static_dispatch(shedding, 0, Event_Deadline{ deadline_after(1h), 2 }, B);
+  static_dispatch(shedding, 0, Event_Trivial{ 3 }, B);
+  return ok && shedding.run_until_idle() == 2 && shedding.queue(0).shed() == 1
+    && shedding.queue(0).late() == 0 && B.order == std::vector<size_t>{ 2, 3 };
+}
+
+// Tasks a queue drops without running are discarded, so a pinned consumer gets its count of
+// queued events back and can move to another queue again.
+bool ShedTasksAreDiscarded()
+{
+  InlineCatbus<DeadlineQueue<true>, 2> catbus;
+  PinnedDeadline A;
+  catbus.pin_to(0, A);
+  static_dispatch(catbus, 0, Event_Deadline{ 1, 1 }, A);
+  static_dispatch(catbus, 0, Event_Deadline{ 1, 2 }, A);
+  bool ok = !A.affinity_.try_move(1);
+  return ok && catbus.run_until_idle() == 0 && catbus.queue(0).shed() == 2
+    && A.affinity_.try_move(1) && A.handled == 0;
+}
+
+// A fair queue serves its traffic classes by deficit round robin: a consumer that floods the queue
+// only gets its weight in tasks per round, and a quiet one doesn't wait behind the whole flood.
+bool FairScheduling()
+{
+  std::vector<size_t> log;
+  Consumer_Logging A{ 1, log }, B{ 2, log }, C{ 3, log };
+  FairWeights weights;
+  weights.consumer(A, 3);
+  InlineCatbus<FairQueue<>> catbus{ weights };
+  for (int i = 0; i < 9; ++i)
+  {
+    static_dispatch(catbus, 0, Event_Trivial{}, A);
+  }
+  for (int i = 0; i < 3; ++i)
+  {
+    static_dispatch(catbus, 0, Event_Trivial{}, B);
+  }
+  static_dispatch(catbus, 0, Event_Trivial{}, C);
+  bool ok = catbus.run_until_idle() == 13
+    && log == std::vector<size_t>{ 1, 1, 1, 2, 3, 1, 1, 1, 2, 1, 1, 1, 2 };
+
+  // Classes by event type: all the events of A are one class.
+  log.clear();
+  weights = FairWeights{};
+  weights.event<Event_NoTarget>(2);
+  InlineCatbus<FairQueue<ByEventType>> by_type{ weights };
+  for (int i = 0; i < 4; ++i)
+  {
+    static_dispatch(by_type, 0, Event_Trivial{}, A);
+  }
+  for (int i = 0; i < 4; ++i)
+  {
+    static_dispatch(by_type, 0, Event_NoTarget{}, i % 2 == 0 ? A : B);
+  }
+  return ok && by_type.run_until_idle() == 8
+    && log == std::vector<size_t>{ 1, 11, 12, 1, 11, 12, 1, 1 };
+}
+
+// Events forwarded through a bridge take a credit each until their handler returns or they are
+// dropped. Without credits they wait in the bridge, and go to the downstream bus in order, in a
+// batch, once enough credits are back.
+bool BridgeFlowControl()
+{
+  BusBridge<InlineCatbus<MutexProtectedQueue>, 4> bridge;
+  InlineCatbus<MutexProtectedQueue> downstream;
+  bridge.connect(downstream);
+  Consumer_Sequenced A{ 1 };
+  Consumer_NoId_Waits_NoTargetEvt B;
+  for (size_t i = 1; i <= 10; ++i)
+  {
+    try_dynamic_dispatch_bridged(bridge, 0, Event_Sequenced{ 1, i }, A);
+  }
+  bool ok = try_dynamic_dispatch_bridged(bridge, 0, Event_Sequenced{ 2, 11 }, A)
+      == dispatch_status::dead_lettered;
+  ok = ok && bridge.credits() == 0 && bridge.waiting() == 6 && downstream.QueueSizes()[0] == 4;
+  // Not enough credits back for a batch yet.
+  ok = ok && downstream.poll(1) == 1 && bridge.waiting() == 6 && bridge.credits() == 1;
+  ok = ok && downstream.poll(3) == 3 && bridge.waiting() == 2 && downstream.QueueSizes()[0] == 4;
+  static_dispatch_bridged(bridge, 0, Event_NoTarget{}, B);
+  ok = ok && downstream.run_until_idle() == 7 && bridge.waiting() == 0 && bridge.credits() == 4;
+  ok = ok && A.handled == 10 && !A.out_of_order && B.no_target_evt_handled == 1;
+
+  // Events dropped downstream give their credits back too.
+  BusBridge<InlineCatbus<DeadlineQueue<true>>, 4> shedding_bridge;
+  InlineCatbus<DeadlineQueue<true>> shedding;
+  shedding_bridge.connect(shedding);
+  Consumer_Deadline C;
+  for (size_t i = 0; i < 10; ++i)
+  {
+    static_dispatch_bridged(shedding_bridge, 0, Event_Deadline{ 1, i }, C);
+  }
+  ok = ok && shedding_bridge.credits() == 0 && shedding_bridge.waiting() == 6;
+  return ok && shedding.run_until_idle() == 0 && shedding.queue(0).shed() == 10
+    && shedding_bridge.credits() == 4 && shedding_bridge.waiting() == 0 && C.order.empty();
+}
+
+// Payload memory freed by a worker goes back to the pool of the thread that allocated it, which
+// takes it from the return list once its own free list is empty.
+bool PayloadReturnsToOriginPool()
+{
+  Consumer_Payload A;
+  PooledVector<long> values(100, 3);
+  const long* sent = values.data();
+  {
+    EventCatbus<MutexProtectedQueue, 1, 1> catbus;
+    static_dispatch(catbus, 0, Event_Payload{ std::move(values),
+      PooledString{ "a payload name too long for the inline buffer" } }, A);
+    // The event is destroyed after the handler returns, at the latest when the worker stops.
+    wait_until([&A] { return A.last_values.load(std::memory_order_acquire) != nullptr; });
+  }
+  PooledVector<long> reused(100, 0);
+  bool ok = A.last_values.load(std::memory_order_acquire) == sent && A.sum == 300
+    && A.name == "a payload name too long for the inline buffer" && reused.data() == sent;
+  // A block that outlives its thread goes back to the pool the next thread gets, also when it is
+  // freed by a thread-local destroyed after the pool changed hands.
+  PooledVector<long> orphan;
+  std::thread{ [&orphan]
+  {
+    static thread_local PooledVector<long> late;
+    late.assign(50, 1);
+    orphan.assign(200, 2);
+  } }.join();
+  const long* left = orphan.data();
+  orphan = PooledVector<long>{};
+  const long* adopted = nullptr;
+  std::thread{ [&adopted]
+  {
+    PooledVector<long> values(200, 0);
+    adopted = values.data();
+  } }.join();
+  return ok && adopted == left;
+}
+
+// Cancelled tasks stay queued, but the worker drops them without calling the handler. A handle
+// cancels one task, a token cancels everything sent with it so far.
+bool CancelledTasksAreDropped()
+{
+  EventCatbus<MutexProtectedQueue, 1, 1> catbus;
+  Consumer_NoId_Waits_NoTargetEvt A;
+  CancelToken token;
+  static_dispatch(catbus, 0, Event_BlockerNoTarget{}, A);
+  if (!wait_until([&] { return A.blocker_received == 1; }))
+  {
+    return false;
+  }
+  std::vector<CancelHandle> handles;
+  for (int i = 0; i < 10; ++i)
+  {
+    handles.push_back(static_dispatch_cancellable(catbus, 0, Event_NoTarget{}, A));
+  }
+  bool ok = true;
+  for (int i = 0; i < 10; i += 2)
+  {
+    ok = ok && handles[i].cancel() && !handles[i].cancel();
+  }
+  for (int i = 0; i < 5; ++i)
+  {
+    static_dispatch_cancellable(catbus, 0, token, Event_NoTarget{}, A);
+  }
+  token.cancel_all();
+  for (int i = 0; i < 3; ++i)
+  {
+    static_dispatch_cancellable(catbus, 0, token, Event_NoTarget{}, A);
+  }
+  ok = ok && wait_until([&] {
+    return A.no_target_evt_handled == 8 && catbus.stats().workers[0].cancelled == 10;
+  });
+  // Tasks that ran can't be cancelled anymore.
+  ok = ok && !handles[1].cancel();
+  return ok && catbus.stats().workers[0].tasks == 9;
+}
+
+// A worker stuck in a long handler is detected by its heartbeat: tasks sent to its queue go to
+// the other queue instead, and the queue is back to normal when the handler returns.
+bool StalledWorkerDetection()
+{
+  EventCatbus<MutexProtectedQueue, 2, 2> catbus;
+  catbus.detect_stalls(20ms);
+  Consumer_NoId_Waits_NoTargetEvt A;
+  static_dispatch(catbus, 0, Event_BlockerNoTarget{}, A);
+  bool ok = wait_until([&] { return catbus.stalled(0) || catbus.stalled(1); });
+  // The blocker may have been stolen by the other worker before the first one started.
+  size_t stuck = catbus.stalled(0) ? 0 : 1;
+  ok = ok && catbus.stalled(stuck) && !catbus.stalled(1 - stuck);
+  for (int i = 0; i < 10; ++i)
+  {
+    static_dispatch(catbus, stuck, Event_NoTarget{}, A);
+  }
+  ok = ok && wait_until([&A] { return A.no_target_evt_handled == 10; });
+  // Redirected tasks were taken by the other worker from its own queue, not stolen.
+  ok = ok && A.blocker_received == 1 && catbus.stats().workers[1 - stuck].steals == 0;
+  return ok && wait_until([&catbus] { return !catbus.stalled(0) && !catbus.stalled(1); });
+}
+
 // Event consumers can have another bus inside them. This one intended to process events in FIFO
 // order and is built by dispatching events to a separate bus with single thread.
 // If that thread is blocked, all other events that were sent there will have to wait.
@@ -389,6 +1222,499 @@ bool NestedBusScheduling()
   return ok;
 }
 
+// When there are more queues than workers, the additional queues don't have a worker which checks
+// them first, but idle workers find them through the mask of non-empty queues.
+bool QueuesWithoutDedicatedWorker()
+{
+  EventCatbus<SimpleLockFreeQueue<16>, 70, 2> catbus;
+  Consumer_NoId_Waits_NoTargetEvt A;
+  static_dispatch(catbus, 5, Event_NoTarget{}, A);
+  static_dispatch(catbus, 69, Event_NoTarget{}, A);
+  static_dispatch(catbus, 64, Event_NoTarget{}, A);
+
+  return wait_until([&] { return A.no_target_evt_handled == 3; });
+}
+
+// Events sent without explicit queue index are placed by the bus placement policy. Whatever the
+// policy picks, every event has to be delivered exactly once.
+bool PlacementPolicies()
+{
+  EventCatbus<MutexProtectedQueue, 4, 1, PowerOfTwoChoices> p2c_bus;
+  EventCatbus<SimpleLockFreeQueue<16>, 3, 1, PerThreadRoundRobin> per_thread_bus;
+  EventCatbus<MutexProtectedQueue, 2, 2, PreferLocal<1>> local_bus;
+  Consumer_NoId_Waits_NoTargetEvt A1, A2, B;
+  Producer P;
+  setup_dispatch(local_bus, B, P);
+  for (int i = 0; i < 10; ++i)
+  {
+    static_dispatch(p2c_bus, ROUND_ROBIN, Event_NoTarget{}, A1);
+    static_dispatch(per_thread_bus, ROUND_ROBIN, Event_NoTarget{}, A2);
+  }
+  // Producer sends its events from a worker thread, so they are placed locally until the
+  // queue grows longer than the threshold.
+  static_dispatch(local_bus, ROUND_ROBIN, Event_InitProducer{ 0 }, P);
+
+  return wait_until([&] {
+    return A1.no_target_evt_handled == 10 && A2.no_target_evt_handled == 10
+      && B.blocker_received == 1 && B.no_target_evt_handled == 2;
+  });
+}
+
+// Pinned consumers are served by one worker at a time even though there are several workers
+// and events are sent with round robin.
+bool PinnedConsumers()
+{
+  EventCatbus<SimpleLockFreeQueue<1024>, 4, 4> catbus;
+  PinnedActor A, B;
+  catbus.pin(A, B);
+  if (A.affinity_.home() == B.affinity_.home())
+  {
+    return false;
+  }
+  for (int i = 0; i < 500; ++i)
+  {
+    static_dispatch(catbus, ROUND_ROBIN, Event_NoTarget{}, A);
+    static_dispatch(catbus, ROUND_ROBIN, Event_NoTarget{}, B);
+  }
+
+  bool ok = wait_until([&] {
+    return A.no_target_evt_handled == 500 && B.no_target_evt_handled == 500;
+  });
+  return ok && !A.overlap_detected && !B.overlap_detected;
+}
+
+// When one actor queue grows much longer than another, rebalance() moves an idle consumer away.
+bool RebalancePinnedConsumers()
+{
+  EventCatbus<MutexProtectedQueue, 2, 1> catbus;
+  PinnedActor A, B, C;
+  Consumer_NoId_Waits_NoTargetEvt D;
+  catbus.pin(A, B, C);
+  bool ok = A.affinity_.home() == 0 && B.affinity_.home() == 1 && C.affinity_.home() == 0;
+  if (!ok)
+  {
+    return false;
+  }
+  // The only worker gets stuck with the blocker, so events for A pile up in queue 0.
+  static_dispatch(catbus, 1, Event_BlockerNoTarget{}, D);
+  if (!wait_until([&] { return D.blocker_received == 1; }))
+  {
+    return false;
+  }
+  for (int i = 0; i < 10; ++i)
+  {
+    static_dispatch(catbus, ROUND_ROBIN, Event_NoTarget{}, A);
+  }
+  // A has queued events and can't move, but C is idle.
+  ok = catbus.rebalance(8) && A.affinity_.home() == 0 && C.affinity_.home() == 1;
+  static_dispatch(catbus, ROUND_ROBIN, Event_NoTarget{}, C);
+
+  return ok && wait_until([&] {
+    return A.no_target_evt_handled == 10 && C.no_target_evt_handled == 1;
+  });
+}
+
+// Senders keep a pointer to the registry shared by the whole setup, so the number of consumers is
+// not limited by the size of sender, and targeted events are found by id lookup.
+bool LargeConsumerRegistry()
+{
+  InlineCatbus<MutexProtectedQueue, 2> catbus;
+  std::array<Consumer_Id_Waits_TargetEvt, 12> targets{
+    Consumer_Id_Waits_TargetEvt{ 11 }, Consumer_Id_Waits_TargetEvt{ 10 },
+    Consumer_Id_Waits_TargetEvt{ 9 }, Consumer_Id_Waits_TargetEvt{ 8 },
+    Consumer_Id_Waits_TargetEvt{ 7 }, Consumer_Id_Waits_TargetEvt{ 6 },
+    Consumer_Id_Waits_TargetEvt{ 5 }, Consumer_Id_Waits_TargetEvt{ 4 },
+    Consumer_Id_Waits_TargetEvt{ 3 }, Consumer_Id_Waits_TargetEvt{ 2 },
+    Consumer_Id_Waits_TargetEvt{ 1 }, Consumer_Id_Waits_TargetEvt{ 0 } };
+  // Has the same id as one of the targets, but no handler for Event_WithTarget.
+  Consumer_Id_Waits_NoTargetEvt B{ 3 };
+  Consumer_NoId_Waits_NoTargetEvt C;
+  Producer P;
+  auto registry = std::apply(
+    [&](auto&... t) { return setup_dispatch(catbus, C, B, P, t...); }, targets);
+
+  EventSender<Event_WithTarget, Event_NoTarget> sender{ registry };
+  sender.send(Event_WithTarget{ 3 });
+  sender.send(Event_WithTarget{ 0 });
+  sender.send(Event_NoTarget{});
+  // Senders don't throw, unknown target goes to the dead letter queue.
+  bool dead_lettered = sender.send(Event_WithTarget{ 12 }) == dispatch_status::dead_lettered;
+
+  catbus.run_until_idle();
+
+  bool ok = dead_lettered && targets[8].target_evt_handled == 1
+    && targets[11].target_evt_handled == 1 && C.no_target_evt_handled == 1;
+  for (size_t i = 0; i < targets.size(); ++i)
+  {
+    ok = ok && (i == 8 || i == 11 || targets[i].target_evt_handled == 0);
+  }
+  return ok;
+}
+
+#if defined(__linux__)
+// Two buses attached to the same shared memory segments: the producer one only enqueues, the
+// consumer one binds the events to its own consumers through a registry and runs them. Only the
+// events cross, so the consumers the producer dispatches to are never called.
+bool SharedMemoryQueues()
+{
+  const auto name = "/catbus_test_" + std::to_string(getpid());
+  Consumer_Trivial A, remote_A;
+  Consumer_Sequenced S{ 1 }, remote_S{ 1 };
+  EventCatbus<SharedMemoryQueue<64>, 2, 1> consumer_bus{
+    name, make_shm_registry<Event_Trivial, Event_Sequenced>(A, S) };
+  EventCatbus<SharedMemoryQueue<64>, 2, 1> producer_bus{ name };
+  for (size_t i = 1; i <= 200; ++i)
+  {
+    static_dispatch(producer_bus, ROUND_ROBIN, Event_Trivial{ i }, remote_A);
+  }
+  for (size_t i = 1; i <= 10; ++i)
+  {
+    static_dispatch(producer_bus, 0, Event_Sequenced{ 1, i }, remote_S);
+  }
+  // Events of a type or target the registry doesn't know are dropped by the consumer side.
+  Consumer_Sequenced T{ 2 };
+  static_dispatch(producer_bus, 1, Event_Sequenced{ 2, 1 }, T);
+  Consumer_Deadline D;
+  static_dispatch(producer_bus, 1, Event_Deadline{ 0, 1 }, D);
+
+  bool rejected = false;
+  Consumer_NoId_Waits_NoTargetEvt B;
+  try
+  {
+    static_dispatch(producer_bus, 0, Event_NoTarget{}, B);
+  }
+  catch (std::invalid_argument&)
+  {
+    rejected = true;
+  }
+  // Non-throwing dispatch only covers misrouting, errors of the queue reach the caller.
+  bool try_rejected = false;
+  Consumer_Id_Waits_TargetEvt C{ 1 };
+  try
+  {
+    try_dynamic_dispatch(producer_bus, 0, Event_WithTarget{ 1 }, C);
+  }
+  catch (std::invalid_argument&)
+  {
+    try_rejected = true;
+  }
+
+  // A segment made for a queue of another size can't be attached to.
+  bool foreign_rejected = false;
+  try
+  {
+    EventCatbus<SharedMemoryQueue<128>, 2, 1> foreign_bus{ name };
+  }
+  catch (std::runtime_error&)
+  {
+    foreign_rejected = true;
+  }
+
+  bool ok = wait_until([&] {
+    return A.trivial_evt_handled == 200 && S.handled == 10
+      && consumer_bus.queue(1).unbound() == 2;
+  });
+
+  return ok && rejected && try_rejected && foreign_rejected && A.data_sum == 200 * 201 / 2
+    && !S.out_of_order && remote_A.trivial_evt_handled == 0 && remote_S.handled == 0
+    && T.handled == 0 && D.order.empty() && B.no_target_evt_handled == 0;
+}
+
+// Events sent through a bus are journaled and can be replayed later into another bus. Small
+// chunks make the journal roll over to new segments a few times.
+bool JournalReplay()
+{
+  const auto dir = (std::filesystem::temp_directory_path()
+    / ("catbus_journal_" + std::to_string(getpid()))).string();
+  std::filesystem::remove_all(dir);
+  size_t skipped = 0;
+  {
+    Journal journal{ dir, 256, 4 };
+    Consumer_Trivial A;
+    Consumer_NoId_Waits_NoTargetEvt B;
+    InlineCatbus<MutexProtectedQueue, 2> catbus;
+    catbus.journal_to(&journal);
+    for (size_t i = 1; i <= 100; ++i)
+    {
+      static_dispatch(catbus, ROUND_ROBIN, Event_Trivial{ i }, A);
+    }
+    // Not trivially copyable, so it's not journaled.
+    static_dispatch(catbus, ROUND_ROBIN, Event_NoTarget{}, B);
+    catbus.run_until_idle();
+    catbus.journal_to<Journal>(nullptr);
+    skipped = journal.skipped();
+  }
+  InlineCatbus<MutexProtectedQueue, 2> catbus;
+  Consumer_Trivial A;
+  auto replayed = replay<Event_Trivial>(dir, make_registry(catbus, A));
+
+  catbus.run_until_idle();
+
+  // A second run in the same directory is read after the first one. The thread alternates
+  // between two journals and keeps filling its chunk of each: 50 events take 7 chunks.
+  const auto other_dir = dir + "_other";
+  uint64_t second_run = 0;
+  {
+    Journal second{ dir, 256, 4 };
+    Journal other{ other_dir, 256, 4 };
+    second_run = second.run();
+    for (size_t i = 101; i <= 150; ++i)
+    {
+      second.append(TaskWrapper{ &A, Event_Trivial{ i } }, 0);
+      other.append(TaskWrapper{ &A, Event_Trivial{ i } }, 0);
+    }
+  }
+  size_t other_segments = 0;
+  for (auto& entry : std::filesystem::directory_iterator{ other_dir })
+  {
+    other_segments += entry.is_regular_file() ? 1 : 0;
+  }
+  bool in_order = true;
+  size_t read = 0;
+  size_t last = 0;
+  {
+    JournalReader reader{ dir };
+    JournalRecord record{};
+    in_order = reader.runs() == 2 && reader.foreign() == 0;
+    while (reader.next(record))
+    {
+      auto* ev = record.event<Event_Trivial>();
+      in_order = in_order && ev && ev->data > last && (ev->data > 100) == (record.run == second_run);
+      last = ev ? ev->data : last;
+      ++read;
+    }
+  }
+
+  // Segments written by another build are not replayed.
+  {
+    int fd = open(_detail::journal_segment_path(dir, 0).c_str(), O_RDWR);
+    _detail::JournalHeader header{};
+    in_order = in_order && fd >= 0 && pread(fd, &header, sizeof(header), 0) == sizeof(header);
+    header.build ^= 1;
+    in_order = in_order && pwrite(fd, &header, sizeof(header), 0) == sizeof(header);
+    close(fd);
+  }
+  JournalReader partial{ dir };
+  const auto foreign = partial.foreign();
+
+  // Chunks too small for the largest record would let it run into the next chunk.
+  bool small_rejected = false;
+  try
+  {
+    Journal small{ dir, 32, 4 };
+  }
+  catch (const std::invalid_argument&)
+  {
+    small_rejected = true;
+  }
+
+  std::filesystem::remove_all(dir);
+  std::filesystem::remove_all(other_dir);
+  return skipped == 1 && replayed == 100 && A.trivial_evt_handled == 100
+    && A.data_sum == 100 * 101 / 2 && other_segments == 2 && in_order && read == 150
+    && foreign == 1 && small_rejected;
+}
+
+// Tasks over the high-water mark are spilled to a file in batches and come back in order, while
+// a batch with a task that can't be copied bytewise stays in memory.
+bool SpillingQueueKeepsOrder()
+{
+  SpillingQueue<16, 8> queue;
+  Consumer_Trivial A;
+  Consumer_NoId_Waits_NoTargetEvt B;
+  for (size_t i = 1; i <= 100; ++i)
+  {
+    queue.enqueue(TaskWrapper{ &A, Event_Trivial{ i } });
+    if (i == 50)
+    {
+      queue.enqueue(TaskWrapper{ &B, Event_NoTarget{} });
+    }
+  }
+  bool ok = queue.size() == 101 && queue.spilled() == 72 && queue.spilled_total() == 72;
+  size_t handled = 0;
+  for (auto task = queue.try_dequeue(); task.is_valid(); task = queue.try_dequeue())
+  {
+    task.run(0);
+    ++handled;
+    // Spilled batches are paged back and their file chunks reused.
+    if (handled == 60)
+    {
+      queue.enqueue(TaskWrapper{ &A, Event_Trivial{ 101 } });
+    }
+  }
+  return ok && handled == 102 && queue.size() == 0 && queue.spilled() == 0
+    && A.trivial_evt_handled == 101 && A.data_sum == 101 * 102 / 2 && !A.out_of_order
+    && B.no_target_evt_handled == 1;
+}
+
+// Receives completions of I/O submitted to the reactor.
+class IoConsumer
+{
+public:
+  explicit IoConsumer(size_t id) : id_{ id } {}
+  IoConsumer(const IoConsumer&) = delete;
+  IoConsumer(IoConsumer&&) = delete;
+
+  const size_t id_;
+  std::atomic<int> completions{ 0 };
+  std::string last_read;
+  long last_write{ 0 };
+
+  void handle(IoCompletion ev, size_t)
+  {
+    if (ev.op == IoOp::read)
+    {
+      last_read.assign(ev.data.begin(), ev.data.end());
+    }
+    else
+    {
+      last_write = ev.result;
+    }
+    completions.fetch_add(1, std::memory_order_release);
+  }
+};
+
+// A read from an empty pipe waits in epoll until the write submitted after it completes. Regular
+// files are read on a helper thread. Completions are delivered to consumers by id, and the
+// only worker is parked in between instead of spinning.
+bool IoReactorCompletions()
+{
+  EventCatbus<MutexProtectedQueue, 1, 1> catbus;
+  catbus.park_idle_workers(true);
+  IoConsumer reader{ 1 }, writer{ 2 };
+  IoReactor reactor{ make_registry(catbus, reader, writer) };
+  int fds[2];
+  if (pipe(fds) != 0)
+  {
+    return false;
+  }
+  reactor.read(fds[0], 64, 1);
+  // The pipe is switched to non-blocking mode when the read is started.
+  bool read_waits = wait_until([&] { return (fcntl(fds[0], F_GETFL) & O_NONBLOCK) != 0; })
+    && reader.completions.load() == 0;
+  reactor.write(fds[1], std::vector<char>{ 'm', 'e', 'o', 'w' }, 2);
+  bool ok = read_waits && wait_until([&] {
+    return reader.completions.load(std::memory_order_acquire) == 1
+      && writer.completions.load(std::memory_order_acquire) == 1;
+  });
+  ok = ok && reader.last_read == "meow" && writer.last_write == 4;
+  // The pipe gets its blocking mode back once nothing is pending on it.
+  ok = ok && (fcntl(fds[0], F_GETFL) & O_NONBLOCK) == 0 && (fcntl(fds[1], F_GETFL) & O_NONBLOCK) == 0;
+
+  char path[] = "/tmp/catbus_io_XXXXXX";
+  int file = mkstemp(path);
+  unlink(path);
+  ok = ok && file >= 0 && ::write(file, "purr", 4) == 4;
+  reactor.read(file, 16, 1, 0, 0);
+  ok = ok && wait_until([&] { return reader.completions.load(std::memory_order_acquire) == 2; })
+    && reader.last_read == "purr";
+  // Completions for a target without a consumer are counted and dead-lettered.
+  reactor.read(file, 16, 3, 0, 0);
+  ok = ok && wait_until([&] { return reactor.completions() == 4 && reactor.unrouted() == 1; });
+  DeadLetter letter;
+  ok = ok && reactor.dropped() == 0
+    && catbus.dead_letters().try_pop(letter) && letter.target == 3;
+  // So does a pipe with a read still pending when the reactor goes away.
+  {
+    IoReactor abandoned{ make_registry(catbus, reader, writer) };
+    abandoned.read(fds[0], 64, 1);
+    ok = ok && wait_until([&] { return (fcntl(fds[0], F_GETFL) & O_NONBLOCK) != 0; });
+  }
+  ok = ok && (fcntl(fds[0], F_GETFL) & O_NONBLOCK) == 0;
+  close(file);
+  close(fds[0]);
+  close(fds[1]);
+  return ok;
+}
+
+// Depths, high-water marks and worker counters are published to a shared memory page and can be
+// read back with StatsReader, as the catbus_stat tool does from another process.
+bool StatsPageCounters()
+{
+  Consumer_NoId_Waits_NoTargetEvt A;
+  EventCatbus<MutexProtectedQueue, 2, 1> catbus;
+  StatsPublisher<decltype(catbus)> publisher{ catbus, "/catbus_test_stats", 1h };
+  StatsReader reader{ "/catbus_test_stats" };
+  // The only worker is blocked on its primary queue, while tasks pile up in the other one.
+  static_dispatch(catbus, 0, Event_BlockerNoTarget{}, A);
+  if (!wait_until([&] { return A.blocker_received == 1; }))
+  {
+    return false;
+  }
+  for (int i = 0; i < 10; ++i)
+  {
+    static_dispatch(catbus, 1, Event_NoTarget{}, A);
+  }
+  publisher.publish();
+  StatsSnapshot busy;
+  bool ok = reader.read(busy) && busy.queues.size() == 2 && busy.workers.size() == 1
+    && busy.queues[1].depth == 10 && busy.queues[1].high_water == 10
+    && busy.workers[0].tasks == 1;
+  // Published again until the worker is through the queue and has been idle.
+  StatsSnapshot idle;
+  ok = ok && wait_until([&] {
+    publisher.publish();
+    return A.no_target_evt_handled == 10 && reader.read(idle) && idle.workers[0].tasks == 11
+      && idle.workers[0].empty_scans > 0 && idle.workers[0].idle_ns > 0;
+  });
+  return ok && idle.queues[1].depth == 0 && idle.queues[1].high_water == 10
+    && idle.workers[0].steals == 10 && idle.updated_ns > busy.updated_ns
+    && idle.pid == static_cast<uint32_t>(getpid());
+}
+#endif
+
+// Every handled task is recorded with its event type and queue, and exported as Chrome trace
+// events: a span per task on the worker track, and an async span for the time it was queued.
+bool TracingExport()
+{
+  Tracer tracer{ 1 };
+  Consumer_NoId_Waits_NoTargetEvt A;
+  {
+    EventCatbus<MutexProtectedQueue, 2, 1> catbus;
+    static_dispatch(catbus, 0, Event_NoTarget{}, A);
+    if (!wait_until([&] { return A.no_target_evt_handled == 1; }))
+    {
+      return false;
+    }
+    catbus.trace_to(&tracer);
+    for (int i = 0; i < 10; ++i)
+    {
+      static_dispatch(catbus, ROUND_ROBIN, Event_NoTarget{}, A);
+    }
+    // Tasks are recorded after their handler returns.
+    wait_until([&] { return tracer.snapshot(0).size() == 10; });
+  }
+  std::ostringstream json;
+  tracer.write_chrome_json(json);
+  auto text = json.str();
+  auto count = [&text](const std::string& what) {
+    size_t n = 0;
+    for (auto pos = text.find(what); pos != std::string::npos; pos = text.find(what, pos + 1))
+    {
+      ++n;
+    }
+    return n;
+  };
+  size_t recorded = tracer.snapshot(0).size();
+  bool ok = A.no_target_evt_handled == 11 && recorded == 10 && count("\"ph\":\"X\"") == 10
+    && count("\"ph\":\"b\"") == 10 && count("\"ph\":\"e\"") == 10
+    && count("\"name\":\"Event_NoTarget\"") == 30;
+  // Every thread that runs tasks gets a ring of its own, and threads that come after all rings
+  // are taken are counted as lost.
+  Tracer shared{ 2 };
+  InlineCatbus<MutexProtectedQueue> polled;
+  polled.trace_to(&shared);
+  for (int i = 0; i < 6; ++i)
+  {
+    static_dispatch(polled, 0, Event_NoTarget{}, A);
+  }
+  polled.poll(2);
+  std::thread{ [&polled] { polled.poll(2); } }.join();
+  std::thread{ [&polled] { polled.poll(2); } }.join();
+  return ok && shared.threads() == 2 && shared.snapshot(0).size() == 2
+    && shared.snapshot(1).size() == 2 && shared.lost() == 2;
+}
+
 // ENTRY POINT
 
 int main()
@@ -407,11 +1733,90 @@ int main()
   passed = FailedDynDispatchNoId();
   std::cout << "Dynamic dispatch fail because id is not found: " << (passed ? "PASS\n" : "FAIL\n");
 
+  passed = DeadLetterQueueOnMisroute();
+  std::cout << "Dead letter queue on misroute: " << (passed ? "PASS\n" : "FAIL\n");
+
+  passed = TracingExport();
+  std::cout << "Tracing export: " << (passed ? "PASS\n" : "FAIL\n");
+
   passed = SchedulingAndTaskStealing();
   std::cout << "Scheduling and task stealing: " << (passed ? "PASS\n" : "FAIL\n");
 
+  passed = SharedWorkerPoolWeights();
+  std::cout << "Shared worker pool weights: " << (passed ? "PASS\n" : "FAIL\n");
+
+  passed = SharedWorkerPoolDetach();
+  std::cout << "Shared worker pool detach: " << (passed ? "PASS\n" : "FAIL\n");
+
+  passed = BulkDynamicDispatch();
+  std::cout << "Bulk dynamic dispatch: " << (passed ? "PASS\n" : "FAIL\n");
+
+  passed = TypedChannels();
+  std::cout << "Typed channels: " << (passed ? "PASS\n" : "FAIL\n");
+
+  passed = BatchHandlers();
+  std::cout << "Batch handlers: " << (passed ? "PASS\n" : "FAIL\n");
+
+  passed = FusedHandlers();
+  std::cout << "Fused handlers: " << (passed ? "PASS\n" : "FAIL\n");
+
+  passed = RunNextSlot();
+  std::cout << "Run next slot: " << (passed ? "PASS\n" : "FAIL\n");
+
+  passed = DeadlineScheduling();
+  std::cout << "Deadline scheduling: " << (passed ? "PASS\n" : "FAIL\n");
+
+  passed = ShedTasksAreDiscarded();
+  std::cout << "Shed tasks are discarded: " << (passed ? "PASS\n" : "FAIL\n");
+  passed = FairScheduling();
+  std::cout << "Fair scheduling: " << (passed ? "PASS\n" : "FAIL\n");
+
+  passed = BridgeFlowControl();
+  std::cout << "Bridge flow control: " << (passed ? "PASS\n" : "FAIL\n");
+
+  passed = PayloadReturnsToOriginPool();
+  std::cout << "Payload returns to origin pool: " << (passed ? "PASS\n" : "FAIL\n");
+
+  passed = CancelledTasksAreDropped();
+  std::cout << "Cancelled tasks are dropped: " << (passed ? "PASS\n" : "FAIL\n");
+
+  passed = StalledWorkerDetection();
+  std::cout << "Stalled worker detection: " << (passed ? "PASS\n" : "FAIL\n");
+
   passed = NestedBusScheduling();
   std::cout << "Nested bus scheduling: " << (passed ? "PASS\n" : "FAIL\n");
+
+  passed = QueuesWithoutDedicatedWorker();
+  std::cout << "Queues without dedicated worker: " << (passed ? "PASS\n" : "FAIL\n");
+
+  passed = PlacementPolicies();
+  std::cout << "Placement policies: " << (passed ? "PASS\n" : "FAIL\n");
+
+  passed = PinnedConsumers();
+  std::cout << "Pinned consumers: " << (passed ? "PASS\n" : "FAIL\n");
+
+  passed = RebalancePinnedConsumers();
+  std::cout << "Rebalance pinned consumers: " << (passed ? "PASS\n" : "FAIL\n");
+
+  passed = LargeConsumerRegistry();
+  std::cout << "Large consumer registry: " << (passed ? "PASS\n" : "FAIL\n");
+
+#if defined(__linux__)
+  passed = SharedMemoryQueues();
+  std::cout << "Shared memory queues: " << (passed ? "PASS\n" : "FAIL\n");
+
+  passed = JournalReplay();
+  std::cout << "Journal replay: " << (passed ? "PASS\n" : "FAIL\n");
+
+  passed = SpillingQueueKeepsOrder();
+  std::cout << "Spilling queue keeps order: " << (passed ? "PASS\n" : "FAIL\n");
+
+  passed = IoReactorCompletions();
+  std::cout << "I/O reactor completions: " << (passed ? "PASS\n" : "FAIL\n");
+
+  passed = StatsPageCounters();
+  std::cout << "Stats page counters: " << (passed ? "PASS\n" : "FAIL\n");
+#endif
   
   return passed ? 0 : 1;
 }
@@ -0,0 +1,137 @@
+// Small helpers shared by perf_*.cpp benchmarks. Not part of the library.
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <random>
+#include <thread>
+
+namespace bench {
+
+inline uint64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Log-linear histogram in the spirit of HdrHistogram: values below 64 are exact, above that every
+// power of two is split into 32 sub-buckets, which gives ~3% precision over the whole 64-bit
+// range. Recording is a single relaxed increment, so it can be shared by all worker threads.
+class LatencyHistogram {
+public:
+    void record(uint64_t value) {
+        counts_[index(value)].fetch_add(1, std::memory_order_relaxed);
+        auto prev = max_.load(std::memory_order_relaxed);
+        while (value > prev && !max_.compare_exchange_weak(prev, value, std::memory_order_relaxed))
+        {}
+    }
+
+    uint64_t count() const {
+        uint64_t total = 0;
+        for (const auto& c : counts_) {
+            total += c.load(std::memory_order_relaxed);
+        }
+        return total;
+    }
+
+    // Returns the highest value equivalent to the given percentile (0..100).
+    uint64_t percentile(double p) const {
+        uint64_t total = count();
+        if (total == 0) {
+            return 0;
+        }
+        uint64_t rank = static_cast<uint64_t>(p / 100.0 * total + 0.5);
+        rank = rank == 0 ? 1 : rank;
+        uint64_t seen = 0;
+        for (size_t i = 0; i < kBuckets; ++i) {
+            seen += counts_[i].load(std::memory_order_relaxed);
+            if (seen >= rank) {
+                auto v = highest_equivalent(i);
+                auto m = max();
+                return v < m ? v : m;
+            }
+        }
+        return max();
+    }
+
+    uint64_t max() const {
+        return max_.load(std::memory_order_relaxed);
+    }
+
+    void reset() {
+        for (auto& c : counts_) {
+            c.store(0, std::memory_order_relaxed);
+        }
+        max_.store(0, std::memory_order_relaxed);
+    }
+
+private:
+    static constexpr size_t kBuckets = 64 + 58 * 32;
+
+    static size_t index(uint64_t v) {
+        if (v < 64) {
+            return v;
+        }
+        unsigned e = 63 - __builtin_clzll(v);
+        unsigned shift = e - 5;
+        return 64 + (shift - 1) * 32 + ((v >> shift) - 32);
+    }
+
+    static uint64_t highest_equivalent(size_t idx) {
+        if (idx < 64) {
+            return idx;
+        }
+        size_t shift = (idx - 64) / 32 + 1;
+        uint64_t top = (idx - 64) % 32 + 32;
+        return ((top + 1) << shift) - 1;
+    }
+
+    std::array<std::atomic<uint64_t>, kBuckets> counts_{};
+    std::atomic<uint64_t> max_{0};
+};
+
+// Send times of an open-loop load generator: a fixed interval, or exponentially distributed gaps
+// (Poisson arrivals) with the same mean. The times don't depend on how fast events are handled,
+// so latency measured from them includes the time an event couldn't even be sent, which is what
+// corrects for coordinated omission.
+class OpenLoopSchedule {
+public:
+    OpenLoopSchedule(double events_per_second, bool poisson, uint64_t start_ns, unsigned seed = 1)
+      : mean_gap_ns_{1e9 / events_per_second}, poisson_{poisson}, next_ns_{double(start_ns)},
+        random_{seed}
+    {}
+
+    // Returns the intended send time of the next event.
+    uint64_t next() {
+        auto result = static_cast<uint64_t>(next_ns_);
+        if (poisson_) {
+            next_ns_ += -std::log(1.0 - uniform_(random_)) * mean_gap_ns_;
+        } else {
+            next_ns_ += mean_gap_ns_;
+        }
+        return result;
+    }
+
+private:
+    double mean_gap_ns_;
+    bool poisson_;
+    double next_ns_;
+    std::mt19937_64 random_;
+    std::uniform_real_distribution<double> uniform_{0.0, 1.0};
+};
+
+// Sleeps most of the way and yields the rest, sleep alone is too coarse for microsecond gaps.
+inline void wait_until_ns(uint64_t deadline) {
+    for (auto now = now_ns(); now < deadline; now = now_ns()) {
+        if (deadline - now > 200'000) {
+            std::this_thread::sleep_for(std::chrono::nanoseconds(deadline - now - 100'000));
+        } else {
+            std::this_thread::yield();
+        }
+    }
+}
+
+}; // namespace bench
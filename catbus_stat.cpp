@@ -0,0 +1,69 @@
+// Watches a bus published with StatsPublisher: prints queue depths and what every worker did
+// since the previous sample.
+//
+// Usage: catbus_stat <name> [interval_ms] [samples]
+// Runs until interrupted when the number of samples isn't given.
+
+#include "stats_page.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <iostream>
+#include <thread>
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " <name> [interval_ms] [samples]\n";
+        return 2;
+    }
+    const auto interval = std::chrono::milliseconds{argc > 2 ? std::atoi(argv[2]) : 1000};
+    const long samples = argc > 3 ? std::atol(argv[3]) : -1;
+    try {
+        catbus::StatsReader reader{argv[1]};
+        catbus::StatsSnapshot prev;
+        if (!reader.read(prev)) {
+            std::cerr << "No consistent snapshot of " << argv[1] << "\n";
+            return 1;
+        }
+        for (long i = 0; samples < 0 || i < samples; ++i) {
+            std::this_thread::sleep_for(interval);
+            catbus::StatsSnapshot cur;
+            if (!reader.read(cur)) {
+                std::cerr << "No consistent snapshot of " << argv[1] << "\n";
+                return 1;
+            }
+            double elapsed_ns = cur.updated_ns > prev.updated_ns
+                ? static_cast<double>(cur.updated_ns - prev.updated_ns) : 0.0;
+            // Counters are read at different times, so a difference can be off by a bit.
+            auto diff = [](uint64_t cur, uint64_t prev) { return cur > prev ? cur - prev : 0; };
+            std::printf("pid %u\n%6s %12s %12s\n", cur.pid, "queue", "depth", "high-water");
+            for (size_t q = 0; q < cur.queues.size(); ++q) {
+                std::printf("%6zu %12llu %12llu\n", q,
+                    static_cast<unsigned long long>(cur.queues[q].depth),
+                    static_cast<unsigned long long>(cur.queues[q].high_water));
+            }
+            std::printf("%6s %12s %12s %10s %12s %10s %7s\n",
+                "worker", "tasks", "tasks/s", "steals", "empty scans", "cancelled", "idle");
+            for (size_t w = 0; w < cur.workers.size(); ++w) {
+                const auto& c = cur.workers[w];
+                const auto& p = prev.workers[w];
+                double rate = elapsed_ns > 0 ? diff(c.tasks, p.tasks) * 1e9 / elapsed_ns : 0.0;
+                double idle = elapsed_ns > 0 ? diff(c.idle_ns, p.idle_ns) * 100.0 / elapsed_ns : 0.0;
+                std::printf("%6zu %12llu %12.0f %10llu %12llu %10llu %6.1f%%\n", w,
+                    static_cast<unsigned long long>(c.tasks), rate,
+                    static_cast<unsigned long long>(diff(c.steals, p.steals)),
+                    static_cast<unsigned long long>(diff(c.empty_scans, p.empty_scans)),
+                    static_cast<unsigned long long>(diff(c.cancelled, p.cancelled)),
+                    idle > 100.0 ? 100.0 : idle);
+            }
+            std::printf("\n");
+            std::fflush(stdout);
+            prev = std::move(cur);
+        }
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << "\n";
+        return 1;
+    }
+}
@@ -0,0 +1,111 @@
+#pragma once
+
+#include "span.h"
+
+#include <atomic>
+#include <cstddef>
+#include <thread>
+#include <utility>
+
+namespace catbus {
+
+// Compose this into a consumer with the name 'affinity_' to opt into actor mode. After the
+// consumer is pinned with EventCatbus::pin(), all events dispatched to it go to its home queue
+// (whatever queue index was given to the dispatch function), and the bus serves that queue with
+// one worker at a time. So handlers of a pinned consumer never run concurrently and its state
+// can be plain non-atomic fields.
+//
+// The bus may move a consumer to another queue in EventCatbus::rebalance(), but only while no
+// events for it are queued, so the one-worker-at-a-time guarantee holds across moves.
+class QueueAffinity {
+public:
+    static constexpr size_t kUnpinned = static_cast<size_t>(-1);
+
+    QueueAffinity() = default;
+    QueueAffinity(const QueueAffinity&) = delete;
+    QueueAffinity& operator=(const QueueAffinity&) = delete;
+
+    size_t home() const {
+        return home_.load(std::memory_order_acquire);
+    }
+
+    // Called by dispatch functions: registers more queued events and returns the queue they
+    // must go to. If the consumer is being moved right now, waits until the move is done.
+    size_t acquire(size_t events = 1) {
+        if (pending_.fetch_add(events, std::memory_order_acq_rel) & kMoving) {
+            while (pending_.load(std::memory_order_acquire) & kMoving) {
+                std::this_thread::yield();
+            }
+        }
+        return home_.load(std::memory_order_acquire);
+    }
+
+    // Called after the handler returns, with the number of events it handled.
+    void release(size_t events = 1) {
+        // Only one worker runs the consumer at a time, so a plain load and store is enough for
+        // the statistics counter, and it's cheaper than an atomic increment.
+        handled_.store(handled_.load(std::memory_order_relaxed) + events,
+            std::memory_order_relaxed);
+        pending_.fetch_sub(events, std::memory_order_release);
+    }
+
+    // Number of events handled since the previous call, used by the rebalancing heuristic.
+    size_t take_handled() {
+        return handled_.exchange(0, std::memory_order_relaxed);
+    }
+
+    // Moves the consumer to another queue if it has no queued events, otherwise returns false.
+    bool try_move(size_t q) {
+        size_t idle = 0;
+        if (!pending_.compare_exchange_strong(idle, kMoving, std::memory_order_acq_rel)) {
+            return false;
+        }
+        home_.store(q, std::memory_order_release);
+        pending_.fetch_sub(kMoving, std::memory_order_release);
+        return true;
+    }
+
+private:
+    static constexpr size_t kMoving = static_cast<size_t>(1) << (sizeof(size_t) * 8 - 1);
+
+    std::atomic<size_t> home_{kUnpinned};
+    std::atomic<size_t> pending_{0};
+    std::atomic<size_t> handled_{0};
+};
+
+namespace _detail {
+
+    // Handler wrapper stored in tasks of pinned consumers, so the affinity bookkeeping is done
+    // after the real handler returns.
+    template<class Consumer>
+    struct PinnedHandler {
+        Consumer* consumer;
+
+        PinnedHandler* operator->() {
+            return this;
+        }
+
+        template<typename Event>
+        void handle(Event ev, size_t q) {
+            consumer->handle(std::move(ev), q);
+            consumer->affinity_.release();
+        }
+
+        // Only exists when the consumer has a batch handler for the event.
+        template<typename Event, class C = Consumer>
+        auto handle_batch(Span<Event> events, size_t q)
+            -> decltype(std::declval<C&>().handle_batch(events, q), void())
+        {
+            consumer->handle_batch(events, q);
+            consumer->affinity_.release(events.size());
+        }
+
+        // Called instead of handle() when the task is dropped, e.g. cancelled.
+        void discard() {
+            consumer->affinity_.release();
+        }
+    };
+
+}; // namespace _detail
+
+}; // namespace catbus
@@ -0,0 +1,272 @@
+#pragma once
+
+#include "dispatch_utils.h"
+#include "span.h"
+#include "task_wrapper.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+// Forwarding of events from one bus to another with credit-based flow control.
+namespace catbus {
+
+namespace _detail {
+
+    // Gives the credit of a task back to its bridge when the handler returns, or when the task
+    // is dropped without running.
+    template<typename Handler, typename Bridge>
+    struct CreditedHandler {
+        Handler handler;
+        Bridge* bridge;
+
+        CreditedHandler* operator->() {
+            return this;
+        }
+
+        template<typename Event>
+        void handle(Event ev, size_t q) {
+            handler->handle(std::move(ev), q);
+            bridge->release(1);
+        }
+
+        // Only exists when the handler has a batch handler for the event.
+        template<typename Event, class H = Handler>
+        auto handle_batch(Span<Event> events, size_t q)
+            -> decltype(std::declval<H&>()->handle_batch(events, q), void())
+        {
+            handler->handle_batch(events, q);
+            bridge->release(events.size());
+        }
+
+        // Only exists when the handler decides whether its task runs, see cancel.h.
+        template<class H = Handler>
+        auto claim() -> decltype(bool{std::declval<H&>().claim()}) {
+            if (handler.claim()) {
+                return true;
+            }
+            bridge->release(1);
+            return false;
+        }
+
+        void discard() {
+            if constexpr (has_discard<Handler>::value) {
+                handler.discard();
+            }
+            bridge->release(1);
+        }
+    };
+
+    template<typename Bridge>
+    struct CreditWrap {
+        Bridge* bridge;
+
+        template<typename Handler>
+        CreditedHandler<Handler, Bridge> operator()(Handler handler) const {
+            return {handler, bridge};
+        }
+    };
+
+    // True if a task forwarded through the bridge to the consumer can carry the event: the
+    // wrapper adds the bridge pointer to the handler.
+    template<typename Event, class Consumer, typename Bridge>
+    constexpr bool fits_bridged = TaskWrapper::fits<CreditedHandler<std::conditional_t<
+        has_affinity<Consumer>::value, PinnedHandler<Consumer>, Consumer*>, Bridge>, Event>;
+
+    // What send_task() sends to, so that only tasks with credited handlers get into the bridge.
+    template<typename Bridge>
+    struct BridgeSink {
+        Bridge& bridge;
+
+        void send(TaskWrapper task, size_t q) {
+            bridge.push(std::move(task), q);
+        }
+    };
+
+}; // namespace _detail
+
+// Connects a producer, usually the handlers of an upstream bus, to a downstream bus, and keeps
+// the downstream queues bounded. The bridge holds Credits: every event sent downstream takes one,
+// and its handler gives it back when it returns, or the task does when it is dropped without
+// running, e.g. shed by a DeadlineQueue. While credits last, events go to the bus right away;
+// when they run out, events wait in the bridge in the order they were sent, and go to the bus in
+// batches with one send_bulk() call as credits come back. If Buffer events are waiting, senders
+// block until there is room, so a fast upstream stage slows down to the pace of the downstream
+// one instead of filling its queues or memory. Use one bridge per edge of a multi-stage topology.
+//
+//     BusBridge<Bus> bridge;
+//     Bus downstream;
+//     bridge.connect(downstream);
+//     static_dispatch_bridged(bridge, ROUND_ROBIN, Event{...}, consumers...);
+//
+// Tasks in the downstream queues point to the bridge, so it must outlive the bus: declare it
+// first and connect() it afterwards. Credits should not exceed the capacity of the downstream
+// queues, so that forwarding never waits for a full queue, and a downstream handler must not
+// send back through a bridge that leads to its own bus, or the two can wait for each other. The
+// handler wrapper takes more of the task than a bare handler, so events must be smaller, see
+// fits_bridged.
+template<typename Downstream, size_t Credits = 1024, size_t Buffer = 65536>
+class BusBridge {
+    static_assert(Credits > 0 && Buffer > 0, "Bridge needs credits and room for events.");
+public:
+    BusBridge() = default;
+
+    explicit BusBridge(Downstream& bus)
+      : bus_{&bus}
+    {}
+
+    BusBridge(const BusBridge&) = delete;
+    BusBridge& operator=(const BusBridge&) = delete;
+
+    void connect(Downstream& bus) {
+        bus_ = &bus;
+    }
+
+    Downstream& downstream() {
+        return *bus_;
+    }
+
+    // Credits left, i.e. how many more events can go downstream before they have to wait.
+    size_t credits() const {
+        return credits_.load(std::memory_order_relaxed);
+    }
+
+    // Events waiting for credits.
+    size_t waiting() const {
+        return waiting_.load(std::memory_order_relaxed);
+    }
+
+    // Called by the handlers of forwarded events, and when such events are dropped.
+    void release(size_t n) {
+        // Sequentially consistent, like the store of 'waiting_' in push() and the loads in
+        // flush(): either this sees the event waiting, or the flusher sees the credit.
+        auto credits = credits_.fetch_add(n) + n;
+        // Waiting events are sent when enough credits are back to make a batch, the last handler
+        // to return always finds all of them back.
+        if (waiting_.load() != 0 && credits >= kBatch) {
+            flush();
+        }
+    }
+
+    _detail::CreditWrap<BusBridge> wrap() {
+        return {this};
+    }
+
+    // Used by send_task() through BridgeSink. Blocks while Buffer events are waiting.
+    void push(TaskWrapper task, size_t q) {
+        {
+            auto lock = std::unique_lock<std::mutex>{ access_ };
+            space_.wait(lock, [this] { return pending_.size() < Buffer; });
+            pending_.push_back(Pending{std::move(task), q});
+            waiting_.store(pending_.size());
+        }
+        flush();
+    }
+
+private:
+    static constexpr size_t kBatch = Credits < TaskWrapper::kMaxBatch
+        ? Credits : TaskWrapper::kMaxBatch;
+
+    struct Pending {
+        TaskWrapper task;
+        size_t q;
+    };
+
+    // Sends as many waiting events as there are credits. One thread at a time sends, so the
+    // events keep their order; a thread that finds another one sending leaves its credits to it,
+    // and the sender looks again after it is done. The lock is only held to take events out, so
+    // a downstream queue that makes send() wait doesn't hold up producers and handlers.
+    void flush() {
+        while (!flushing_.exchange(true)) {
+            while (send_batch()) {}
+            flushing_.store(false);
+            if (waiting_.load() == 0 || credits_.load() == 0) {
+                return;
+            }
+        }
+    }
+
+    // Takes up to a batch of waiting events for the same queue, as many as there are credits,
+    // and sends them with one send_bulk() call. Returns false if there was nothing to send.
+    bool send_batch() {
+        std::array<TaskWrapper, TaskWrapper::kMaxBatch> batch;
+        size_t k = 0;
+        size_t q = 0;
+        bool was_full = false;
+        {
+            auto lock = std::unique_lock<std::mutex>{ access_ };
+            // Only the flusher takes credits, so they can't go below this.
+            const auto credits = credits_.load();
+            const size_t n = std::min({pending_.size(), credits, batch.size()});
+            if (n == 0) {
+                return false;
+            }
+            was_full = pending_.size() >= Buffer;
+            q = pending_.front().q;
+            while (k < n && pending_.front().q == q) {
+                batch[k++] = std::move(pending_.front().task);
+                pending_.pop_front();
+            }
+            credits_.fetch_sub(k);
+            waiting_.store(pending_.size());
+        }
+        if (was_full) {
+            space_.notify_all();
+        }
+        if (k == 1) {
+            bus_->send(std::move(batch[0]), q);
+        } else {
+            bus_->send_bulk(batch.data(), k, q);
+        }
+        return true;
+    }
+
+    Downstream* bus_{nullptr};
+    alignas(64) std::atomic<size_t> credits_{Credits};
+    std::atomic<size_t> waiting_{0};
+    std::atomic_bool flushing_{};
+    std::deque<Pending> pending_;
+    std::mutex access_;
+    std::condition_variable space_;
+};
+
+// Counterparts of static_dispatch() and try_dynamic_dispatch() which forward the event through
+// the bridge to consumers on its downstream bus.
+
+template<typename Bridge, typename Event, class... Consumers>
+void static_dispatch_bridged(Bridge& bridge, size_t q, Event ev, Consumers&... args) {
+    constexpr auto consumer_idx = find_handler_idx<Event, Consumers...>();
+    static_assert(std::tuple_size<std::tuple<Consumers...>>::value > consumer_idx,
+        "Handler not found!");
+    static_assert((_detail::fits_bridged<Event, Consumers, Bridge> && ...),
+        "Event is too big for a bridged task!");
+    std::tuple<Consumers&...> list{ args... };
+    _detail::BridgeSink<Bridge> sink{bridge};
+    _detail::send_task(sink, q, std::move(ev), std::get<consumer_idx>(list), bridge.wrap());
+}
+
+// Unroutable events go to the dead letter queue of the downstream bus.
+template<typename Bridge, typename Event, class... Consumers>
+dispatch_status try_dynamic_dispatch_bridged(Bridge& bridge, size_t q, Event ev,
+    Consumers&... consumers)
+{
+    static_assert(has_target<Event>::value, "Event does not have 'size_t target' member.");
+    static_assert((_detail::fits_bridged<Event, Consumers, Bridge> && ...),
+        "Event is too big for a bridged task!");
+    _detail::BridgeSink<Bridge> sink{bridge};
+    if ((route_event(sink, q, ev, consumers, bridge.wrap()) || ...)) {
+        return dispatch_status::delivered;
+    }
+    auto target = ev.target;
+    return bridge.downstream().dead_letters().push(target, std::move(ev))
+        ? dispatch_status::dead_lettered : dispatch_status::dropped;
+}
+
+}; // namespace catbus
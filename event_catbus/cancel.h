@@ -0,0 +1,326 @@
+#pragma once
+
+#include "dispatch_utils.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Cancellation of queued events. A cancelled task stays in its queue, and the worker that takes
+// it out drops it without calling the handler, so cancelling costs one atomic operation and
+// never searches the queues.
+namespace catbus {
+
+namespace _detail {
+
+    // Flag of one cancellable task. The generation is bumped exactly once per use, either by
+    // the worker claiming the task to run it or by cancel(), and whoever bumps it returns the
+    // flag to the pool. Stale handles and tasks see a different generation.
+    struct alignas(64) CancelSlot {
+        std::atomic<uint64_t> generation{0};
+    };
+
+    // Process-wide pool of flags, which are never freed, so a handle stays safe to use after its
+    // task is gone. Each thread keeps a cache of free flags and exchanges them with the shared
+    // list in batches: flags are usually taken by producers and given back by workers.
+    class CancelPool {
+    public:
+        static CancelPool& instance() {
+            static CancelPool pool;
+            return pool;
+        }
+
+        CancelSlot* acquire() {
+            auto& free = cache().free;
+            if (free.empty()) {
+                refill(free);
+            }
+            auto* slot = free.back();
+            free.pop_back();
+            return slot;
+        }
+
+        void release(CancelSlot* slot) {
+            auto& free = cache().free;
+            free.push_back(slot);
+            if (free.size() >= 2 * kBatch) {
+                auto lock = std::unique_lock<std::mutex>{ access_ };
+                free_.insert(free_.end(), free.end() - kBatch, free.end());
+                free.resize(free.size() - kBatch);
+            }
+        }
+
+    private:
+        static constexpr size_t kBatch = 256;
+        static constexpr size_t kChunk = 1024;
+
+        struct Cache {
+            // Makes sure the pool is destroyed after the caches.
+            Cache() : pool{instance()} {}
+
+            ~Cache() {
+                auto lock = std::unique_lock<std::mutex>{ pool.access_ };
+                pool.free_.insert(pool.free_.end(), free.begin(), free.end());
+            }
+
+            CancelPool& pool;
+            std::vector<CancelSlot*> free;
+        };
+
+        static Cache& cache() {
+            static thread_local Cache cache;
+            return cache;
+        }
+
+        void refill(std::vector<CancelSlot*>& free) {
+            auto lock = std::unique_lock<std::mutex>{ access_ };
+            if (free_.empty()) {
+                chunks_.push_back(std::make_unique<CancelSlot[]>(kChunk));
+                for (size_t i = 0; i < kChunk; ++i) {
+                    free_.push_back(&chunks_.back()[i]);
+                }
+            }
+            auto take = std::min(kBatch, free_.size());
+            free.insert(free.end(), free_.end() - take, free_.end());
+            free_.resize(free_.size() - take);
+        }
+
+        std::mutex access_;
+        std::vector<CancelSlot*> free_;
+        std::vector<std::unique_ptr<CancelSlot[]>> chunks_;
+    };
+
+    // Handler wrapper stored in cancellable tasks. With a pooled flag the task claims it, so a
+    // task either runs or is cancelled, never both. With a token the task only compares the
+    // epoch, which is bumped for every task sent with the token at once.
+    template<class Handler, bool Pooled>
+    struct CancellableHandler {
+        Handler handler;
+        std::atomic<uint64_t>* epoch;
+        uint64_t expected;
+
+        CancellableHandler* operator->() {
+            return this;
+        }
+
+        template<typename Event>
+        void handle(Event ev, size_t q) {
+            handler->handle(std::move(ev), q);
+        }
+
+        bool claim() {
+            bool run;
+            if constexpr (Pooled) {
+                run = epoch->compare_exchange_strong(expected, expected + 1,
+                    std::memory_order_acq_rel, std::memory_order_relaxed);
+                if (run) {
+                    CancelPool::instance().release(slot());
+                }
+            } else {
+                run = epoch->load(std::memory_order_acquire) == expected;
+            }
+            if constexpr (has_discard<Handler>::value) {
+                if (!run) {
+                    handler.discard();
+                }
+            }
+            return run;
+        }
+
+        // The task is dropped without being claimed, so its flag is retired here unless it was
+        // cancelled already.
+        void discard() {
+            if constexpr (Pooled) {
+                if (epoch->compare_exchange_strong(expected, expected + 1,
+                    std::memory_order_acq_rel, std::memory_order_relaxed))
+                {
+                    CancelPool::instance().release(slot());
+                }
+            }
+            if constexpr (has_discard<Handler>::value) {
+                handler.discard();
+            }
+        }
+
+        CancelSlot* slot() const {
+            return reinterpret_cast<CancelSlot*>(epoch);
+        }
+    };
+
+    template<bool Pooled>
+    struct CancelWrap {
+        std::atomic<uint64_t>* epoch;
+        uint64_t expected;
+
+        template<typename Handler>
+        CancellableHandler<Handler, Pooled> operator()(Handler handler) const {
+            return {handler, epoch, expected};
+        }
+    };
+
+    // True if a cancellable task for the consumer can carry the event: the wrapper adds the
+    // flag and the generation to the handler, which leaves less room than a plain task has.
+    template<typename Event, class Consumer>
+    constexpr bool fits_cancellable = TaskWrapper::fits<CancellableHandler<std::conditional_t<
+        has_affinity<Consumer>::value, PinnedHandler<Consumer>, Consumer*>, true>, Event>;
+
+}; // namespace _detail
+
+// Returned by the cancellable dispatch functions. Cheap to copy, can be kept after the task ran.
+class CancelHandle {
+public:
+    CancelHandle() = default;
+
+    // Returns true if the task was still queued and now will never run. False if it already
+    // ran, is running, or was cancelled before.
+    bool cancel() {
+        if (slot_ == nullptr) {
+            return false;
+        }
+        auto expected = generation_;
+        if (!slot_->generation.compare_exchange_strong(expected, generation_ + 1,
+            std::memory_order_acq_rel, std::memory_order_relaxed))
+        {
+            return false;
+        }
+        _detail::CancelPool::instance().release(slot_);
+        return true;
+    }
+
+    bool is_valid() const {
+        return slot_ != nullptr;
+    }
+
+private:
+    template<typename Catbus, typename Event, class... Consumers>
+    friend CancelHandle static_dispatch_cancellable(Catbus&, size_t, Event, Consumers&...);
+    template<typename Catbus, typename Event, class... Consumers>
+    friend CancelHandle try_dynamic_dispatch_cancellable(Catbus&, size_t, Event, Consumers&...);
+
+    static CancelHandle acquire() {
+        auto* slot = _detail::CancelPool::instance().acquire();
+        return CancelHandle{slot, slot->generation.load(std::memory_order_relaxed)};
+    }
+
+    CancelHandle(_detail::CancelSlot* slot, uint64_t generation)
+      : slot_{slot}, generation_{generation}
+    {}
+
+    _detail::CancelWrap<true> wrap() const {
+        return {&slot_->generation, generation_};
+    }
+
+    // Gives the flag back when the task was not sent after all.
+    void discard() {
+        cancel();
+        slot_ = nullptr;
+    }
+
+    _detail::CancelSlot* slot_{nullptr};
+    uint64_t generation_{0};
+};
+
+// Cancels a group of tasks at once: cancel_all() drops every task sent with the token before
+// the call, and doesn't affect the ones sent after it. The token must outlive the tasks.
+class CancelToken {
+public:
+    CancelToken() = default;
+    CancelToken(const CancelToken&) = delete;
+    CancelToken& operator=(const CancelToken&) = delete;
+
+    void cancel_all() {
+        epoch_.fetch_add(1, std::memory_order_acq_rel);
+    }
+
+    _detail::CancelWrap<false> wrap() const {
+        return {&epoch_, epoch_.load(std::memory_order_relaxed)};
+    }
+
+private:
+    alignas(64) mutable std::atomic<uint64_t> epoch_{0};
+};
+
+// Cancellable counterparts of static_dispatch() and try_dynamic_dispatch(). The handler wrapper
+// takes more of the task than a bare handler, so events must be smaller, see fits_cancellable.
+// Cancellation works within one process, it doesn't follow tasks into shared memory queues.
+
+template<typename Catbus, typename Event, class... Consumers>
+CancelHandle static_dispatch_cancellable(Catbus& bus, size_t q, Event ev, Consumers&... args) {
+    constexpr auto consumer_idx = find_handler_idx<Event, Consumers...>();
+    static_assert(std::tuple_size<std::tuple<Consumers...>>::value > consumer_idx,
+        "Handler not found!");
+    static_assert((_detail::fits_cancellable<Event, Consumers> && ...),
+        "Event is too big for a cancellable task!");
+    std::tuple<Consumers&...> list{ args... };
+    auto handle = CancelHandle::acquire();
+    try {
+        _detail::send_task(bus, q, std::move(ev), std::get<consumer_idx>(list), handle.wrap());
+    }
+    catch (...) {
+        handle.discard();
+        throw;
+    }
+    return handle;
+}
+
+// Returns an invalid handle if no consumer has id_ equal to the target, the event goes to the
+// dead letter queue then, like with try_dynamic_dispatch(). Errors of the queue are thrown, and
+// the flag goes back to the pool.
+template<typename Catbus, typename Event, class... Consumers>
+CancelHandle try_dynamic_dispatch_cancellable(Catbus& bus, size_t q, Event ev,
+    Consumers&... consumers)
+{
+    static_assert(has_target<Event>::value, "Event does not have 'size_t target' member.");
+    static_assert((_detail::fits_cancellable<Event, Consumers> && ...),
+        "Event is too big for a cancellable task!");
+    auto handle = CancelHandle::acquire();
+    try {
+        if ((route_event(bus, q, ev, consumers, handle.wrap()) || ...)) {
+            return handle;
+        }
+    }
+    catch (...) {
+        handle.discard();
+        throw;
+    }
+    handle.discard();
+    auto target = ev.target;
+    bus.dead_letters().push(target, std::move(ev));
+    return handle;
+}
+
+// Same with a token instead of a handle per task, so there is no flag to take from the pool.
+template<typename Catbus, typename Event, class... Consumers>
+void static_dispatch_cancellable(Catbus& bus, size_t q, const CancelToken& token, Event ev,
+    Consumers&... args)
+{
+    constexpr auto consumer_idx = find_handler_idx<Event, Consumers...>();
+    static_assert(std::tuple_size<std::tuple<Consumers...>>::value > consumer_idx,
+        "Handler not found!");
+    static_assert((_detail::fits_cancellable<Event, Consumers> && ...),
+        "Event is too big for a cancellable task!");
+    std::tuple<Consumers&...> list{ args... };
+    _detail::send_task(bus, q, std::move(ev), std::get<consumer_idx>(list), token.wrap());
+}
+
+template<typename Catbus, typename Event, class... Consumers>
+dispatch_status try_dynamic_dispatch_cancellable(Catbus& bus, size_t q, const CancelToken& token,
+    Event ev, Consumers&... consumers)
+{
+    static_assert(has_target<Event>::value, "Event does not have 'size_t target' member.");
+    static_assert((_detail::fits_cancellable<Event, Consumers> && ...),
+        "Event is too big for a cancellable task!");
+    if ((route_event(bus, q, ev, consumers, token.wrap()) || ...)) {
+        return dispatch_status::delivered;
+    }
+    auto target = ev.target;
+    return bus.dead_letters().push(target, std::move(ev))
+        ? dispatch_status::dead_lettered : dispatch_status::dropped;
+}
+
+}; // namespace catbus
@@ -0,0 +1,163 @@
+#pragma once
+
+#include "dispatch_utils.h"
+#include "span.h"
+#include "task_wrapper.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <thread>
+#include <type_traits>
+
+namespace catbus {
+
+// Dense queue for one stream of small plain events to one consumer. A task in a generic queue
+// takes 80 bytes whatever the event, plus the slot's flag; here the ring holds only the events,
+// so a 16-byte event takes 16 bytes, and the slot sequence numbers are 4 bytes each, in a
+// separate array. The consumer is bound once per channel instead of being stored with every
+// event.
+//
+//     TypedChannel<Consumer, Tick> ticks{consumer};
+//     bus.attach_channel(ticks);
+//     ticks.send(Tick{...});
+//
+// Workers of the bus poll attached channels when their primary queue is empty, and before it
+// every few rounds, so that a busy queue doesn't starve the channels. They take up to
+// TaskWrapper::kMaxBatch events at a time; a consumer with a batch handler for the event gets
+// them in one handle_batch() call. Handlers get the primary queue of the worker as the queue
+// index. Events sent through a channel bypass the journal and the tracer of the bus, and the
+// consumer can't be pinned, its handlers run on any worker like those of other tasks.
+//
+// The ring is a bounded multi-producer multi-consumer queue with a sequence number per slot, as
+// described by D. Vyukov. The channel must be attached before the first send, and it must
+// outlive the bus.
+template<class Consumer, typename Event, size_t N = 4096>
+class TypedChannel {
+    static_assert(N > 0 && (N & (N - 1)) == 0, "Channel size must be a power of 2.");
+    static_assert(N <= (static_cast<size_t>(1) << 31), "Channel size must fit the sequences.");
+    static_assert(std::is_trivially_copyable_v<Event> && std::is_default_constructible_v<Event>,
+        "Channel events must be plain data.");
+    static_assert(has_handler<Consumer, Event>::value, "Handler not found!");
+    static_assert(!has_affinity<Consumer>::value, "Pinned consumers can't have channels.");
+public:
+    explicit TypedChannel(Consumer& consumer)
+      : consumer_{consumer}
+    {
+        for (size_t i = 0; i < N; ++i) {
+            sequences_[i].store(static_cast<uint32_t>(i), std::memory_order_relaxed);
+        }
+    }
+
+    TypedChannel(const TypedChannel&) = delete;
+    TypedChannel& operator=(const TypedChannel&) = delete;
+
+    // Returns false if the channel is full.
+    bool try_send(const Event& ev) {
+        uint32_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+        for (;;) {
+            auto& sequence = sequences_[pos & kMask];
+            auto seq = sequence.load(std::memory_order_acquire);
+            auto diff = static_cast<int32_t>(seq - pos);
+            if (diff == 0) {
+                if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    events_[pos & kMask] = ev;
+                    sequence.store(pos + 1, std::memory_order_release);
+                    break;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = enqueue_pos_.load(std::memory_order_relaxed);
+            }
+        }
+        // Workers are only woken when the channel gets its first event: with events before this
+        // one, the sender of the first woke them, and they take the rest before going idle. A
+        // stale read here can miss a wakeup, then a parked worker finds the event on its timeout.
+        if (wake_ && dequeue_pos_.load(std::memory_order_relaxed) == pos) {
+            wake_(bus_);
+        }
+        return true;
+    }
+
+    // Waits while the channel is full, like SimpleLockFreeQueue::enqueue().
+    void send(const Event& ev) {
+        while (!try_send(ev)) {
+            std::this_thread::yield();
+        }
+    }
+
+    bool empty() const {
+        uint32_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+        auto seq = sequences_[pos & kMask].load(std::memory_order_acquire);
+        return static_cast<int32_t>(seq - (pos + 1)) < 0;
+    }
+
+    size_t size() const {
+        auto d = dequeue_pos_.load(std::memory_order_relaxed);
+        auto e = enqueue_pos_.load(std::memory_order_relaxed);
+        auto size = static_cast<int32_t>(e - d);
+        return size > 0 ? static_cast<size_t>(size) : 0;
+    }
+
+    // Called by the bus: takes up to 'budget' events and handles them, returns how many.
+    size_t drain(size_t budget, size_t q) {
+        Event batch[TaskWrapper::kMaxBatch];
+        size_t n = 0;
+        if (budget > TaskWrapper::kMaxBatch) {
+            budget = TaskWrapper::kMaxBatch;
+        }
+        while (n < budget && try_receive(batch[n])) {
+            ++n;
+        }
+        if constexpr (has_batch_handler<Consumer, Event>::value) {
+            if (n > 1) {
+                consumer_.handle_batch(Span<Event>{batch, n}, q);
+                return n;
+            }
+        }
+        for (size_t i = 0; i < n; ++i) {
+            consumer_.handle(batch[i], q);
+        }
+        return n;
+    }
+
+    // Called by the bus in EventCatbus::attach_channel(), so that senders wake idle workers.
+    void bind(void* bus, void (*wake)(void* bus)) {
+        bus_ = bus;
+        wake_ = wake;
+    }
+
+private:
+    static constexpr uint32_t kMask = static_cast<uint32_t>(N - 1);
+
+    bool try_receive(Event& ev) {
+        uint32_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+        for (;;) {
+            auto& sequence = sequences_[pos & kMask];
+            auto seq = sequence.load(std::memory_order_acquire);
+            auto diff = static_cast<int32_t>(seq - (pos + 1));
+            if (diff == 0) {
+                if (dequeue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    ev = events_[pos & kMask];
+                    sequence.store(pos + static_cast<uint32_t>(N), std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = dequeue_pos_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    Consumer& consumer_;
+    void* bus_{nullptr};
+    void (*wake_)(void* bus){nullptr};
+    alignas(64) std::atomic<uint32_t> enqueue_pos_{0};
+    alignas(64) std::atomic<uint32_t> dequeue_pos_{0};
+    alignas(64) Event events_[N];
+    alignas(64) std::atomic<uint32_t> sequences_[N];
+};
+
+}; // namespace catbus
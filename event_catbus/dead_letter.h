@@ -0,0 +1,109 @@
+#pragma once
+
+#include "task_wrapper.h"
+
+#include <atomic>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <utility>
+
+namespace catbus {
+
+namespace _detail {
+
+    // Handler type of dead letter tasks. Running such task just discards the event.
+    struct DeadLetterTag {
+        DeadLetterTag* operator->() {
+            return this;
+        }
+
+        template<typename Event>
+        void handle(Event, size_t) {}
+    };
+
+}; // namespace _detail
+
+// Event that could not be routed, because no consumer had id_ equal to its target.
+struct DeadLetter {
+    size_t target{};
+    TaskWrapper task;
+
+    // Returns the event if it has given type, so it can be inspected or dispatched again.
+    template<typename Event>
+    Event* event() {
+        auto* p = task.template target<_detail::DeadLetterTag, Event>();
+        return p ? &p->second : nullptr;
+    }
+};
+
+// Every EventCatbus has one of these. Non-throwing dispatch functions put unroutable events here
+// instead of throwing dispatch_error, so a misrouted event sent from a handler never unwinds
+// through a worker thread. Capacity is configurable; when it's reached, or when it is set to 0,
+// unroutable events are only counted and dropped.
+class DeadLetterQueue {
+public:
+    explicit DeadLetterQueue(size_t capacity = 1024)
+      : capacity_{capacity}
+    {}
+
+    void set_capacity(size_t capacity) {
+        auto lock = std::unique_lock<std::mutex>{ access_ };
+        capacity_ = capacity;
+        while (letters_.size() > capacity_) {
+            letters_.pop_front();
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    // Returns false if the event was dropped.
+    template<typename Event>
+    bool push(size_t target, Event&& ev) noexcept {
+        misrouted_.fetch_add(1, std::memory_order_relaxed);
+        auto lock = std::unique_lock<std::mutex>{ access_ };
+        if (letters_.size() < capacity_) {
+            try {
+                letters_.push_back(DeadLetter{
+                    target, TaskWrapper{_detail::DeadLetterTag{}, std::forward<Event>(ev)}});
+                return true;
+            }
+            catch (...) {
+            }
+        }
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    bool try_pop(DeadLetter& letter) {
+        auto lock = std::unique_lock<std::mutex>{ access_ };
+        if (letters_.empty()) {
+            return false;
+        }
+        letter = std::move(letters_.front());
+        letters_.pop_front();
+        return true;
+    }
+
+    size_t size() const {
+        auto lock = std::unique_lock<std::mutex>{ access_ };
+        return letters_.size();
+    }
+
+    // Total number of unroutable events, including dropped ones.
+    size_t misrouted() const {
+        return misrouted_.load(std::memory_order_relaxed);
+    }
+
+    size_t dropped() const {
+        return dropped_.load(std::memory_order_relaxed);
+    }
+
+private:
+    std::deque<DeadLetter> letters_;
+    size_t capacity_;
+    mutable std::mutex access_;
+    std::atomic<size_t> misrouted_{0};
+    std::atomic<size_t> dropped_{0};
+};
+
+}; // namespace catbus
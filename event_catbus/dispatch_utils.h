@@ -24,13 +24,19 @@ SOFTWARE.
 
 #pragma once
 
+#include "affinity.h"
 #include "event_bus.h"
 #include "exception.h"
+#include "span.h"
 #include "task_wrapper.h"
 
+#include <algorithm>
+#include <array>
+#include <cstdint>
 #include <tuple>
 #include <type_traits>
 #include <utility>
+#include <vector>
 
 // This header contains utility methods for dispatching events to proper consumers based on the
 // handlers they are providing and potentially also target vs. id_ comparison.
@@ -38,6 +44,13 @@ namespace catbus {
 
 constexpr size_t ROUND_ROBIN = -1; 
 
+// Result of non-throwing dispatch functions.
+enum class dispatch_status {
+    delivered,      // event was sent to a consumer
+    dead_lettered,  // no consumer found, event was put into the bus dead letter queue
+    dropped         // no consumer found and dead letter queue is full
+};
+
 //--------------------- SFINAE event handler detector
 
 // Check if class T has method 'T::handle(Event evt)' to process event of specific type.
@@ -53,6 +66,17 @@ struct has_handler<T, Event, void_t<
     decltype(std::declval<T>().handle(std::declval<Event>(), size_t{}))>
 > : std::true_type {};
 
+//--------------------- SFINAE batch handler detector
+
+// Check if class T has method 'T::handle_batch(Span<Event> events, size_t q)'. A worker which
+// takes a task for such consumer also takes the tasks right behind it in the queue that carry
+// the same event type to the same consumer, up to TaskWrapper::kMaxBatch of them, and passes all
+// their events in one call. Dispatch still looks for 'handle(Event, size_t)', and it is called
+// for single tasks, so the consumer needs both. Cancellable tasks are never batched.
+
+template<class T, class Event>
+struct has_batch_handler : _detail::has_batch_handler<T*, Event> {};
+
 //--------------------- SFINAE event target id detector
 
 // Check if type Event has member 'size_t target'.
@@ -65,6 +89,14 @@ struct has_target<Event, void_t<std::enable_if_t<
     std::is_same_v<decltype(Event::target), size_t>>>
 > : std::true_type {};
 
+//--------------------- SFINAE event deadline detector
+
+// Check if type Event has member 'uint64_t deadline_ns', a time on the steady clock in
+// nanoseconds, see deadline_after(). DeadlineQueue serves such events earliest deadline first.
+
+template<class Event>
+struct has_deadline : _detail::has_deadline<Event> {};
+
 //--------------------- SFINAE consumer id detector
 
 // Check if type Consumer has member 'const size_t id_'.
@@ -89,16 +121,83 @@ struct has_sender<Consumer, void_t<std::enable_if_t<
     std::is_member_object_pointer<decltype(&Consumer::sender_)>::value>>
 > : std::true_type {};
 
+//--------------------- SFINAE queue affinity detector
+
+// Check if type Consumer has member 'QueueAffinity affinity_'.
+
+template<class Consumer, class = void>
+struct has_affinity : std::false_type {};
+
+template<class Consumer>
+struct has_affinity<Consumer, void_t<std::enable_if_t<
+    std::is_same_v<decltype(Consumer::affinity_), QueueAffinity>>>
+> : std::true_type {};
+
+//--------------------- Fused handlers
+
+// Specialise 'fused_event<Event>' as std::true_type to have every handler of Event called inline
+// by the handler that sends it, on the same worker, instead of going through a queue round trip,
+// or 'fused_handler<Event, Consumer>' to fuse only the handler of that consumer:
+//
+//     template<> struct catbus::fused_handler<Medium, MediumConsumer> : std::true_type {};
+//
+// A linear chain of consumers then runs as one sequence of calls. The bus decides at every send
+// whether to fuse, see EventCatbus::try_fuse(); when it doesn't, the event is sent as usual.
+// Sends from outside the bus's workers, pinned consumers and cancellable sends are never fused.
+// Fused handlers run inside the sending handler, so they must not rely on the sender's state
+// being final, and nothing else runs on the worker until the whole chain returns.
+
+template<class Event>
+struct fused_event : std::false_type {};
+
+template<class Event, class Consumer>
+struct fused_handler : fused_event<Event> {};
+
+//--------------------- Task sending helper
+
+namespace _detail {
+
+    // Default handler wrapper for send_task(), leaves the handler as it is.
+    struct NoWrap {
+        template<typename Handler>
+        Handler operator()(Handler handler) const {
+            return handler;
+        }
+    };
+
+    // Wraps event into a task for the given consumer and sends it, or runs the handler inline if
+    // it is fused and the bus agrees. Pinned consumers override the
+    // queue index with their home queue. 'wrap' can put the handler into another one, like
+    // CancellableHandler, see cancel.h.
+    template <typename Catbus, typename Event, class Consumer, class Wrap = NoWrap>
+    inline void send_task(Catbus& bus, size_t q, Event&& ev, Consumer& c, const Wrap& wrap = {}) {
+        if constexpr (fused_handler<std::decay_t<Event>, Consumer>::value
+            && !has_affinity<Consumer>::value && std::is_same_v<Wrap, NoWrap>)
+        {
+            if (bus.try_fuse(q, [&](size_t primary) { c.handle(std::move(ev), primary); })) {
+                return;
+            }
+        }
+        if constexpr (has_affinity<Consumer>::value) {
+            q = c.affinity_.acquire();
+            bus.send(TaskWrapper{wrap(PinnedHandler<Consumer>{&c}), std::move(ev)}, q);
+        } else {
+            bus.send(TaskWrapper{wrap(&c), std::move(ev)}, q);
+        }
+    }
+
+}; // namespace _detail
+
 //--------------------- SFINAE handler caller for specific target
 
 // This function will instantiate for classes, that have handler given event.
-template <typename Catbus, typename Event, class Consumer>
-inline bool route_event(Catbus& bus, size_t q, Event& ev, Consumer& c) {
+template <typename Catbus, typename Event, class Consumer, class Wrap = _detail::NoWrap>
+inline bool route_event(Catbus& bus, size_t q, Event& ev, Consumer& c, const Wrap& wrap = {}) {
     if constexpr (has_handler<Consumer, Event>::value && has_id<Consumer>::value) {
         if (c.id_ != ev.target) {
             return false;
         }
-        bus.send(TaskWrapper{&c, std::move(ev)}, q);
+        _detail::send_task(bus, q, std::move(ev), c, wrap);
         return true;
     }
     return false;
@@ -124,20 +223,195 @@ void dynamic_dispatch(Catbus& bus, size_t q, Event ev, Consumer& c, Consumers&..
     }
 }
 
-//--------------------- Static dispatch helper
+// Non-throwing version of dynamic_dispatch(). If no consumer has id_ equal to target, the event
+// goes to the bus dead letter queue, so misrouting costs a counter increment and a push instead
+// of an exception unwinding through the worker thread. Only misrouting is reported this way:
+// errors of the queue itself, like SharedMemoryQueue rejecting a task or std::bad_alloc, are
+// still thrown by send().
+template <typename Catbus, typename Event, class ...Consumers>
+dispatch_status try_dynamic_dispatch(Catbus& bus, size_t q, Event ev, Consumers&... consumers) {
+    static_assert(has_target<Event>::value, "Event does not have 'size_t target' member.");
+    if ((route_event(bus, q, ev, consumers) || ...)) {
+        return dispatch_status::delivered;
+    }
+    auto target = ev.target;
+    return bus.dead_letters().push(target, std::move(ev))
+        ? dispatch_status::dead_lettered : dispatch_status::dropped;
+}
+
+//--------------------- Bulk dispatcher for targeted events
+
+namespace _detail {
+
+    constexpr size_t kNoId = static_cast<size_t>(-1);
+
+    // Tasks try_dynamic_dispatch_bulk() passes to one send_bulk() call.
+    constexpr size_t kBulkChunk = 256;
+
+    // Id of the consumer if it takes events of the type, kNoId otherwise.
+    template<typename Event, class Consumer>
+    size_t routable_id(const Consumer& c) {
+        if constexpr (has_handler<Consumer, Event>::value && has_id<Consumer>::value) {
+            return c.id_;
+        } else {
+            return kNoId;
+        }
+    }
+
+    // Maps targets to positions of consumers in the pack; position 'count' stands for events no
+    // consumer takes. When ids are small, as they usually are, the map is a plain table and
+    // a lookup is a bounds check and a load without branches, otherwise it's a binary search.
+    // If several consumers have the same id, the first one gets the events, as with
+    // try_dynamic_dispatch().
+    class TargetIndex {
+    public:
+        // Tables for ids below this, or below the number of events, are always built.
+        static constexpr size_t kDirectLimit = 65536;
+
+        TargetIndex(const size_t* ids, size_t count, size_t events)
+          : none_{static_cast<uint32_t>(count)}
+        {
+            size_t max_id = 0;
+            for (size_t i = 0; i < count; ++i) {
+                if (ids[i] != kNoId) {
+                    max_id = std::max(max_id, ids[i]);
+                }
+            }
+            if (max_id < std::max(kDirectLimit, events)) {
+                direct_.assign(max_id + 1, none_);
+                for (size_t i = count; i-- > 0;) {
+                    if (ids[i] != kNoId) {
+                        direct_[ids[i]] = static_cast<uint32_t>(i);
+                    }
+                }
+            } else {
+                for (size_t i = 0; i < count; ++i) {
+                    if (ids[i] != kNoId) {
+                        sorted_.emplace_back(ids[i], static_cast<uint32_t>(i));
+                    }
+                }
+                std::stable_sort(sorted_.begin(), sorted_.end(),
+                    [](const auto& a, const auto& b) { return a.first < b.first; });
+            }
+        }
 
-// This function is needed to break recursion in compile-time, but it will be selected only
-// when no handlers are found in parameter pack, so compilation will break. There is static assert
-// using this return value to generate conscious error message.
-template<typename Event>
-constexpr size_t find_handler_idx(size_t idx) {
-    return idx;
+        template<typename Event>
+        void find_all(Span<Event> events, uint32_t* positions) const {
+            if (!direct_.empty()) {
+                const uint32_t* table = direct_.data();
+                const size_t size = direct_.size();
+                for (size_t i = 0; i < events.size(); ++i) {
+                    const size_t target = events[i].target;
+                    positions[i] = target < size ? table[target] : none_;
+                }
+                return;
+            }
+            for (size_t i = 0; i < events.size(); ++i) {
+                const size_t target = events[i].target;
+                auto it = std::lower_bound(sorted_.begin(), sorted_.end(), target,
+                    [](const auto& entry, size_t id) { return entry.first < id; });
+                positions[i] = it != sorted_.end() && it->first == target ? it->second : none_;
+            }
+        }
+
+    private:
+        uint32_t none_;
+        std::vector<uint32_t> direct_;
+        std::vector<std::pair<size_t, uint32_t>> sorted_;
+    };
+
+    // Sends events[order[0..n)] to the consumer as one run.
+    template<typename Catbus, typename Event, class Consumer>
+    void send_run(Catbus& bus, size_t q, Span<Event> events, const size_t* order, size_t n,
+        Consumer& c, std::vector<TaskWrapper>& tasks)
+    {
+        if constexpr (has_handler<Consumer, Event>::value && has_id<Consumer>::value) {
+            if (n == 0) {
+                return;
+            }
+            if constexpr (has_affinity<Consumer>::value) {
+                q = c.affinity_.acquire(n);
+            } else {
+                // All chunks of the run go to the same queue.
+                q = bus.place(q);
+            }
+            // Tasks are built in chunks which stay in cache until the queue takes them.
+            for (size_t done = 0; done < n;) {
+                const size_t chunk = std::min(n - done, kBulkChunk);
+                tasks.clear();
+                for (size_t i = done; i < done + chunk; ++i) {
+                    if constexpr (has_affinity<Consumer>::value) {
+                        tasks.emplace_back(PinnedHandler<Consumer>{&c},
+                            std::move(events[order[i]]));
+                    } else {
+                        tasks.emplace_back(&c, std::move(events[order[i]]));
+                    }
+                }
+                bus.send_bulk(tasks.data(), chunk, q);
+                done += chunk;
+            }
+        }
+    }
+
+}; // namespace _detail
+
+// Sends many events with targets at once, with the same routing as try_dynamic_dispatch(). The
+// events are partitioned by consumer in one counting sort pass over the array, then the events
+// of each consumer go to the bus as one run with EventCatbus::send_bulk(), in their original
+// order. Events no consumer takes go to the dead letter queue. Returns the number of events
+// delivered. The events are moved from.
+template <typename Catbus, typename Event, class ...Consumers>
+size_t try_dynamic_dispatch_bulk(Catbus& bus, size_t q, Span<Event> events,
+    Consumers&... consumers)
+{
+    static_assert(has_target<Event>::value, "Event does not have 'size_t target' member.");
+    static_assert(sizeof...(Consumers) > 0, "No consumers given.");
+    constexpr size_t count = sizeof...(Consumers);
+    const size_t ids[] = { _detail::routable_id<Event>(consumers)... };
+    const _detail::TargetIndex index{ids, count, events.size()};
+    std::vector<uint32_t> positions(events.size());
+    index.find_all(events, positions.data());
+    // Counting sort, stable, so every consumer gets its events in order.
+    std::array<size_t, count + 3> begin{};
+    for (auto position : positions) {
+        ++begin[position + 2];
+    }
+    for (size_t i = 2; i < begin.size(); ++i) {
+        begin[i] += begin[i - 1];
+    }
+    std::vector<size_t> order(events.size());
+    for (size_t i = 0; i < events.size(); ++i) {
+        order[begin[positions[i] + 1]++] = i;
+    }
+    // Now begin[i] is where the events of consumer i start, and begin[i + 1] where they end.
+    std::vector<TaskWrapper> tasks;
+    tasks.reserve(_detail::kBulkChunk);
+    size_t i = 0;
+    ((_detail::send_run(bus, q, events, order.data() + begin[i], begin[i + 1] - begin[i],
+        consumers, tasks), ++i), ...);
+    for (size_t j = begin[count]; j < begin[count + 1]; ++j) {
+        auto& ev = events[order[j]];
+        auto target = ev.target;
+        bus.dead_letters().push(target, std::move(ev));
+    }
+    return begin[count];
 }
 
-// Recursively search for type with handler for given event.
-template<typename Event, typename Head, typename ...Ts>
-constexpr size_t find_handler_idx(size_t idx = 0) {
-    return has_handler< Head, Event >::value ? idx : find_handler_idx<Event, Ts...>(idx + 1);
+//--------------------- Static dispatch helper
+
+// Search for the first type with handler for given event. It is a loop rather than recursion, so
+// that packs of hundreds of consumers don't hit the compiler's constexpr depth limit. When no
+// handlers are found, the size of the pack is returned, and there is static assert using this
+// return value to generate conscious error message.
+template<typename Event, typename ...Ts>
+constexpr size_t find_handler_idx() {
+    constexpr bool found[] = { has_handler<Ts, Event>::value..., false };
+    for (size_t i = 0; i < sizeof...(Ts); ++i) {
+        if (found[i]) {
+            return i;
+        }
+    }
+    return sizeof...(Ts);
 }
 
 //--------------------- Static compile-time dispatcher
@@ -149,7 +423,7 @@ void static_dispatch(Catbus& bus, size_t q, Event ev, Consumers& ...args) {
     static_assert(std::tuple_size<std::tuple<Consumers...>>::value > consumer_idx,
         "Handler not found!");
     std::tuple<Consumers&...> list{ args... };
-    bus.send(TaskWrapper{&std::get<consumer_idx>(list), std::move(ev)}, q);
+    _detail::send_task(bus, q, std::move(ev), std::get<consumer_idx>(list));
 }
 
 }; // namespace catbus
@@ -24,51 +24,460 @@ SOFTWARE.
 
 #pragma once
 
+#include "affinity.h"
+#include "dead_letter.h"
+#include "executor.h"
+#include "placement.h"
+#include "queue_mask.h"
+#include "stats.h"
 #include "task_wrapper.h"
+#include "trace.h"
 
 #include <array>
 #include <atomic>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
 #include <functional>
+#include <mutex>
+#include <stdexcept>
 #include <system_error>
 #include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
 namespace catbus {
 
+namespace _detail {
+
+    // Queues that can be filled from outside of the bus (e.g. by another process) declare
+    // 'static constexpr bool kExternalProducers = true'.
+    template<class Queue, class = void>
+    struct has_external_producers : std::false_type {};
+
+    template<class Queue>
+    struct has_external_producers<Queue, std::void_t<decltype(Queue::kExternalProducers)>>
+      : std::bool_constant<Queue::kExternalProducers> {};
+
+    // Queues that can block an idle worker until something arrives provide
+    // 'void wait_for_task(std::chrono::microseconds timeout)'.
+    template<class Queue, class = void>
+    struct has_wait_for_task : std::false_type {};
+
+    template<class Queue>
+    struct has_wait_for_task<Queue, std::void_t<decltype(
+        std::declval<Queue&>().wait_for_task(std::chrono::microseconds{}))>> : std::true_type {};
+
+    // Queues that can take many tasks at once cheaper than one by one provide
+    // 'void enqueue_bulk(TaskWrapper* tasks, size_t n)', which moves the tasks in, in order.
+    template<class Queue, class = void>
+    struct has_enqueue_bulk : std::false_type {};
+
+    template<class Queue>
+    struct has_enqueue_bulk<Queue, std::void_t<decltype(
+        std::declval<Queue&>().enqueue_bulk(std::declval<TaskWrapper*>(), size_t{}))>>
+        : std::true_type {};
+
+    // Queues that drop tasks by themselves, without handing them out, count them in
+    // 'uint64_t shed() const', see DeadlineQueue.
+    template<class Queue, class = void>
+    struct has_shed_count : std::false_type {};
+
+    template<class Queue>
+    struct has_shed_count<Queue, std::void_t<decltype(
+        uint64_t{std::declval<const Queue&>().shed()})>> : std::true_type {};
+
+    // Number of fused handlers (see dispatch_utils.h) the current thread is running inline, one
+    // inside another.
+    inline thread_local size_t fused_depth{0};
+
+    // Task a worker runs right after the current handler returns, see
+    // EventCatbus::run_next_local(). Only the worker that owns the slot touches it.
+    struct RunNextSlot {
+        explicit RunNextSlot(const void* owner) : bus{owner} {}
+
+        const void* bus;
+        TaskWrapper task;
+        size_t q{0};
+    };
+
+    inline thread_local RunNextSlot* run_next{nullptr};
+
+}; // namespace _detail
+
 // Incapsulates worker threads and queues and enqueues tasks.
 // The Queue type must be thread-safe.
+//
+// Each worker has a 'primary' queue which it always checks first. When it's empty, the worker
+// looks up the next non-empty queue in the QueueMask. So it is fine to have many more queues
+// than workers: additional queues will be visited when workers have free time, which can be used
+// as a sort of priority mechanism.
+//
+// Tasks sent without an explicit queue index are placed according to the Placement policy, see
+// placement.h.
+//
+// Consumers with a QueueAffinity member can be pinned to a home queue (actor mode, see
+// affinity.h). Queues that have pinned consumers are served by one worker at a time.
+//
+// A worker stuck in a long handler can be detected with detect_stalls(): its queue then stops
+// receiving tasks and another worker serves it until the handler returns.
+//
+// Consumers can take runs of events at once with a batch handler, see dispatch_utils.h: a
+// worker that takes a task for one gathers the tasks right behind it in the queue that go to the
+// same handler, and runs them with one call.
+//
+// With run_next_local(), a follow-up task a handler sends to its own queue runs right after it on
+// the same worker, Go-style.
+//
+// Handlers declared fused (see dispatch_utils.h) are called inline by the handler that sends
+// them, up to fuse_depth() deep, instead of going through a queue.
+//
+// Small plain events can skip the generic queues through typed channels (see channel.h), which
+// workers poll after their primary queue, and before it every kChannelPeriod rounds.
+//
+// Handled tasks can be traced with trace_to() and viewed as a timeline, see trace.h.
+//
+// Every event sent through the bus can be written to a Journal (see journal.h) with journal_to().
+//
+// A bus with NWrk == 0 has no threads, its tasks are run by an Executor it is attached to (see
+// worker_pool.h), or by whoever calls poll() or run_until_idle(). InlineCatbus is such a bus.
+//
+// Queues which need constructor arguments (see queue_shm.h) get them from the bus constructor,
+// followed by the queue index.
 
-template<typename Queue, size_t NQ, size_t NWrk>
+template<typename Queue, size_t NQ, size_t NWrk, typename Placement = GlobalRoundRobin>
 class EventCatbus {
     static_assert(NQ >= 1, "At least one queue is needed to run dispatching.");
-    static_assert(NWrk >= 1, "At least one worker thread is needed to handle events.");
 public:
     EventCatbus() {
-        for(size_t i = 0; i < NWrk; ++i) {
-            workers_[i].setup(&queues_, i % NQ);
-        }
+        start();
+    }
+
+    // Constructs every queue as Queue{args..., queue index}.
+    template<typename Arg, typename... Args>
+    explicit EventCatbus(const Arg& arg, const Args&... args)
+      : queues_{make_queues(std::make_index_sequence<NQ>{}, arg, args...)}
+    {
+        start();
     }
 
     ~EventCatbus() {
+        if (auto* executor = executor_.load(std::memory_order_acquire)) {
+            executor->detach_bus(this);
+        }
         stop();
     }
 
     void stop() {
-        for (auto& worker : workers_) {
-            worker.stop_ = true;
+        stop_.store(true, std::memory_order_relaxed);
+        if (parking_.load(std::memory_order_relaxed)) {
+            auto lock = std::unique_lock<std::mutex>{ park_access_ };
+            park_cv_.notify_all();
+        }
+    }
+
+    // When enabled, workers that stay idle for a while block until a task is sent instead of
+    // spinning, at the cost of a fence and a load in every send(). Queues that have their own
+    // wait_for_task() keep using it.
+    void park_idle_workers(bool enable) {
+        parking_.store(enable, std::memory_order_relaxed);
+        if (!enable) {
+            auto lock = std::unique_lock<std::mutex>{ park_access_ };
+            park_cv_.notify_all();
         }
     }
 
-    // Enqueues tasks to specified queue, falls back to simple round-robin algorithm if
-    // provided value is out of range.
+    // Enqueues tasks to specified queue, falls back to the placement policy if provided value
+    // is out of range.
     void send(TaskWrapper task, size_t q) {
         // std::move is used throughout the library and here as well to avoid copying of events,
         // this is why it's hard to implement try_enqueue() so we are risking some waiting here.
-        if (q < NQ) {
-            queues_[q].enqueue(std::move(task));
+        if (q >= NQ) {
+            q = placement_.pick(queues_, this);
+        }
+        if (queue_state_[q].stalled.load(std::memory_order_relaxed)) {
+            q = redirect(q);
+        }
+        if (auto* journal = journal_.load(std::memory_order_acquire)) {
+            journal_append_.load(std::memory_order_relaxed)(journal, task, q);
+        }
+        if (tracer_.load(std::memory_order_relaxed)) {
+            task.set_enqueued_ns(Tracer::now_ns());
+        }
+        auto* slot = _detail::run_next;
+        if (slot && slot->bus == this && _detail::worker_context.bus == this
+            && q == _detail::worker_context.queue
+            && run_next_.load(std::memory_order_relaxed)
+            && !queue_state_[q].exclusive.load(std::memory_order_relaxed))
+        {
+            std::swap(slot->task, task);
+            std::swap(slot->q, q);
+            if (!task.is_valid()) {
+                return;
+            }
+        }
+        queues_[q].enqueue(std::move(task));
+        announce(q, 1);
+    }
+
+    // Index of the queue a task sent to 'q' goes to: 'q' itself, or the queue the placement
+    // policy picks if 'q' is out of range.
+    size_t place(size_t q) {
+        return q < NQ ? q : placement_.pick(queues_, this);
+    }
+
+    // Enqueues 'n' tasks to one queue, in order, like send() does with each of them, but the
+    // queue index is resolved once, the queue gets them with one enqueue_bulk() call if it has
+    // one, and idle workers are woken once. The tasks are moved from.
+    void send_bulk(TaskWrapper* tasks, size_t n, size_t q) {
+        if (n == 0) {
+            return;
+        }
+        q = place(q);
+        if (queue_state_[q].stalled.load(std::memory_order_relaxed)) {
+            q = redirect(q);
+        }
+        if (auto* journal = journal_.load(std::memory_order_acquire)) {
+            const auto append = journal_append_.load(std::memory_order_relaxed);
+            for (size_t i = 0; i < n; ++i) {
+                append(journal, tasks[i], q);
+            }
+        }
+        if (tracer_.load(std::memory_order_relaxed)) {
+            auto now = Tracer::now_ns();
+            for (size_t i = 0; i < n; ++i) {
+                tasks[i].set_enqueued_ns(now);
+            }
+        }
+        if constexpr (_detail::has_enqueue_bulk<Queue>::value) {
+            queues_[q].enqueue_bulk(tasks, n);
         } else {
-            queues_[dispatch_counter_.fetch_add(1, std::memory_order_relaxed) % NQ].
-                enqueue(std::move(task));
+            for (size_t i = 0; i < n; ++i) {
+                queues_[q].enqueue(std::move(tasks[i]));
+            }
+        }
+        announce(q, n);
+    }
+
+    // Runs up to 'budget' tasks on the calling thread and returns how many ran. This is how
+    // executors serve buses without workers (NWrk == 0), but it can be called on any bus. The
+    // handlers get the index of the queue the task came from. Successive calls start the scan
+    // at different queues, so a small budget doesn't starve the last ones. 'worker' is the index
+    // of the calling thread among the threads of the executor.
+    size_t poll(size_t budget = 1, size_t worker = 0) {
+        const auto saved = _detail::worker_context;
+        size_t ran = 0;
+        const size_t turn = poll_cursor_.fetch_add(1, std::memory_order_relaxed);
+        size_t from = turn % NQ;
+        size_t misses = 0;
+        // Mask bits can be lost in a race (see queue_mask.h), so an empty mask is sometimes
+        // double-checked by visiting every queue.
+        bool sweep = false;
+        if (turn % kChannelPeriod == 0) {
+            ran += poll_channels(budget, from, worker);
+        }
+        while (ran < budget && misses < NQ) {
+            size_t q = sweep ? from : non_empty_.find(from);
+            if (q == NQ) {
+                if (poll_misses_.fetch_add(1, std::memory_order_relaxed) % kFullSweepPeriod != 0) {
+                    break;
+                }
+                sweep = true;
+                continue;
+            }
+            _detail::worker_context = {this, q, worker, true};
+            size_t taken = 0;
+            if (visit(q, q, budget - ran, &taken) == Visit::ran) {
+                ran += taken;
+                misses = 0;
+            } else {
+                ++misses;
+                from = q + 1 < NQ ? q + 1 : 0;
+            }
+        }
+        if (ran < budget && turn % kChannelPeriod != 0) {
+            ran += poll_channels(budget - ran, from, worker);
+        }
+        _detail::worker_context = saved;
+        return ran;
+    }
+
+    // Calls poll() until it finds nothing to run and returns the number of tasks that ran,
+    // including the ones their handlers sent. Doesn't return while handlers keep sending. On a
+    // bus without workers driven by one thread the order is deterministic: tasks of a queue run
+    // in the order they were sent, and each poll() starts at the next queue.
+    size_t run_until_idle(size_t worker = 0) {
+        size_t ran = 0;
+        for (;;) {
+            const size_t n = poll(TaskWrapper::kMaxBatch, worker);
+            ran += n;
+            // A poll can run nothing and still leave tasks behind, when a queue dropped what it
+            // had and the discarded tasks sent new ones, e.g. to a bridge. Queues with external
+            // producers always look non-empty, so for them an empty poll is enough.
+            if (n == 0 && (kExternalProducers || !has_tasks())) {
+                return ran;
+            }
+        }
+    }
+
+    // True if some queue may have tasks. Can be wrong for a moment, like the mask it reads.
+    bool has_tasks() const {
+        return !non_empty_.empty() || !channels_empty();
+    }
+
+    // Called by executors, see executor.h. Pass nullptr to detach.
+    void set_executor(Executor* executor) {
+        executor_.store(executor, std::memory_order_release);
+    }
+
+    // Makes the workers poll a typed channel (see channel.h). Should be called before any
+    // events are sent to the channel. Throws std::length_error past kMaxChannels.
+    template<typename Channel>
+    void attach_channel(Channel& channel) {
+        auto lock = std::unique_lock<std::mutex>{ bindings_access_ };
+        auto n = channel_count_.load(std::memory_order_relaxed);
+        if (n == kMaxChannels) {
+            throw std::length_error{"Too many channels attached to the bus."};
+        }
+        channels_[n] = ChannelEntry{&channel,
+            [](void* channel, size_t budget, size_t q) {
+                return static_cast<Channel*>(channel)->drain(budget, q);
+            },
+            [](const void* channel) { return static_cast<const Channel*>(channel)->empty(); }};
+        channel.bind(this, [](void* bus) { static_cast<EventCatbus*>(bus)->wake(1); });
+        channel_count_.store(n + 1, std::memory_order_release);
+    }
+
+    // When enabled, a task a handler sends to the queue it was given (a local send) goes to a
+    // private slot of the worker instead, and runs as soon as the handler returns, without
+    // touching the queue. A newer local send takes the slot, and the task it held goes to the
+    // queue. So a request/response exchange between two consumers stays on one worker. Tasks in
+    // a slot can't be stolen by other workers, and the worker visits its queues after every
+    // kRunNextStreak tasks from the slot, so a ping-pong doesn't starve them. Queues with pinned
+    // consumers don't use the slot. A task left in the slot when the bus stops goes back to its
+    // queue.
+    void run_next_local(bool enable) {
+        run_next_.store(enable, std::memory_order_relaxed);
+    }
+
+    // Longest chain of fused handlers (see dispatch_utils.h) a worker runs inline, one called from
+    // another; a send past it goes to the queue, and the chain goes on from there. Zero turns
+    // fusing off.
+    void fuse_depth(size_t depth) {
+        fuse_depth_.store(depth, std::memory_order_relaxed);
+    }
+
+    // Called when a fused handler is sent to queue 'q': runs 'handler' right away, with the queue
+    // index of the calling worker, and returns true, or returns false if the task has to be sent
+    // after all. The bus splits the chain when the caller isn't one of its workers or polling
+    // threads, when 'q' names another queue than the one being served, past fuse_depth(), and
+    // while a journal or a tracer is attached, so that they still see every event.
+    template<typename Handler>
+    bool try_fuse(size_t q, Handler&& handler) {
+        const auto& ctx = _detail::worker_context;
+        if (ctx.bus != this || (q < NQ && q != ctx.queue)
+            || _detail::fused_depth >= fuse_depth_.load(std::memory_order_relaxed)
+            || journal_.load(std::memory_order_relaxed)
+            || tracer_.load(std::memory_order_relaxed))
+        {
+            return false;
+        }
+        struct DepthGuard {
+            DepthGuard() { ++_detail::fused_depth; }
+            ~DepthGuard() { --_detail::fused_depth; }
+        } guard;
+        auto& counters = caller_counters();
+        counters.add(counters.tasks, 1);
+        handler(ctx.queue);
+        return true;
+    }
+
+    // Starts watching worker heartbeats. A worker that has not come back from a handler for
+    // longer than 'threshold' is stalled, and when all workers of a queue are stalled, tasks sent
+    // to the queue, including the ones its handlers send locally, go to other queues instead, and
+    // one of the other workers adopts the queue, visiting it right after its own primary queue,
+    // until the stall clears. Queues with pinned consumers keep their tasks, but are adopted too.
+    // Workers check for stalls every few hundred iterations, so detection takes 'threshold' plus
+    // the time to handle that many tasks. Zero turns detection off.
+    void detect_stalls(std::chrono::microseconds threshold) {
+        auto lock = std::unique_lock<std::mutex>{ stall_access_ };
+        stall_threshold_ns_.store(
+            static_cast<uint64_t>(std::chrono::nanoseconds{threshold}.count()),
+            std::memory_order_relaxed);
+        if (threshold.count() == 0) {
+            for (auto& state : queue_state_) {
+                state.stalled.store(false, std::memory_order_relaxed);
+            }
+            adopter_.fill(NWrk);
+        }
+    }
+
+    // True while all workers of the queue are stalled, see detect_stalls().
+    bool stalled(size_t q) const {
+        return q < NQ && queue_state_[q].stalled.load(std::memory_order_relaxed);
+    }
+
+    // Starts writing events sent through the bus to the journal, which must provide
+    // 'bool append(const TaskWrapper&, size_t q)' and outlive the bus. Pass nullptr to stop.
+    // While events are sent, it can only switch to a journal of the same type: a sender that
+    // still has the old journal may call it through the function of the new one.
+    template<typename Journal>
+    void journal_to(Journal* journal) {
+        if (journal) {
+            journal_append_.store([](void* j, const TaskWrapper& task, size_t q) {
+                static_cast<Journal*>(j)->append(task, q);
+            }, std::memory_order_relaxed);
+        }
+        journal_.store(journal, std::memory_order_release);
+    }
+
+    // Starts recording every handled task to the tracer, which should have a ring per thread that
+    // runs tasks, workers and threads that poll(), and outlive the bus. Pass nullptr to stop.
+    // While tracing is off, it costs a branch per task.
+    void trace_to(Tracer* tracer) {
+        tracer_.store(tracer, std::memory_order_release);
+    }
+
+    // Unroutable events sent with non-throwing dispatch functions end up here.
+    DeadLetterQueue& dead_letters() {
+        return dead_letters_;
+    }
+
+    // Counters for monitoring, see stats_page.h to publish them to other processes. Queue depths
+    // and high-water marks come from counters of sent and taken tasks, which are only kept after
+    // enable_stats(), at the cost of an atomic add per send and per task or batch a worker takes;
+    // reading them doesn't touch the queues. Until then stats() asks the queues for their sizes.
+    // Worker counters are always kept, they are local to the worker.
+    void enable_stats(bool enable = true) {
+        if (enable && !stats_enabled_.load(std::memory_order_relaxed)) {
+            // Tasks queued before are counted as sent now.
+            for (size_t i = 0; i < NQ; ++i) {
+                auto& counters = queue_counters_[i];
+                counters.enqueued.store(counters.dequeued.load(std::memory_order_relaxed)
+                    + dropped(i) + queues_[i].size(), std::memory_order_relaxed);
+            }
+        }
+        stats_enabled_.store(enable, std::memory_order_relaxed);
+    }
+
+    BusStats<NQ, NWrk> stats() const {
+        BusStats<NQ, NWrk> result;
+        const bool enabled = stats_enabled_.load(std::memory_order_relaxed);
+        for(size_t i = 0; i < NQ; ++i) {
+            // Queues with external producers get tasks the counters don't see, their size() is
+            // lock-free.
+            const uint64_t depth = enabled && !kExternalProducers
+                ? queue_counters_[i].depth(dropped(i)) : queues_[i].size();
+            const uint64_t high_water = queue_counters_[i].high_water.load(
+                std::memory_order_relaxed);
+            result.queues[i] = QueueStats{depth, std::max(depth, high_water)};
         }
+        for(size_t i = 0; i < NWrk; ++i) {
+            result.workers[i] = worker_stats_[i].load();
+        }
+        result.polled = worker_stats_[NWrk].load();
+        return result;
     }
 
     std::array<size_t, NQ> QueueSizes() const {
@@ -79,10 +488,77 @@ public:
         return result;
     }
 
-    // TODO: (ideas) potentially there can be special 'high piority' queue with separate workers.
-    // Also send() method with explicit queue idx might be useful. For example, when there are more
-    // queues than workers, additional queues will be visited when workers will have free time, so
-    // it can be sort of priority mechanism as well.
+    // Queue 'q' itself, to read counters of its own, like DeadlineQueue::late().
+    const Queue& queue(size_t q) const {
+        return queues_[q];
+    }
+
+    // Binds consumers (which must have 'QueueAffinity affinity_' member) to home queues, picking
+    // the queues with fewest bindings. Should be called before any events are sent to them.
+    template<typename... Consumer>
+    void pin(Consumer&... consumers) {
+        auto lock = std::unique_lock<std::mutex>{ bindings_access_ };
+        auto bind_least_pinned = [this](QueueAffinity& affinity) {
+            size_t q = 0;
+            for (size_t i = 1; i < NQ; ++i) {
+                if (queue_state_[i].pinned < queue_state_[q].pinned) {
+                    q = i;
+                }
+            }
+            bind(affinity, q);
+        };
+        (bind_least_pinned(consumers.affinity_), ...);
+    }
+
+    // Binds consumer to the given queue. Should be called before any events are sent to it.
+    template<typename Consumer>
+    void pin_to(size_t q, Consumer& consumer) {
+        auto lock = std::unique_lock<std::mutex>{ bindings_access_ };
+        bind(consumer.affinity_, q % NQ);
+    }
+
+    // If the deepest actor queue is longer than the shallowest one by at least 'min_difference'
+    // tasks, moves one pinned consumer from the former to the latter. Only consumers without
+    // queued events can move; among them the busiest since the previous call is preferred.
+    // Returns true if a consumer was moved. Meant to be called periodically, e.g. from a
+    // monitoring thread.
+    bool rebalance(size_t min_difference = 8) {
+        auto lock = std::unique_lock<std::mutex>{ bindings_access_ };
+        auto sizes = QueueSizes();
+        size_t deep = NQ;
+        size_t shallow = NQ;
+        for(size_t i = 0; i < NQ; ++i) {
+            if (!queue_state_[i].exclusive.load(std::memory_order_relaxed)) {
+                continue;
+            }
+            if (deep == NQ || sizes[i] > sizes[deep]) {
+                deep = i;
+            }
+            if (shallow == NQ || sizes[i] < sizes[shallow]) {
+                shallow = i;
+            }
+        }
+        std::vector<std::pair<size_t, QueueAffinity*>> candidates;
+        for(auto* affinity : bindings_) {
+            auto handled = affinity->take_handled();
+            if (affinity->home() == deep) {
+                candidates.emplace_back(handled, affinity);
+            }
+        }
+        if (deep == shallow || sizes[deep] < sizes[shallow] + min_difference) {
+            return false;
+        }
+        std::sort(candidates.begin(), candidates.end(),
+            [](const auto& a, const auto& b) { return a.first > b.first; });
+        for(auto& candidate : candidates) {
+            if (candidate.second->try_move(shallow)) {
+                --queue_state_[deep].pinned;
+                ++queue_state_[shallow].pinned;
+                return true;
+            }
+        }
+        return false;
+    }
 
     EventCatbus(const EventCatbus& other) = delete;
     EventCatbus(EventCatbus&& other) = delete;
@@ -90,43 +566,527 @@ public:
     EventCatbus& operator=(EventCatbus&& other) = delete;
 
 private:
-    struct Worker {
+    // Number of consecutive idle iterations after which a worker ignores the mask and checks
+    // every queue, in case a bit was lost in a race between clear() and enqueue.
+    static constexpr size_t kFullSweepPeriod = 1024;
+
+    // How many queues from the mask an idle worker tries before going back to its primary queue,
+    // in case the ones it finds are busy being served by other workers.
+    static constexpr size_t kStealAttempts = 4;
+
+    // Number of consecutive idle iterations after which a worker blocks in the primary queue's
+    // wait_for_task(), if the queue has one. The timeout bounds the delay of stop().
+    static constexpr size_t kIdleWaitRounds = 4096;
+    static constexpr std::chrono::microseconds kIdleWaitTimeout{1000};
+
+    // Parked workers wake up this often anyway, in case a mask bit was lost.
+    static constexpr std::chrono::milliseconds kParkTimeout{10};
+
+    // Most tasks a worker runs from its run-next slot in a row, see run_next_local().
+    static constexpr size_t kRunNextStreak = 32;
+
+    // Default for fuse_depth().
+    static constexpr size_t kDefaultFuseDepth = 8;
+
+    // Most typed channels a bus polls.
+    static constexpr size_t kMaxChannels = 32;
 
-        void setup(std::array<Queue, NQ>* queues, size_t primary) {
-            thread_ = std::thread(
-                [&queues = *queues, primary = primary, &stop = stop_] () {
-                    while (!stop) {
-                        for(size_t i = primary; !stop && i < primary + NQ; ++i) {
-                            auto task = queues[i % NQ].try_dequeue();
-                            if (task.is_valid()) {
-                                // Passing primary queue idx, because worker will check it on the
-                                // next iteration anyway. 
-                                task.run(primary);
-                                break;
-                            }
-                        }
+    // Every this many rounds, a worker or poll() serves the channels before the queues, so they
+    // get their share while the queues are busy.
+    static constexpr size_t kChannelPeriod = 8;
+
+    // Number of worker iterations between checks for stalled workers.
+    static constexpr size_t kStallCheckPeriod = 256;
+
+    // Such queues may get tasks without send(), so their bits in the mask are kept set.
+    static constexpr bool kExternalProducers = _detail::has_external_producers<Queue>::value;
+
+    enum class Visit { ran, empty, busy };
+
+    template<size_t... I, typename... Args>
+    static std::array<Queue, NQ> make_queues(std::index_sequence<I...>, const Args&... args) {
+        return {Queue{args..., I}...};
+    }
+
+    void start() {
+        adopter_.fill(NWrk);
+        worker_stats_[NWrk].shared = true;
+        if constexpr (kExternalProducers) {
+            for(size_t i = 0; i < NQ; ++i) {
+                non_empty_.set(i);
+            }
+        }
+        for(size_t i = 0; i < NWrk; ++i) {
+            workers_[i].thread_ = std::thread([this, i] { work(i, i % NQ); });
+        }
+    }
+
+    // Counters of the calling thread: its own if it is a worker of the bus, the shared ones of
+    // polling threads otherwise.
+    _detail::WorkerCounters& caller_counters() {
+        const auto& ctx = _detail::worker_context;
+        return ctx.polling ? worker_stats_[NWrk] : worker_stats_[ctx.worker];
+    }
+
+    void bind(QueueAffinity& affinity, size_t q) {
+        queue_state_[q].exclusive.store(true, std::memory_order_release);
+        ++queue_state_[q].pinned;
+        affinity.try_move(q);
+        bindings_.push_back(&affinity);
+    }
+
+    void work(size_t worker, size_t primary) {
+        _detail::worker_context = {this, primary, worker};
+        auto& counters = worker_stats_[worker];
+        auto& heartbeat = worker_state_[worker];
+        size_t idle_rounds = 0;
+        uint64_t beats = 0;
+        uint64_t last_check = 0;
+        size_t adopted = NQ;
+        size_t channel_cursor = worker;
+        size_t rounds = 0;
+        _detail::RunNextSlot slot{this};
+        _detail::run_next = &slot;
+        size_t streak = 0;
+        while (!stop_.load(std::memory_order_relaxed)) {
+            heartbeat.beat.store(++beats, std::memory_order_relaxed);
+            if (beats % kStallCheckPeriod == 0) {
+                auto threshold = stall_threshold_ns_.load(std::memory_order_relaxed);
+                if (threshold != 0 || adopted != NQ) {
+                    auto now = _detail::steady_now_ns();
+                    if (now - last_check >= threshold / 4) {
+                        last_check = now;
+                        adopted = check_stalls(worker, adopted, now, threshold);
                     }
                 }
-            );
+            }
+            if (slot.task.is_valid() && streak < kRunNextStreak) {
+                // Moved out first, the handler may fill the slot again.
+                TaskWrapper task = std::move(slot.task);
+                run_one(task, slot.q, primary, counters);
+                ++streak;
+                continue;
+            }
+            streak = 0;
+            const bool channels_first = ++rounds % kChannelPeriod == 0;
+            if ((channels_first
+                    && drain_channels(TaskWrapper::kMaxBatch, primary, channel_cursor, counters) != 0)
+                || visit(primary, primary) == Visit::ran
+                || (adopted != NQ && visit(adopted, primary) == Visit::ran)
+                || (!channels_first
+                    && drain_channels(TaskWrapper::kMaxBatch, primary, channel_cursor, counters) != 0)
+                || steal(primary, ++idle_rounds % kFullSweepPeriod == 0))
+            {
+                // The clock is only read when a worker becomes idle and when it gets busy again.
+                if (idle_rounds > 1) {
+                    counters.end_idle(_detail::steady_now_ns());
+                }
+                idle_rounds = 0;
+            } else if (idle_rounds == 1) {
+                counters.begin_idle(_detail::steady_now_ns());
+            }
+            if (idle_rounds >= kIdleWaitRounds) {
+                // A waiting worker doesn't beat, but isn't stalled.
+                heartbeat.waiting.store(true, std::memory_order_relaxed);
+                if constexpr (_detail::has_wait_for_task<Queue>::value) {
+                    queues_[primary].wait_for_task(kIdleWaitTimeout);
+                } else if (parking_.load(std::memory_order_relaxed)) {
+                    park(primary);
+                }
+                heartbeat.waiting.store(false, std::memory_order_relaxed);
+            }
+        }
+        _detail::run_next = nullptr;
+        // A task left in the slot goes back to its queue, like any other task still queued.
+        if (slot.task.is_valid()) {
+            queues_[slot.q].enqueue(std::move(slot.task));
+            announce(slot.q, 1);
+        }
+    }
+
+    // Compares heartbeats with the ones seen by the previous check, updates the stalled flags of
+    // queues, and returns the queue the worker should adopt, or NQ. Only one worker at a time
+    // checks, the others keep what they adopted until their next check.
+    size_t check_stalls(size_t worker, size_t adopted, uint64_t now, uint64_t threshold) {
+        auto lock = std::unique_lock<std::mutex>{ stall_access_, std::try_to_lock };
+        if (!lock.owns_lock()) {
+            return adopted;
+        }
+        if (threshold == 0) {
+            return NQ;
+        }
+        std::array<size_t, NQ> running{};
+        std::array<size_t, NQ> stuck{};
+        for (size_t w = 0; w < NWrk; ++w) {
+            auto& state = worker_state_[w];
+            auto beat = state.beat.load(std::memory_order_relaxed);
+            if (beat != state.seen_beat || state.seen_ns == 0
+                || state.waiting.load(std::memory_order_relaxed))
+            {
+                state.seen_beat = beat;
+                state.seen_ns = now;
+            }
+            ++running[w % NQ];
+            if (now - state.seen_ns > threshold) {
+                ++stuck[w % NQ];
+            }
+        }
+        for (size_t q = 0; q < NQ; ++q) {
+            const bool stalled = running[q] != 0 && stuck[q] == running[q];
+            queue_state_[q].stalled.store(stalled, std::memory_order_relaxed);
+            if (!stalled) {
+                adopter_[q] = NWrk;
+            }
+        }
+        if (adopted != NQ && adopter_[adopted] == worker) {
+            return adopted;
+        }
+        for (size_t q = 0; q < NQ; ++q) {
+            if (queue_state_[q].stalled.load(std::memory_order_relaxed) && adopter_[q] == NWrk
+                && q != worker % NQ)
+            {
+                adopter_[q] = worker;
+                return q;
+            }
+        }
+        return NQ;
+    }
+
+    // Picks a queue for a task sent to a stalled one. Tasks of pinned consumers stay at home.
+    size_t redirect(size_t q) {
+        if (queue_state_[q].exclusive.load(std::memory_order_relaxed)) {
+            return q;
+        }
+        size_t next = placement_.pick(queues_, this);
+        for (size_t i = 0; i < NQ; ++i, next = next + 1 < NQ ? next + 1 : 0) {
+            if (!queue_state_[next].stalled.load(std::memory_order_relaxed)) {
+                return next;
+            }
+        }
+        return q;
+    }
+
+    // Makes 'n' tasks just enqueued to queue 'q' visible to idle workers and executors.
+    void announce(size_t q, size_t n) {
+        non_empty_.set(q);
+        if (stats_enabled_.load(std::memory_order_relaxed)) {
+            auto& counters = queue_counters_[q];
+            if constexpr (kExternalProducers) {
+                counters.raise(queues_[q].size());
+            } else {
+                counters.enqueued.fetch_add(n, std::memory_order_relaxed);
+                counters.raise(counters.depth(dropped(q)));
+            }
+        }
+        wake(n);
+    }
+
+    // Tasks queue 'q' dropped by itself.
+    uint64_t dropped(size_t q) const {
+        if constexpr (_detail::has_shed_count<Queue>::value) {
+            return queues_[q].shed();
+        } else {
+            (void)q;
+            return 0;
+        }
+    }
+
+    // Lets idle workers or the executor know about 'n' new tasks.
+    void wake(size_t n) {
+        if constexpr (NWrk == 0) {
+            if (auto* executor = executor_.load(std::memory_order_acquire)) {
+                executor->notify();
+            }
+        }
+        if (parking_.load(std::memory_order_relaxed)) {
+            // Pairs with the increment in park(): either the worker sees the queue non-empty, or
+            // this sees the sleeper.
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (sleepers_.load(std::memory_order_relaxed) != 0) {
+                auto lock = std::unique_lock<std::mutex>{ park_access_ };
+                if (n == 1) {
+                    park_cv_.notify_one();
+                } else {
+                    park_cv_.notify_all();
+                }
+            }
         }
+    }
 
+    void park(size_t primary) {
+        auto lock = std::unique_lock<std::mutex>{ park_access_ };
+        sleepers_.fetch_add(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        // Primary queue bit may be cleared after a task was enqueued, so its size is checked too.
+        if (non_empty_.empty() && queues_[primary].size() == 0 && channels_empty()
+            && !stop_.load(std::memory_order_relaxed) && parking_.load(std::memory_order_relaxed))
+        {
+            park_cv_.wait_for(lock, kParkTimeout);
+        }
+        sleepers_.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    // Takes one task from queue 'q' and runs it. A task for a batch handler runs together with
+    // the tasks right behind it that go to the same handler, up to 'limit' tasks, and 'ran' gets
+    // the number of tasks taken. Queues with pinned consumers have to be acquired first, so that
+    // only one worker at a time runs their tasks.
+    Visit visit(size_t q, size_t primary, size_t limit = TaskWrapper::kMaxBatch,
+        size_t* ran = nullptr)
+    {
+        auto& state = queue_state_[q];
+        const bool exclusive = state.exclusive.load(std::memory_order_acquire);
+        if (exclusive && state.busy.exchange(true, std::memory_order_acquire)) {
+            return Visit::busy;
+        }
+        auto result = Visit::empty;
+        auto task = queues_[q].try_dequeue();
+        auto& counters = caller_counters();
+        size_t taken = 0;
+        if (task.is_valid()) {
+            if (task.can_batch() && limit > 1) {
+                taken = run_batch(task, q, primary, limit, counters);
+            } else {
+                run_one(task, q, primary, counters);
+                taken = 1;
+            }
+            result = Visit::ran;
+        }
+        if (exclusive) {
+            state.busy.store(false, std::memory_order_release);
+        }
+        if (result == Visit::empty) {
+            counters.add(counters.empty_scans, 1);
+        } else if (!kExternalProducers && stats_enabled_.load(std::memory_order_relaxed)) {
+            queue_counters_[q].dequeued.fetch_add(taken, std::memory_order_relaxed);
+        }
+        if (result == Visit::empty && !kExternalProducers) {
+            // Drain transition: clear the bit and re-check, so a task enqueued in between
+            // isn't hidden until the next full sweep. poll() and has_tasks() only see the mask,
+            // so the primary queue is re-checked too. A bit that was already clear costs nothing.
+            if (non_empty_.clear(q) && queues_[q].size() != 0) {
+                non_empty_.set(q);
+            }
+        }
+        if (ran) {
+            *ran = taken;
+        }
+        return result;
+    }
+
+    // Runs a task taken from queue 'q', or drops it if it was cancelled (see cancel.h).
+    void run_one(TaskWrapper& task, size_t q, size_t primary, _detail::WorkerCounters& counters) {
+        if (!task.claim()) {
+            counters.add(counters.cancelled, 1);
+            return;
+        }
+        counters.add(counters.tasks, 1);
+        if (q != primary) {
+            counters.add(counters.steals, 1);
+        }
+        // Passing primary queue idx, because worker will check it on the next
+        // iteration anyway.
+        if (auto* tracer = tracer_.load(std::memory_order_acquire)) {
+            run_traced(*tracer, task, q, primary, [&] { task.run(primary); });
+        } else {
+            task.run(primary);
+        }
+    }
+
+    // Runs 'first' and the tasks behind it in queue 'q' that batch with it in one handle_batch()
+    // call. A task of another kind ends the batch and runs right after it. Returns the number of
+    // tasks taken from the queue.
+    size_t run_batch(TaskWrapper& first, size_t q, size_t primary, size_t limit,
+        _detail::WorkerCounters& counters)
+    {
+        std::array<TaskWrapper, TaskWrapper::kMaxBatch> batch;
+        batch[0] = std::move(first);
+        size_t n = 1;
+        limit = std::min(limit, TaskWrapper::kMaxBatch);
+        TaskWrapper next;
+        while (n < limit) {
+            next = queues_[q].try_dequeue();
+            if (!next.is_valid() || !next.batches_with(batch[0])) {
+                break;
+            }
+            batch[n++] = std::move(next);
+        }
+        counters.add(counters.tasks, n);
+        if (q != primary) {
+            counters.add(counters.steals, n);
+        }
+        // A single event goes to the usual handler.
+        auto run = [&] {
+            if (n == 1) {
+                batch[0].run(primary);
+            } else {
+                TaskWrapper::run_batch(batch.data(), n, primary);
+            }
+        };
+        if (auto* tracer = tracer_.load(std::memory_order_acquire)) {
+            run_traced(*tracer, batch[0], q, primary, run);
+        } else {
+            run();
+        }
+        if (next.is_valid()) {
+            run_one(next, q, primary, counters);
+            ++n;
+        }
+        return n;
+    }
+
+    // A batch is recorded as one span, with the type and send time of its first task.
+    template<typename Run>
+    void run_traced(Tracer& tracer, const TaskWrapper& task, size_t q, size_t primary, Run run) {
+        TraceRecord record{&task.event_type(), task.enqueued_ns(), Tracer::now_ns(), 0,
+            static_cast<uint32_t>(q), static_cast<uint32_t>(primary)};
+        run();
+        record.end_ns = Tracer::now_ns();
+        tracer.record(record);
+    }
+
+    // Handles up to 'budget' events from the first non-empty channel after 'cursor', which is
+    // advanced so that channels take turns. Returns the number of events handled.
+    size_t drain_channels(size_t budget, size_t q, size_t& cursor,
+        _detail::WorkerCounters& counters)
+    {
+        const size_t n = channel_count_.load(std::memory_order_acquire);
+        for (size_t i = 0; i < n; ++i) {
+            cursor = cursor + 1 < n ? cursor + 1 : 0;
+            auto& channel = channels_[cursor];
+            if (channel.empty(channel.channel)) {
+                continue;
+            }
+            size_t handled = channel.drain(channel.channel, budget, q);
+            counters.add(counters.tasks, handled);
+            return handled;
+        }
+        return 0;
+    }
+
+    // drain_channels() for poll(), with the cursor shared by the threads that call it.
+    size_t poll_channels(size_t budget, size_t q, size_t worker) {
+        _detail::worker_context = {this, q, worker, true};
+        size_t cursor = channel_cursor_.load(std::memory_order_relaxed);
+        const size_t handled = drain_channels(budget, q, cursor, worker_stats_[NWrk]);
+        channel_cursor_.store(cursor, std::memory_order_relaxed);
+        return handled;
+    }
+
+    bool channels_empty() const {
+        const size_t n = channel_count_.load(std::memory_order_acquire);
+        for (size_t i = 0; i < n; ++i) {
+            if (!channels_[i].empty(channels_[i].channel)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool steal(size_t primary, bool full_sweep) {
+        if (full_sweep) {
+            for(size_t i = primary + 1; i < primary + NQ; ++i) {
+                if (visit(i % NQ, primary) == Visit::ran) {
+                    return true;
+                }
+            }
+            return false;
+        }
+        size_t from = primary;
+        size_t distance = 0;
+        for(size_t attempt = 0; attempt < kStealAttempts; ++attempt) {
+            from = from + 1 < NQ ? from + 1 : 0;
+            size_t q = non_empty_.find(from);
+            size_t next_distance = (q + NQ - primary) % NQ;
+            // Stop when the search wrapped around to the primary queue or beyond.
+            if (q == NQ || next_distance <= distance) {
+                return false;
+            }
+            if (visit(q, primary) == Visit::ran) {
+                return true;
+            }
+            distance = next_distance;
+            from = q;
+        }
+        return false;
+    }
+
+    struct Worker {
         ~Worker() {
             if (thread_.joinable()) {
                 try {
                     thread_.join();
                 }
-                catch (std::system_error e) {
+                catch (std::system_error&) {
                 }
             }
         }
 
         std::thread thread_;
-        bool stop_{};
     };
 
-    std::atomic_uint dispatch_counter_{};
-    std::array<Worker, NWrk> workers_;
+    struct alignas(64) QueueState {
+        std::atomic_bool exclusive{};
+        std::atomic_bool busy{};
+        std::atomic_bool stalled{};
+        size_t pinned{};
+    };
+
+    struct ChannelEntry {
+        void* channel;
+        size_t (*drain)(void* channel, size_t budget, size_t q);
+        bool (*empty)(const void* channel);
+    };
+
+    struct alignas(64) WorkerState {
+        // Written by the worker every iteration.
+        std::atomic<uint64_t> beat{0};
+        std::atomic_bool waiting{};
+        // Last change of the beat seen by check_stalls(), under stall_access_.
+        uint64_t seen_beat{0};
+        uint64_t seen_ns{0};
+    };
+
+    Placement placement_;
+    std::atomic_bool stop_{};
+    QueueMask<NQ> non_empty_;
+    std::array<QueueState, NQ> queue_state_;
+    std::array<WorkerState, NWrk> worker_state_;
+    std::atomic<uint64_t> stall_threshold_ns_{0};
+    // Worker serving each stalled queue besides its own, or NWrk. Guarded by stall_access_.
+    std::array<size_t, NQ> adopter_;
+    std::mutex stall_access_;
+    DeadLetterQueue dead_letters_;
+    std::atomic<void*> journal_{nullptr};
+    using JournalAppend = void (*)(void* journal, const TaskWrapper& task, size_t q);
+    std::atomic<JournalAppend> journal_append_{nullptr};
+    std::vector<QueueAffinity*> bindings_;
+    std::mutex bindings_access_;
+    std::atomic<Tracer*> tracer_{nullptr};
+    std::atomic_bool stats_enabled_{};
+    std::array<_detail::QueueCounters, NQ> queue_counters_;
+    // A slot per worker, and a shared one for threads calling poll().
+    std::array<_detail::WorkerCounters, NWrk + 1> worker_stats_;
+    std::atomic<Executor*> executor_{nullptr};
+    std::atomic<size_t> poll_cursor_{0};
+    std::atomic<size_t> fuse_depth_{kDefaultFuseDepth};
+    std::atomic_bool run_next_{};
+    std::array<ChannelEntry, kMaxChannels> channels_{};
+    std::atomic<size_t> channel_count_{0};
+    // Shared by threads calling poll(), races only make channels take turns less evenly.
+    std::atomic<size_t> channel_cursor_{0};
+    std::atomic<size_t> poll_misses_{0};
+    std::atomic_bool parking_{};
+    std::atomic<size_t> sleepers_{0};
+    std::mutex park_access_;
+    std::condition_variable park_cv_;
     std::array<Queue, NQ> queues_;
+    // Declared last, so worker threads are joined before the queues are destroyed.
+    std::array<Worker, NWrk> workers_;
 };
 
+// Bus without background threads, for tests and for embedding in a single-threaded loop: events
+// are dispatched as usual and handled on the thread that calls poll() or run_until_idle().
+template<typename Queue, size_t NQ = 1, typename Placement = GlobalRoundRobin>
+using InlineCatbus = EventCatbus<Queue, NQ, 0, Placement>;
+
 }; // namespace catbus
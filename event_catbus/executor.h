@@ -0,0 +1,17 @@
+#pragma once
+
+namespace catbus {
+
+// Runs the tasks of buses that have no workers of their own (NWrk == 0), like SharedWorkerPool.
+// The bus calls notify() after every send, so the executor can wake up idle threads, and
+// detach_bus() from its destructor. Executors drive the bus with EventCatbus::poll().
+class Executor {
+public:
+    virtual void notify() = 0;
+    virtual void detach_bus(const void* bus) = 0;
+
+protected:
+    ~Executor() = default;
+};
+
+}; // namespace catbus
@@ -0,0 +1,425 @@
+#pragma once
+
+#if defined(__linux__)
+
+#include "dispatch_utils.h"
+#include "registry.h"
+
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace catbus {
+
+enum class IoOp { read, write };
+
+// Event delivered to the consumer with id_ equal to 'target' when an operation submitted to
+// IoReactor is done.
+struct IoCompletion {
+    size_t target;
+    uint64_t user_data;
+    int fd;
+    IoOp op;
+    // Number of bytes transferred (0 on end of file) or -errno.
+    long result;
+    // Bytes read, or the buffer of a write given back, so it can be reused.
+    std::vector<char> data;
+};
+
+// Performs reads and writes for handlers, so they don't block bus workers with I/O. Operations
+// are started on the reactor thread, and those that would block wait in epoll. Completions are
+// routed as IoCompletion events through a registry (see make_registry()), the same way
+// EventSender routes targeted events, so consumers need an id_ and a handler for IoCompletion.
+// Everything that completes in one round of epoll is dispatched together, as a batch.
+//
+// Pipes, sockets and other pollable fds are switched to non-blocking mode while they have
+// operations pending, and back to their own flags after, so the fd shouldn't be used elsewhere
+// in the meantime; fds that are already non-blocking are left alone and save the two fcntl(2)
+// calls. Regular files can't be polled, so their operations are done one at a time on a helper
+// thread, started with the first of them, and a slow disk doesn't hold up the other fds.
+// Operations on the same fd in the same direction complete in submission order. Reads complete
+// with whatever one read(2) returns, writes complete when the whole buffer is written.
+// Completions for a target without a consumer go to the dead letter queue of the bus, see
+// unrouted().
+//
+// io_uring would allow submitting regular file I/O asynchronously too, but epoll and eventfd are
+// available everywhere without extra libraries.
+class IoReactor {
+public:
+    template<typename Bus, typename... Consumer>
+    explicit IoReactor(std::shared_ptr<const ConsumerRegistry<Bus, Consumer...>> registry,
+        size_t q = ROUND_ROBIN)
+      : q_{q}
+    {
+        route_ = [](const void* registry, size_t q, IoCompletion&& completion) {
+            return static_cast<const ConsumerRegistry<Bus, Consumer...>*>(registry)->try_route(
+                q, std::move(completion));
+        };
+        registry_ = registry.get();
+        owner_ = std::move(registry);
+        epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+        if (epoll_fd_ < 0) {
+            throw std::system_error(errno, std::generic_category(), "epoll_create1");
+        }
+        wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (wake_fd_ < 0) {
+            auto err = errno;
+            close(epoll_fd_);
+            throw std::system_error(err, std::generic_category(), "eventfd");
+        }
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.fd = wake_fd_;
+        epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wake_fd_, &ev);
+        thread_ = std::thread([this] { run(); });
+    }
+
+    ~IoReactor() {
+        stop_.store(true, std::memory_order_relaxed);
+        wake();
+        if (thread_.joinable()) {
+            thread_.join();
+        }
+        {
+            auto lock = std::unique_lock<std::mutex>{ file_access_ };
+            file_ready_.notify_one();
+        }
+        if (file_thread_.joinable()) {
+            file_thread_.join();
+        }
+        // Operations still pending are abandoned, but their fds get their flags back.
+        while (!fds_.empty()) {
+            forget(fds_.begin());
+        }
+        close(wake_fd_);
+        close(epoll_fd_);
+    }
+
+    IoReactor(const IoReactor&) = delete;
+    IoReactor& operator=(const IoReactor&) = delete;
+
+    // Reads up to 'size' bytes. A non-negative offset means pread(2) at that offset.
+    void read(int fd, size_t size, size_t target, uint64_t user_data = 0, int64_t offset = -1) {
+        submit(Op{IoOp::read, fd, offset, target, user_data, 0, std::vector<char>(size)});
+    }
+
+    void write(int fd, std::vector<char> data, size_t target, uint64_t user_data = 0,
+        int64_t offset = -1)
+    {
+        submit(Op{IoOp::write, fd, offset, target, user_data, 0, std::move(data)});
+    }
+
+    size_t completions() const {
+        return completions_.load(std::memory_order_relaxed);
+    }
+
+    // Number of times completions were dispatched, so completions() / batches() is the average
+    // batch size.
+    size_t batches() const {
+        return batches_.load(std::memory_order_relaxed);
+    }
+
+    // Completions whose target has no consumer, put into the dead letter queue of the bus or,
+    // if it was full, dropped.
+    size_t unrouted() const {
+        return unrouted_.load(std::memory_order_relaxed);
+    }
+
+    // Of the unrouted completions, those dropped, including those whose routing threw.
+    size_t dropped() const {
+        return dropped_.load(std::memory_order_relaxed);
+    }
+
+private:
+    static constexpr int kMaxEvents = 64;
+
+    struct Op {
+        IoOp op;
+        int fd;
+        int64_t offset;
+        size_t target;
+        uint64_t user_data;
+        size_t done;
+        std::vector<char> data;
+    };
+
+    // Pollable fds with operations pending.
+    struct FdState {
+        // Flags to restore when nothing is pending anymore, or -1 if the fd was non-blocking.
+        int restore_flags{-1};
+        uint32_t armed{0};
+        std::deque<Op> reads;
+        std::deque<Op> writes;
+    };
+
+    void submit(Op op) {
+        bool was_empty;
+        {
+            auto lock = std::unique_lock<std::mutex>{ submit_access_ };
+            was_empty = submitted_.empty();
+            submitted_.push_back(std::move(op));
+        }
+        // The reactor takes all submitted operations at once, so it's woken up once per batch.
+        if (was_empty) {
+            wake();
+        }
+    }
+
+    void wake() {
+        uint64_t one = 1;
+        (void)!::write(wake_fd_, &one, sizeof(one));
+    }
+
+    void run() {
+        epoll_event events[kMaxEvents];
+        std::vector<Op> submitted;
+        while (!stop_.load(std::memory_order_relaxed)) {
+            int n = epoll_wait(epoll_fd_, events, kMaxEvents, -1);
+            for (int i = 0; i < n; ++i) {
+                if (events[i].data.fd == wake_fd_) {
+                    uint64_t count;
+                    (void)!::read(wake_fd_, &count, sizeof(count));
+                    {
+                        auto lock = std::unique_lock<std::mutex>{ submit_access_ };
+                        submitted.swap(submitted_);
+                    }
+                    for (auto& op : submitted) {
+                        start(std::move(op));
+                    }
+                    submitted.clear();
+                    // The helper thread wakes the reactor the same way when files are done.
+                    auto lock = std::unique_lock<std::mutex>{ file_access_ };
+                    for (auto& completion : files_done_) {
+                        completed_.push_back(std::move(completion));
+                    }
+                    files_done_.clear();
+                } else {
+                    ready(events[i].data.fd);
+                }
+            }
+            deliver();
+        }
+    }
+
+    void start(Op op) {
+        const int fd = op.fd;
+        auto it = fds_.find(fd);
+        if (it == fds_.end()) {
+            struct stat st{};
+            if (fstat(fd, &st) != 0 || S_ISREG(st.st_mode) || S_ISDIR(st.st_mode)) {
+                start_file(std::move(op));
+                return;
+            }
+            it = fds_.emplace(fd, FdState{}).first;
+            int flags = fcntl(fd, F_GETFL);
+            if (flags >= 0 && !(flags & O_NONBLOCK) && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0) {
+                it->second.restore_flags = flags;
+            }
+        }
+        auto& state = it->second;
+        auto& pending = op.op == IoOp::read ? state.reads : state.writes;
+        if (!pending.empty() || !attempt(op, completed_)) {
+            pending.push_back(std::move(op));
+        }
+        arm(fd, state);
+        if (state.reads.empty() && state.writes.empty()) {
+            forget(it);
+        }
+    }
+
+    void start_file(Op op) {
+        auto lock = std::unique_lock<std::mutex>{ file_access_ };
+        files_.push_back(std::move(op));
+        if (!file_thread_.joinable()) {
+            file_thread_ = std::thread([this] { run_files(); });
+        }
+        file_ready_.notify_one();
+    }
+
+    // The helper thread: blocking reads and writes of regular files, one at a time.
+    void run_files() {
+        std::vector<IoCompletion> done;
+        auto lock = std::unique_lock<std::mutex>{ file_access_ };
+        for (;;) {
+            file_ready_.wait(lock, [this] {
+                return stop_.load(std::memory_order_relaxed) || !files_.empty();
+            });
+            if (stop_.load(std::memory_order_relaxed)) {
+                return;
+            }
+            auto op = std::move(files_.front());
+            files_.pop_front();
+            lock.unlock();
+            if (!attempt(op, done)) {
+                complete(op, -EAGAIN, done);
+            }
+            lock.lock();
+            const bool was_empty = files_done_.empty();
+            for (auto& completion : done) {
+                files_done_.push_back(std::move(completion));
+            }
+            done.clear();
+            if (was_empty) {
+                wake();
+            }
+        }
+    }
+
+    // Stops tracking an fd without operations pending and gives it its flags back. It's not
+    // kept: the fd may be closed and its number reused for a different kind of file.
+    void forget(std::unordered_map<int, FdState>::iterator it) {
+        if (it->second.restore_flags >= 0) {
+            fcntl(it->first, F_SETFL, it->second.restore_flags);
+        }
+        fds_.erase(it);
+    }
+
+    void ready(int fd) {
+        auto it = fds_.find(fd);
+        if (it == fds_.end()) {
+            return;
+        }
+        auto& state = it->second;
+        for (auto* pending : {&state.reads, &state.writes}) {
+            while (!pending->empty() && attempt(pending->front(), completed_)) {
+                pending->pop_front();
+            }
+        }
+        arm(fd, state);
+        if (state.reads.empty() && state.writes.empty()) {
+            forget(it);
+        }
+    }
+
+    // Returns false if the operation would block, otherwise adds its completion to 'done'.
+    static bool attempt(Op& op, std::vector<IoCompletion>& done) {
+        for (;;) {
+            char* buf = op.data.data() + op.done;
+            size_t left = op.data.size() - op.done;
+            ssize_t n;
+            if (op.op == IoOp::read) {
+                n = op.offset >= 0 ? pread(op.fd, buf, left, op.offset) : ::read(op.fd, buf, left);
+            } else {
+                n = op.offset >= 0 ? pwrite(op.fd, buf, left, op.offset + op.done)
+                    : ::write(op.fd, buf, left);
+            }
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    return false;
+                }
+                complete(op, -errno, done);
+                return true;
+            }
+            op.done += static_cast<size_t>(n);
+            if (op.op == IoOp::read) {
+                op.data.resize(op.done);
+                complete(op, static_cast<long>(n), done);
+                return true;
+            }
+            if (op.done == op.data.size()) {
+                complete(op, static_cast<long>(op.done), done);
+                return true;
+            }
+        }
+    }
+
+    static void complete(Op& op, long result, std::vector<IoCompletion>& done) {
+        done.push_back(
+            IoCompletion{op.target, op.user_data, op.fd, op.op, result, std::move(op.data)});
+    }
+
+    void arm(int fd, FdState& state) {
+        uint32_t wanted = (state.reads.empty() ? 0u : static_cast<uint32_t>(EPOLLIN))
+            | (state.writes.empty() ? 0u : static_cast<uint32_t>(EPOLLOUT));
+        if (wanted == state.armed) {
+            return;
+        }
+        epoll_event ev{};
+        ev.events = wanted;
+        ev.data.fd = fd;
+        int op = wanted == 0 ? EPOLL_CTL_DEL : (state.armed == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD);
+        if (epoll_ctl(epoll_fd_, op, fd, &ev) != 0 && op != EPOLL_CTL_DEL) {
+            // Can't be polled after all: fail the waiting operations instead of losing them.
+            auto err = errno;
+            for (auto* pending : {&state.reads, &state.writes}) {
+                for (auto& waiting : *pending) {
+                    complete(waiting, -err, completed_);
+                }
+                pending->clear();
+            }
+            wanted = 0;
+        }
+        state.armed = wanted;
+    }
+
+    void deliver() {
+        if (completed_.empty()) {
+            return;
+        }
+        for (auto& completion : completed_) {
+            // A completion that can't be sent (e.g. the bus is out of memory) is dropped, the
+            // reactor thread has nobody to report it to.
+            auto status = dispatch_status::dropped;
+            try {
+                status = route_(registry_, q_, std::move(completion));
+            }
+            catch (...) {
+            }
+            if (status != dispatch_status::delivered) {
+                unrouted_.fetch_add(1, std::memory_order_relaxed);
+                if (status == dispatch_status::dropped) {
+                    dropped_.fetch_add(1, std::memory_order_relaxed);
+                }
+            }
+        }
+        completions_.fetch_add(completed_.size(), std::memory_order_relaxed);
+        batches_.fetch_add(1, std::memory_order_relaxed);
+        completed_.clear();
+    }
+
+    size_t q_;
+    dispatch_status (*route_)(const void* registry, size_t q, IoCompletion&& completion);
+    const void* registry_;
+    std::shared_ptr<const void> owner_;
+    int epoll_fd_{-1};
+    int wake_fd_{-1};
+    std::atomic_bool stop_{};
+    std::mutex submit_access_;
+    std::vector<Op> submitted_;
+    // Owned by the reactor thread.
+    std::unordered_map<int, FdState> fds_;
+    std::vector<IoCompletion> completed_;
+    std::atomic<size_t> completions_{0};
+    std::atomic<size_t> batches_{0};
+    std::atomic<size_t> unrouted_{0};
+    std::atomic<size_t> dropped_{0};
+    std::thread thread_;
+    // Regular file operations for the helper thread, and their completions for the reactor.
+    std::mutex file_access_;
+    std::condition_variable file_ready_;
+    std::deque<Op> files_;
+    std::vector<IoCompletion> files_done_;
+    std::thread file_thread_;
+};
+
+}; // namespace catbus
+
+#endif // __linux__
@@ -0,0 +1,593 @@
+#pragma once
+
+#if defined(__linux__)
+
+#include "task_wrapper.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <queue>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <typeinfo>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace catbus {
+
+namespace _detail {
+
+    constexpr uint64_t kJournalMagic = 0x324c4e524a425443;  // 'CTBJRNL2'
+    constexpr size_t kJournalHeaderSize = 4096;
+
+    struct JournalHeader {
+        uint64_t magic;
+        uint64_t chunk_size;
+        uint64_t chunk_count;
+        // Program that wrote the segment, see journal_build_id(), and the Journal instance.
+        uint64_t build;
+        uint64_t run;
+        // Clocks when the journal was created. Record timestamps are steady clock, which only
+        // compares within one boot; the system clock tells when the run was.
+        uint64_t base_steady_ns;
+        uint64_t base_system_ns;
+    };
+
+    // Records are 8-byte aligned. 'size' is written last, so a record with zero size marks the
+    // end of written data in its chunk, also after a crash.
+    struct JournalRecordHeader {
+        std::atomic<uint32_t> size;
+        uint32_t queue;
+        uint64_t type;
+        uint64_t timestamp_ns;
+    };
+
+    static_assert(sizeof(JournalRecordHeader) == 24, "Journal record header must be packed.");
+
+    inline std::string journal_segment_path(const std::string& dir, size_t index) {
+        char name[32];
+        std::snprintf(name, sizeof(name), "/segment.%06zu", index);
+        return dir + name;
+    }
+
+    inline uint64_t journal_now_ns() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    inline uint64_t journal_system_ns() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    inline uint64_t journal_mix(uint64_t hash, uint64_t value) {
+        return (hash ^ value) * 0x100000001b3ull;
+    }
+
+    // Identifies the executable by its file, so a rebuild gets a new id. Event type ids and
+    // layouts are only known to match within one build.
+    inline uint64_t journal_build_id() {
+        static const uint64_t id = [] {
+            struct stat st{};
+            if (stat("/proc/self/exe", &st) != 0) {
+                return uint64_t{0};
+            }
+            uint64_t hash = 0xcbf29ce484222325ull;
+            hash = journal_mix(hash, static_cast<uint64_t>(st.st_dev));
+            hash = journal_mix(hash, static_cast<uint64_t>(st.st_ino));
+            hash = journal_mix(hash, static_cast<uint64_t>(st.st_size));
+            hash = journal_mix(hash, static_cast<uint64_t>(st.st_mtim.tv_sec));
+            hash = journal_mix(hash, static_cast<uint64_t>(st.st_mtim.tv_nsec));
+            return hash;
+        }();
+        return id;
+    }
+
+    struct JournalSegment {
+        char* base{nullptr};
+        size_t next_chunk{0};
+        size_t released{0};
+    };
+
+    // Chunk of a journal that the thread is writing to. Journals are told apart by unique ids
+    // rather than addresses, which may be reused.
+    struct JournalCursor {
+        uint64_t journal{0};
+        JournalSegment* segment{nullptr};
+        char* pos{nullptr};
+        char* end{nullptr};
+        // hash_code() hashes the type name on every call, so the last one is cached.
+        const std::type_info* last_type{nullptr};
+        uint64_t last_type_id{0};
+    };
+
+    inline thread_local JournalCursor journal_cursor;
+    // Chunks of the other journals the thread wrote to, so that one thread alternating between
+    // journals keeps filling its chunks, and their segments still get unmapped.
+    inline thread_local std::vector<JournalCursor> journal_parked;
+
+    // Stable within one build of the program, which is what a journal is replayed with.
+    template<typename Event>
+    uint64_t journal_type_id() {
+        static const uint64_t id = typeid(Event).hash_code();
+        return id;
+    }
+
+}; // namespace _detail
+
+// Append-only log of events sent through a bus, see EventCatbus::journal_to(). It is split into
+// fixed size segment files in a directory, which are memory-mapped, so appending an event is a
+// copy into the page cache: no syscall per event, and the data survives a crash of the process
+// (flush() also makes it survive a crash of the machine).
+//
+// Every segment is divided into chunks. A thread reserves a whole chunk under the mutex and then
+// appends to it without synchronization, so the writers never contend for a cache line. Segments
+// are unmapped when all their chunks are filled. Only events that are trivially copyable are
+// written, others are counted as skipped. Events keep the queue index they were sent to and a
+// timestamp, see JournalReader and replay(). The segment header records the build of the program
+// and a random id of the run, i.e. of this Journal, with the clocks when it started, so that
+// segments of earlier runs left in the directory are read separately, and those of other builds,
+// whose type ids mean nothing to this one, are not read at all.
+//
+// The journal must outlive the buses writing to it, and its chunks must hold the largest record,
+// see kMinChunkSize.
+class Journal {
+public:
+    static constexpr size_t kDefaultChunkSize = 64 * 1024;
+    static constexpr size_t kDefaultChunkCount = 1024;
+    // Room for a record of the largest event a task can carry.
+    static constexpr size_t kMinChunkSize =
+        sizeof(_detail::JournalRecordHeader) + TaskWrapper::kBufferSize;
+
+    explicit Journal(const std::string& dir, size_t chunk_size = kDefaultChunkSize,
+        size_t chunk_count = kDefaultChunkCount)
+      : dir_{dir}, chunk_size_{chunk_size}, chunk_count_{chunk_count}, id_{next_id()}
+      , base_steady_ns_{_detail::journal_now_ns()}, base_system_ns_{_detail::journal_system_ns()}
+    {
+        run_ = _detail::journal_mix(_detail::journal_mix(0xcbf29ce484222325ull, base_system_ns_),
+            (static_cast<uint64_t>(getpid()) << 32) ^ id_ ^ reinterpret_cast<uintptr_t>(this));
+        if (chunk_size_ < kMinChunkSize || chunk_size_ % 8 != 0 || chunk_count_ == 0) {
+            throw std::invalid_argument{"Journal chunks must be multiples of 8 bytes, at least "
+                "kMinChunkSize."};
+        }
+        if (mkdir(dir_.c_str(), 0755) != 0 && errno != EEXIST) {
+            throw std::system_error(errno, std::generic_category(), "mkdir");
+        }
+        // Continue after existing segments, e.g. when restarted after a crash.
+        while (access(_detail::journal_segment_path(dir_, next_segment_).c_str(), F_OK) == 0) {
+            ++next_segment_;
+        }
+    }
+
+    ~Journal() {
+        for (auto& segment : segments_) {
+            if (segment->base) {
+                munmap(segment->base, segment_size());
+            }
+        }
+    }
+
+    Journal(const Journal&) = delete;
+    Journal& operator=(const Journal&) = delete;
+
+    // Called by EventCatbus::send(). Returns false if the event was not written.
+    bool append(const TaskWrapper& task, size_t q) noexcept {
+        if (!task.is_event_trivially_copyable()) {
+            skipped_.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        const auto size = task.event_size();
+        const auto record_size = sizeof(_detail::JournalRecordHeader) + ((size + 7) & ~size_t{7});
+        auto& cursor = _detail::journal_cursor;
+        if (cursor.journal != id_) {
+            switch_cursor(cursor);
+        }
+        if (cursor.journal != id_ || cursor.end - cursor.pos < static_cast<ptrdiff_t>(record_size)) {
+            // A record that doesn't fit a whole chunk would run into the next one.
+            if (record_size > chunk_size_ || !next_chunk(cursor)) {
+                skipped_.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+        }
+        auto* header = reinterpret_cast<_detail::JournalRecordHeader*>(cursor.pos);
+        header->queue = static_cast<uint32_t>(q);
+        if (cursor.last_type != &task.event_type()) {
+            cursor.last_type = &task.event_type();
+            cursor.last_type_id = cursor.last_type->hash_code();
+        }
+        header->type = cursor.last_type_id;
+        header->timestamp_ns = _detail::journal_now_ns();
+        std::memcpy(cursor.pos + sizeof(_detail::JournalRecordHeader), task.event_data(), size);
+        header->size.store(static_cast<uint32_t>(size), std::memory_order_release);
+        cursor.pos += record_size;
+        return true;
+    }
+
+    // Writes mapped segments to disk.
+    void flush() {
+        auto lock = std::unique_lock<std::mutex>{ access_ };
+        for (auto& segment : segments_) {
+            if (segment->base) {
+                msync(segment->base, segment_size(), MS_SYNC);
+            }
+        }
+    }
+
+    const std::string& dir() const {
+        return dir_;
+    }
+
+    // Random id written into the segments of this journal, see JournalRecord::run.
+    uint64_t run() const {
+        return run_;
+    }
+
+    // Number of events that were not trivially copyable or could not be written.
+    size_t skipped() const {
+        return skipped_.load(std::memory_order_relaxed);
+    }
+
+private:
+    using Segment = _detail::JournalSegment;
+    using Cursor = _detail::JournalCursor;
+
+    static uint64_t next_id() {
+        static std::atomic<uint64_t> counter{0};
+        return counter.fetch_add(1, std::memory_order_relaxed) + 1;
+    }
+
+    // Parks the chunk of the journal the thread wrote to last, and picks up its chunk of this one.
+    // Entries of destroyed journals stay behind, their ids are never used again.
+    void switch_cursor(Cursor& cursor) noexcept {
+        auto& parked = _detail::journal_parked;
+        auto it = std::find_if(parked.begin(), parked.end(),
+            [this](const Cursor& c) { return c.journal == id_; });
+        Cursor mine{};
+        if (it != parked.end()) {
+            mine = *it;
+            parked.erase(it);
+        }
+        if (cursor.journal != 0) {
+            try {
+                parked.push_back(cursor);
+            }
+            catch (...) {
+                // The chunk is left unfinished, its segment stays mapped until the journal goes.
+            }
+        }
+        cursor = mine;
+    }
+
+    size_t segment_size() const {
+        return _detail::kJournalHeaderSize + chunk_size_ * chunk_count_;
+    }
+
+    bool next_chunk(Cursor& cursor) noexcept {
+        auto lock = std::unique_lock<std::mutex>{ access_ };
+        if (cursor.journal == id_ && cursor.segment) {
+            release(*cursor.segment);
+        }
+        cursor.journal = 0;
+        if (segments_.empty() || segments_.back()->next_chunk == chunk_count_) {
+            if (!open_segment()) {
+                return false;
+            }
+        }
+        auto& segment = *segments_.back();
+        cursor.journal = id_;
+        cursor.segment = &segment;
+        cursor.pos = segment.base + _detail::kJournalHeaderSize + chunk_size_ * segment.next_chunk++;
+        cursor.end = cursor.pos + chunk_size_;
+        return true;
+    }
+
+    // Called under the mutex.
+    void release(Segment& segment) {
+        if (++segment.released == chunk_count_) {
+            munmap(segment.base, segment_size());
+            segment.base = nullptr;
+        }
+    }
+
+    // Called under the mutex.
+    bool open_segment() noexcept {
+        auto path = _detail::journal_segment_path(dir_, next_segment_);
+        int fd = open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+        if (fd < 0) {
+            return false;
+        }
+        if (ftruncate(fd, segment_size()) != 0) {
+            close(fd);
+            return false;
+        }
+        void* mem = mmap(nullptr, segment_size(), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (mem == MAP_FAILED) {
+            return false;
+        }
+        try {
+            segments_.push_back(std::make_unique<Segment>());
+        }
+        catch (...) {
+            munmap(mem, segment_size());
+            return false;
+        }
+        auto* header = static_cast<_detail::JournalHeader*>(mem);
+        header->chunk_size = chunk_size_;
+        header->chunk_count = chunk_count_;
+        header->build = _detail::journal_build_id();
+        header->run = run_;
+        header->base_steady_ns = base_steady_ns_;
+        header->base_system_ns = base_system_ns_;
+        header->magic = _detail::kJournalMagic;
+        segments_.back()->base = static_cast<char*>(mem);
+        ++next_segment_;
+        return true;
+    }
+
+    std::string dir_;
+    size_t chunk_size_;
+    size_t chunk_count_;
+    uint64_t id_;
+    uint64_t base_steady_ns_;
+    uint64_t base_system_ns_;
+    uint64_t run_{0};
+    size_t next_segment_{0};
+    std::vector<std::unique_ptr<Segment>> segments_;
+    std::mutex access_;
+    std::atomic<size_t> skipped_{0};
+};
+
+// One event read back from a journal. 'data' points into the mapped segment and is valid until
+// the reader is destroyed.
+struct JournalRecord {
+    uint64_t type;
+    // Run of the journal that wrote the event, see Journal::run(). Timestamps only compare
+    // within a run.
+    uint64_t run;
+    uint64_t timestamp_ns;
+    size_t queue;
+    size_t size;
+    const void* data;
+
+    // Returns the event if it has given type, nullptr otherwise.
+    template<typename Event>
+    const Event* event() const {
+        if (type != _detail::journal_type_id<Event>() || size != sizeof(Event)) {
+            return nullptr;
+        }
+        return static_cast<const Event*>(data);
+    }
+};
+
+// Reads all segments of a journal directory. Each chunk was written by one thread, so it is
+// ordered by time, and the reader merges the chunks by timestamp: events come out in the order
+// they were sent, and events sent by one thread keep their relative order. Runs are not mixed:
+// all events of a run come before those of the runs that started after it. Segments written by
+// another build of the program are skipped and counted, see foreign().
+class JournalReader {
+public:
+    explicit JournalReader(const std::string& dir) {
+        for (size_t index = 0;; ++index) {
+            auto path = _detail::journal_segment_path(dir, index);
+            int fd = open(path.c_str(), O_RDONLY);
+            if (fd < 0) {
+                break;
+            }
+            struct stat st{};
+            void* mem = MAP_FAILED;
+            if (fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) >= _detail::kJournalHeaderSize) {
+                mem = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            }
+            close(fd);
+            if (mem == MAP_FAILED) {
+                continue;
+            }
+            mappings_.push_back({static_cast<char*>(mem), static_cast<size_t>(st.st_size)});
+            add_chunks(mappings_.back());
+        }
+        order_runs();
+    }
+
+    ~JournalReader() {
+        for (auto& m : mappings_) {
+            munmap(m.base, m.size);
+        }
+    }
+
+    JournalReader(const JournalReader&) = delete;
+    JournalReader& operator=(const JournalReader&) = delete;
+
+    // Segments skipped because another build of the program wrote them.
+    size_t foreign() const {
+        return foreign_;
+    }
+
+    // Number of runs with events to read.
+    size_t runs() const {
+        return runs_;
+    }
+
+    // Returns false when there are no more records.
+    bool next(JournalRecord& record) {
+        if (chunks_.empty()) {
+            return false;
+        }
+        auto chunk = chunks_.top();
+        chunks_.pop();
+        auto* header = reinterpret_cast<const _detail::JournalRecordHeader*>(chunk.pos);
+        record.type = header->type;
+        record.run = chunk.run_id;
+        record.timestamp_ns = header->timestamp_ns;
+        record.queue = header->queue;
+        record.size = header->size.load(std::memory_order_acquire);
+        record.data = chunk.pos + sizeof(_detail::JournalRecordHeader);
+        chunk.pos += sizeof(_detail::JournalRecordHeader) + ((record.size + 7) & ~size_t{7});
+        if (valid_record(chunk)) {
+            chunks_.push(chunk);
+        }
+        return true;
+    }
+
+private:
+    struct Mapping {
+        char* base;
+        size_t size;
+    };
+
+    struct ChunkCursor {
+        const char* pos;
+        const char* end;
+        size_t order;
+        uint64_t run_id;
+        // Position of the run by start time.
+        size_t run;
+
+        uint64_t timestamp() const {
+            return reinterpret_cast<const _detail::JournalRecordHeader*>(pos)->timestamp_ns;
+        }
+    };
+
+    struct Later {
+        bool operator()(const ChunkCursor& a, const ChunkCursor& b) const {
+            if (a.run != b.run) {
+                return a.run > b.run;
+            }
+            auto ta = a.timestamp();
+            auto tb = b.timestamp();
+            return ta != tb ? ta > tb : a.order > b.order;
+        }
+    };
+
+    static bool valid_record(const ChunkCursor& chunk) {
+        if (chunk.end - chunk.pos < static_cast<ptrdiff_t>(sizeof(_detail::JournalRecordHeader))) {
+            return false;
+        }
+        auto* header = reinterpret_cast<const _detail::JournalRecordHeader*>(chunk.pos);
+        auto size = header->size.load(std::memory_order_acquire);
+        return size != 0 && chunk.end - chunk.pos
+            >= static_cast<ptrdiff_t>(sizeof(_detail::JournalRecordHeader) + size);
+    }
+
+    void add_chunks(const Mapping& m) {
+        auto* header = reinterpret_cast<const _detail::JournalHeader*>(m.base);
+        if (header->magic != _detail::kJournalMagic || header->chunk_size == 0) {
+            return;
+        }
+        if (header->build != _detail::journal_build_id()) {
+            ++foreign_;
+            return;
+        }
+        for (size_t i = 0; i < header->chunk_count; ++i) {
+            auto offset = _detail::kJournalHeaderSize + header->chunk_size * i;
+            if (offset + header->chunk_size > m.size) {
+                break;
+            }
+            ChunkCursor chunk{m.base + offset, m.base + offset + header->chunk_size, order_++,
+                header->run, 0};
+            if (valid_record(chunk)) {
+                found_.push_back(chunk);
+                if (std::none_of(starts_.begin(), starts_.end(),
+                    [&](const RunStart& r) { return r.run == header->run; }))
+                {
+                    starts_.push_back(RunStart{header->run, header->base_system_ns});
+                }
+            }
+        }
+    }
+
+    // Numbers the runs by start time, and queues their chunks for the merge.
+    void order_runs() {
+        std::sort(starts_.begin(), starts_.end(), [](const RunStart& a, const RunStart& b) {
+            return a.system_ns != b.system_ns ? a.system_ns < b.system_ns : a.run < b.run;
+        });
+        runs_ = starts_.size();
+        for (auto& chunk : found_) {
+            chunk.run = std::find_if(starts_.begin(), starts_.end(),
+                [&](const RunStart& r) { return r.run == chunk.run_id; }) - starts_.begin();
+            chunks_.push(chunk);
+        }
+        found_.clear();
+        found_.shrink_to_fit();
+        starts_.clear();
+    }
+
+    struct RunStart {
+        uint64_t run;
+        uint64_t system_ns;
+    };
+
+    std::vector<Mapping> mappings_;
+    std::vector<ChunkCursor> found_;
+    std::vector<RunStart> starts_;
+    std::priority_queue<ChunkCursor, std::vector<ChunkCursor>, Later> chunks_;
+    size_t order_{0};
+    size_t foreign_{0};
+    size_t runs_{0};
+};
+
+enum class ReplaySpeed {
+    full,      // as fast as possible
+    original   // keeping the intervals between events as they were recorded
+};
+
+// Feeds journaled events of the given types back to the consumers through a registry (see
+// make_registry()), to the queues they were originally sent to. Events of other types are
+// skipped, and so are segments of other builds (see JournalReader). With the original timing,
+// every run starts right after the one before it. Returns the number of replayed events.
+template<typename... Events, typename Registry>
+size_t replay(const std::string& dir, const Registry& registry,
+    ReplaySpeed speed = ReplaySpeed::full)
+{
+    static_assert(sizeof...(Events) > 0, "Specify event types to replay.");
+    static_assert((std::is_trivially_copyable_v<Events> && ...),
+        "Only trivially copyable events are journaled.");
+    JournalReader reader{dir};
+    JournalRecord record{};
+    size_t replayed = 0;
+    uint64_t first_ns = 0;
+    uint64_t start_ns = 0;
+    uint64_t run = 0;
+    while (reader.next(record)) {
+        if (speed == ReplaySpeed::original) {
+            if (start_ns == 0 || record.run != run) {
+                run = record.run;
+                first_ns = record.timestamp_ns;
+                start_ns = _detail::journal_now_ns();
+            }
+            auto due = start_ns + (record.timestamp_ns - first_ns);
+            for (auto now = _detail::journal_now_ns(); now < due; now = _detail::journal_now_ns()) {
+                if (due - now > 100'000) {
+                    std::this_thread::sleep_for(std::chrono::nanoseconds(due - now - 50'000));
+                }
+            }
+        }
+        bool found = ([&] {
+            if (auto* ev = record.event<Events>()) {
+                registry->try_route(record.queue, *ev);
+                return true;
+            }
+            return false;
+        }() || ...);
+        replayed += found ? 1 : 0;
+    }
+    return replayed;
+}
+
+}; // namespace catbus
+
+#endif // __linux__
@@ -0,0 +1,252 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+#include <string>
+#include <vector>
+
+// Allocator for the heap parts of events, like vectors and strings. An event is usually built on
+// one thread and destroyed on another, after its handler returns, and with malloc such traffic
+// contends on arenas. Here every thread allocates from its own pool, and a block freed on another
+// thread goes back to the pool it came from through a lock-free return list, which the owner
+// takes whole when its own free list runs out. When a thread exits, its pool goes to the next new
+// thread, or is freed if all its blocks are back.
+namespace catbus {
+
+namespace _detail {
+
+    class PayloadPool {
+    public:
+        // Blocks are 16-byte aligned.
+        static constexpr size_t kAlignment = 16;
+        // Size classes are powers of 2 from kMinBlock to kMaxBlock, larger blocks use malloc.
+        static constexpr size_t kMinBlock = 16;
+        static constexpr size_t kMaxBlock = 4096;
+        static constexpr size_t kClasses = 9;
+        static constexpr size_t kArenaSize = 256 * 1024;
+
+        ~PayloadPool() {
+            for (auto* arena : arenas_) {
+                std::free(arena);
+            }
+        }
+
+        static void* allocate(size_t size) {
+            // After the pool of the thread was given away, only malloc is left, see Owner.
+            if (size > kMaxBlock || thread_exiting()) {
+                auto* header = static_cast<Header*>(std::malloc(sizeof(Header) + size));
+                if (header == nullptr) {
+                    throw std::bad_alloc{};
+                }
+                header->origin = nullptr;
+                return header + 1;
+            }
+            return local().take(size_class(size));
+        }
+
+        static void deallocate(void* ptr) {
+            auto* header = static_cast<Header*>(ptr) - 1;
+            auto* origin = header->origin;
+            if (origin == nullptr) {
+                std::free(header);
+                return;
+            }
+            auto cls = header->size_class;
+            if (!thread_exiting()) {
+                auto& pool = local();
+                if (origin == &pool) {
+                    header->next = pool.free_[cls];
+                    pool.free_[cls] = header;
+                    return;
+                }
+            }
+            // Only the owner takes from the return list, and it takes the whole list at once, so
+            // a push can't be confused by a block leaving and coming back (no ABA).
+            auto& returned = origin->returned_[cls];
+            header->next = returned.load(std::memory_order_relaxed);
+            while (!returned.compare_exchange_weak(header->next, header,
+                std::memory_order_release, std::memory_order_relaxed))
+            {}
+        }
+
+    private:
+        struct alignas(kAlignment) Header {
+            PayloadPool* origin;
+            union {
+                // While the block is allocated.
+                size_t size_class;
+                // While the block is in a free or return list.
+                Header* next;
+            };
+        };
+
+        // Pools outlive their threads: blocks can still come back after the thread exits, and
+        // the pool is given to the next new thread. Other thread-locals can be destroyed after
+        // the owner, so from then on the thread frees its blocks through the return lists too,
+        // and never touches the pool's own lists, which the next thread may already be using.
+        struct Owner {
+            Owner() {
+                auto lock = std::unique_lock<std::mutex>{ orphans_access() };
+                auto& orphaned = orphans();
+                if (orphaned.empty()) {
+                    pool = new PayloadPool;
+                } else {
+                    pool = orphaned.back();
+                    orphaned.pop_back();
+                }
+            }
+
+            ~Owner() {
+                thread_exiting() = true;
+                if (pool->reclaim()) {
+                    delete pool;
+                    return;
+                }
+                auto lock = std::unique_lock<std::mutex>{ orphans_access() };
+                orphans().push_back(pool);
+            }
+
+            PayloadPool* pool;
+        };
+
+        static PayloadPool& local() {
+            static thread_local Owner owner;
+            return *owner.pool;
+        }
+
+        // Set when the owner of the thread's pool is destroyed. Trivial, so it can still be read
+        // while the thread-locals with destructors are being destroyed.
+        static bool& thread_exiting() {
+            static thread_local bool exiting = false;
+            return exiting;
+        }
+
+        static std::mutex& orphans_access() {
+            static std::mutex access;
+            return access;
+        }
+
+        static std::vector<PayloadPool*>& orphans() {
+            static std::vector<PayloadPool*> pools;
+            return pools;
+        }
+
+        static size_t size_class(size_t size) {
+            size_t cls = 0;
+            for (size_t block = kMinBlock; block < size; block *= 2) {
+                ++cls;
+            }
+            return cls;
+        }
+
+        void* take(size_t cls) {
+            auto* header = free_[cls];
+            if (header == nullptr) {
+                header = returned_[cls].exchange(nullptr, std::memory_order_acquire);
+            }
+            if (header == nullptr) {
+                header = carve(cls);
+            }
+            free_[cls] = header->next;
+            header->origin = this;
+            header->size_class = cls;
+            return header + 1;
+        }
+
+        // Cuts a new block from the arena, returns it as a one-element list.
+        Header* carve(size_t cls) {
+            const size_t size = sizeof(Header) + (kMinBlock << cls);
+            if (arena_left_ < size) {
+                // The rest of the old arena is abandoned, it's less than one block.
+                arena_left_ = 0;
+                arenas_.reserve(arenas_.size() + 1);
+                arena_ = static_cast<char*>(std::malloc(kArenaSize));
+                if (arena_ == nullptr) {
+                    throw std::bad_alloc{};
+                }
+                arenas_.push_back(arena_);
+                arena_left_ = kArenaSize;
+            }
+            auto* header = reinterpret_cast<Header*>(arena_);
+            arena_ += size;
+            arena_left_ -= size;
+            header->next = nullptr;
+            ++carved_;
+            return header;
+        }
+
+        // Called by the exiting owner: takes the return lists and returns true if every block
+        // ever carved is back, so the pool can be freed with its arenas.
+        bool reclaim() {
+            size_t free = 0;
+            for (size_t cls = 0; cls < kClasses; ++cls) {
+                auto* returned = returned_[cls].exchange(nullptr, std::memory_order_acquire);
+                while (returned != nullptr) {
+                    auto* next = returned->next;
+                    returned->next = free_[cls];
+                    free_[cls] = returned;
+                    returned = next;
+                }
+                for (auto* header = free_[cls]; header != nullptr; header = header->next) {
+                    ++free;
+                }
+            }
+            return free == carved_;
+        }
+
+        // Owned by the thread of the pool.
+        Header* free_[kClasses]{};
+        char* arena_{nullptr};
+        size_t arena_left_{0};
+        std::vector<char*> arenas_;
+        size_t carved_{0};
+        // Pushed to by other threads.
+        alignas(64) std::atomic<Header*> returned_[kClasses]{};
+    };
+
+}; // namespace _detail
+
+// Standard allocator on top of the per-thread payload pools, for containers in events.
+template<typename T>
+class PoolAllocator {
+    static_assert(alignof(T) <= _detail::PayloadPool::kAlignment,
+        "Type is over-aligned for the payload pool.");
+public:
+    using value_type = T;
+
+    PoolAllocator() noexcept = default;
+
+    template<typename U>
+    PoolAllocator(const PoolAllocator<U>&) noexcept {}
+
+    T* allocate(size_t n) {
+        return static_cast<T*>(_detail::PayloadPool::allocate(n * sizeof(T)));
+    }
+
+    void deallocate(T* ptr, size_t) noexcept {
+        _detail::PayloadPool::deallocate(ptr);
+    }
+
+    template<typename U>
+    bool operator==(const PoolAllocator<U>&) const noexcept {
+        return true;
+    }
+
+    template<typename U>
+    bool operator!=(const PoolAllocator<U>&) const noexcept {
+        return false;
+    }
+};
+
+// Containers for event payloads. The string keeps short values inline, as std::string does.
+template<typename T>
+using PooledVector = std::vector<T, PoolAllocator<T>>;
+
+using PooledString = std::basic_string<char, std::char_traits<char>, PoolAllocator<char>>;
+
+}; // namespace catbus
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace catbus {
+
+namespace _detail {
+
+    // Set by the worker threads, so placement policies and other helpers can tell whether the
+    // current thread belongs to a given bus, and which queue it is serving.
+    struct WorkerContext {
+        const void* bus{nullptr};
+        size_t queue{0};
+        size_t worker{0};
+        // True while the thread runs tasks through poll() rather than as a worker of the bus.
+        bool polling{false};
+    };
+
+    inline thread_local WorkerContext worker_context;
+
+    // Cheap per-thread xorshift generator, seeded from the address of its own state so that
+    // threads don't walk the same sequence.
+    inline uint32_t thread_random() {
+        thread_local uint32_t state = static_cast<uint32_t>(
+            reinterpret_cast<uintptr_t>(&state) >> 4) | 1u;
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return state;
+    }
+
+}; // namespace _detail
+
+// Placement policies decide which queue gets a task that was sent with ROUND_ROBIN instead of an
+// explicit queue index. A policy is the last template parameter of EventCatbus and must provide
+//
+//     template<typename Queue, size_t NQ>
+//     size_t pick(const std::array<Queue, NQ>& queues, const void* bus);
+//
+// where 'bus' is the address of the bus, to compare with _detail::worker_context.
+
+// The original behaviour: one shared counter. Spreads tasks perfectly evenly, but every producer
+// in the process contends on the same cache line.
+class GlobalRoundRobin {
+public:
+    template<typename Queue, size_t NQ>
+    size_t pick(const std::array<Queue, NQ>&, const void*) {
+        return counter_.fetch_add(1, std::memory_order_relaxed) % NQ;
+    }
+
+private:
+    std::atomic_uint counter_{};
+};
+
+// Round robin with a thread-local counter, no shared state at all. Each thread starts at a
+// different queue so that senders don't move in lockstep.
+class PerThreadRoundRobin {
+public:
+    template<typename Queue, size_t NQ>
+    size_t pick(const std::array<Queue, NQ>&, const void*) {
+        thread_local size_t counter = _detail::thread_random();
+        return counter++ % NQ;
+    }
+};
+
+// Samples two random queues and takes the shorter one. Needs only two size() calls, but keeps
+// the load much more even than blind round robin when handler costs are skewed. Note that with
+// MutexProtectedQueue size() takes the queue lock.
+class PowerOfTwoChoices {
+public:
+    template<typename Queue, size_t NQ>
+    size_t pick(const std::array<Queue, NQ>& queues, const void*) {
+        if constexpr (NQ == 1) {
+            return 0;
+        } else {
+            auto r = _detail::thread_random();
+            size_t a = r % NQ;
+            size_t b = (a + 1 + (r >> 16) % (NQ - 1)) % NQ;
+            return queues[a].size() <= queues[b].size() ? a : b;
+        }
+    }
+};
+
+// When the sender is a worker of the same bus, keeps the task on that worker's queue, which is
+// the fastest option as long as the queue is short. Once the local queue holds more than
+// 'Threshold' tasks (for example, because the worker is stuck in a long handler), or when the
+// sender is not a worker of this bus, falls back to power-of-two-choices.
+template<size_t Threshold = 64>
+class PreferLocal {
+public:
+    template<typename Queue, size_t NQ>
+    size_t pick(const std::array<Queue, NQ>& queues, const void* bus) {
+        const auto& ctx = _detail::worker_context;
+        if (ctx.bus == bus && queues[ctx.queue].size() <= Threshold) {
+            return ctx.queue;
+        }
+        return fallback_.pick(queues, bus);
+    }
+
+private:
+    PowerOfTwoChoices fallback_;
+};
+
+}; // namespace catbus
@@ -0,0 +1,186 @@
+#pragma once
+
+#include "task_wrapper.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+namespace catbus {
+
+// Deadline for an event's 'uint64_t deadline_ns' member, 'timeout' from now.
+inline std::uint64_t deadline_after(std::chrono::nanoseconds timeout) {
+    return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch() + timeout).count());
+}
+
+// Queue which serves tasks earliest deadline first. Events with 'uint64_t deadline_ns' (see
+// has_deadline in dispatch_utils.h) go ahead of the ones with later deadlines, events without a
+// deadline come last, and tasks with equal deadlines keep the order they were sent in. So urgent
+// events don't wait behind bulk work queued before them.
+//
+// Tasks whose deadline has passed by the time a worker takes them are counted in late(). With
+// ShedLate they are dropped instead, without running, and counted in shed(); the handler can't
+// tell such an event from one that was never sent, so only events that are worthless when late
+// should go to such a queue. Dropped tasks are discarded (see TaskWrapper::discard()), so pinned
+// consumers and bridges get back what the task held.
+//
+// The heap holds 24-byte entries with the deadline and the index of the task, which stays in
+// place, so sifting moves a few cache lines instead of whole tasks. Each node has D children,
+// which makes the heap shallower than a binary one. Like MutexProtectedQueue, it is protected by
+// a mutex.
+template <bool ShedLate = false, size_t D = 4>
+class DeadlineQueue {
+    static_assert(D >= 2, "Heap nodes need at least two children.");
+public:
+    void enqueue(TaskWrapper task) {
+        auto lock = std::unique_lock<std::mutex>{ queue_access_ };
+        push(std::move(task));
+    }
+
+    // Moves 'n' tasks in under one lock.
+    void enqueue_bulk(TaskWrapper* tasks, size_t n) {
+        auto lock = std::unique_lock<std::mutex>{ queue_access_ };
+        for (size_t i = 0; i < n; ++i) {
+            push(std::move(tasks[i]));
+        }
+    }
+
+    TaskWrapper try_dequeue() {
+        auto lock = std::unique_lock<std::mutex>{ queue_access_, std::defer_lock };
+        if (!lock.try_lock()) {
+            return TaskWrapper{};
+        }
+        uint64_t now = 0;
+        // Shed tasks are discarded after the lock is released, their discard() may send.
+        std::vector<TaskWrapper> shed;
+        TaskWrapper result;
+        while (!heap_.empty()) {
+            auto top = heap_.front();
+            pop();
+            auto task = std::move(tasks_[top.slot]);
+            free_.push_back(top.slot);
+            if (top.deadline == TaskWrapper::kNoDeadline) {
+                result = std::move(task);
+                break;
+            }
+            if (now == 0) {
+                now = now_ns();
+            }
+            if (top.deadline >= now) {
+                result = std::move(task);
+                break;
+            }
+            if constexpr (ShedLate) {
+                shed_.fetch_add(1, std::memory_order_relaxed);
+                shed.push_back(std::move(task));
+            } else {
+                late_.fetch_add(1, std::memory_order_relaxed);
+                result = std::move(task);
+                break;
+            }
+        }
+        lock.unlock();
+        for (auto& task : shed) {
+            task.discard();
+        }
+        return result;
+    }
+
+    size_t size() const {
+        auto lock = std::unique_lock<std::mutex>{ queue_access_ };
+        return heap_.size();
+    }
+
+    // Tasks handed out after their deadline.
+    uint64_t late() const {
+        return late_.load(std::memory_order_relaxed);
+    }
+
+    // Tasks dropped because their deadline had passed, only with ShedLate.
+    uint64_t shed() const {
+        return shed_.load(std::memory_order_relaxed);
+    }
+
+private:
+    struct Entry {
+        uint64_t deadline;
+        uint64_t seq;
+        uint32_t slot;
+    };
+
+    static bool before(const Entry& a, const Entry& b) {
+        return a.deadline < b.deadline || (a.deadline == b.deadline && a.seq < b.seq);
+    }
+
+    static uint64_t now_ns() {
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count());
+    }
+
+    void push(TaskWrapper task) {
+        uint32_t slot;
+        if (free_.empty()) {
+            slot = static_cast<uint32_t>(tasks_.size());
+            tasks_.push_back(TaskWrapper{});
+        } else {
+            slot = free_.back();
+            free_.pop_back();
+        }
+        Entry entry{task.deadline_ns(), seq_++, slot};
+        tasks_[slot] = std::move(task);
+        size_t i = heap_.size();
+        heap_.push_back(entry);
+        while (i > 0) {
+            size_t parent = (i - 1) / D;
+            if (!before(entry, heap_[parent])) {
+                break;
+            }
+            heap_[i] = heap_[parent];
+            i = parent;
+        }
+        heap_[i] = entry;
+    }
+
+    void pop() {
+        auto last = heap_.back();
+        heap_.pop_back();
+        const size_t n = heap_.size();
+        if (n == 0) {
+            return;
+        }
+        size_t i = 0;
+        for (;;) {
+            size_t first = i * D + 1;
+            if (first >= n) {
+                break;
+            }
+            size_t best = first;
+            const size_t end = first + D < n ? first + D : n;
+            for (size_t c = first + 1; c < end; ++c) {
+                if (before(heap_[c], heap_[best])) {
+                    best = c;
+                }
+            }
+            if (!before(heap_[best], last)) {
+                break;
+            }
+            heap_[i] = heap_[best];
+            i = best;
+        }
+        heap_[i] = last;
+    }
+
+    std::vector<Entry> heap_;
+    // Tasks stay in their slots while their entries move in the heap.
+    std::vector<TaskWrapper> tasks_;
+    std::vector<uint32_t> free_;
+    uint64_t seq_{0};
+    mutable std::mutex queue_access_;
+    std::atomic<uint64_t> late_{0};
+    std::atomic<uint64_t> shed_{0};
+};
+
+}; // namespace catbus
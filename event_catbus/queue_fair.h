@@ -0,0 +1,186 @@
+#pragma once
+
+#include "task_wrapper.h"
+
+#include <array>
+#include <cstdint>
+#include <mutex>
+#include <queue>
+#include <typeinfo>
+#include <utility>
+#include <vector>
+
+namespace catbus {
+
+// Traffic classes of FairQueue: every consumer is a class of its own, or every event type.
+struct ByConsumer {
+    static uintptr_t key(const TaskWrapper& task) {
+        return reinterpret_cast<uintptr_t>(task.consumer());
+    }
+};
+
+struct ByEventType {
+    static uintptr_t key(const TaskWrapper& task) {
+        return task.event_type().hash_code();
+    }
+};
+
+// Weights of traffic classes for FairQueue, passed to the bus constructor, which gives them to
+// every queue. Classes without a weight have weight 1.
+//
+//     FairWeights weights;
+//     weights.consumer(ui, 4).consumer(logger, 1);
+//     EventCatbus<FairQueue<>, 4, 4> bus{weights};
+class FairWeights {
+public:
+    template<class Consumer>
+    FairWeights& consumer(const Consumer& c, uint32_t weight) {
+        weights_.emplace_back(reinterpret_cast<uintptr_t>(&c), weight);
+        return *this;
+    }
+
+    template<class Event>
+    FairWeights& event(uint32_t weight) {
+        weights_.emplace_back(typeid(Event).hash_code(), weight);
+        return *this;
+    }
+
+    uint32_t weight(uintptr_t key) const {
+        for (const auto& [k, w] : weights_) {
+            if (k == key) {
+                return w > 0 ? w : 1;
+            }
+        }
+        return 1;
+    }
+
+private:
+    std::vector<std::pair<uintptr_t, uint32_t>> weights_;
+};
+
+// Queue which keeps a FIFO sub-queue per traffic class and serves them by deficit round robin, so
+// a class that floods the queue only delays the others by its share. In each round a class with
+// queued tasks takes up to its weight in tasks, then the next one takes its turn; a class that
+// runs out of tasks leaves the round and joins at the end when it gets new ones. The order of
+// tasks within a class is kept. Every task costs the same, whatever its event.
+//
+// Classes are tracked in a table of MaxClasses; the tasks of classes seen after it filled up share
+// the last one. Like MutexProtectedQueue, it is protected by a mutex, and the dequeue is a few
+// more loads than with a single FIFO.
+template <typename Classify = ByConsumer, size_t MaxClasses = 64>
+class FairQueue {
+    static_assert(MaxClasses >= 2, "Need room for at least two classes.");
+public:
+    FairQueue() = default;
+
+    // 'index' is given by EventCatbus when the weights are passed to its constructor, and is not
+    // used.
+    explicit FairQueue(const FairWeights& weights, size_t index = 0)
+      : weights_{weights}
+    {
+        (void)index;
+    }
+
+    void enqueue(TaskWrapper task) {
+        auto lock = std::unique_lock<std::mutex>{ queue_access_ };
+        push(std::move(task));
+    }
+
+    // Moves 'n' tasks in under one lock.
+    void enqueue_bulk(TaskWrapper* tasks, size_t n) {
+        auto lock = std::unique_lock<std::mutex>{ queue_access_ };
+        for (size_t i = 0; i < n; ++i) {
+            push(std::move(tasks[i]));
+        }
+    }
+
+    TaskWrapper try_dequeue() {
+        auto lock = std::unique_lock<std::mutex>{ queue_access_, std::defer_lock };
+        if (!lock.try_lock() || active_.empty()) {
+            return TaskWrapper{};
+        }
+        const auto idx = active_.front();
+        auto& cls = classes_[idx];
+        if (cls.deficit == 0) {
+            cls.deficit = cls.weight;
+        }
+        auto result = std::move(cls.tasks.front());
+        cls.tasks.pop();
+        --cls.deficit;
+        --size_;
+        if (cls.tasks.empty()) {
+            cls.deficit = 0;
+            active_.pop();
+        } else if (cls.deficit == 0) {
+            active_.pop();
+            active_.push(idx);
+        }
+        return result;
+    }
+
+    size_t size() const {
+        auto lock = std::unique_lock<std::mutex>{ queue_access_ };
+        return size_;
+    }
+
+private:
+    struct Class {
+        uintptr_t key{0};
+        uint32_t weight{1};
+        uint32_t deficit{0};
+        std::queue<TaskWrapper> tasks;
+    };
+
+    static constexpr size_t kSlots = [] {
+        size_t n = 1;
+        while (n < MaxClasses * 2) {
+            n <<= 1;
+        }
+        return n;
+    }();
+
+    void push(TaskWrapper task) {
+        const auto idx = find(Classify::key(task));
+        auto& cls = classes_[idx];
+        if (cls.tasks.empty()) {
+            active_.push(idx);
+        }
+        cls.tasks.push(std::move(task));
+        ++size_;
+    }
+
+    // Index of the key's class, which is added if it's new, open addressing over 'slots_'.
+    uint32_t find(uintptr_t key) {
+        auto i = static_cast<size_t>((key ^ (key >> 17)) * 0x9E3779B97F4A7C15ull) & (kSlots - 1);
+        for (;; i = (i + 1) & (kSlots - 1)) {
+            const auto slot = slots_[i];
+            if (slot == 0) {
+                break;
+            }
+            if (classes_[slot - 1].key == key) {
+                return slot - 1;
+            }
+        }
+        if (count_ == MaxClasses - 1) {
+            // The last class takes everyone else.
+            return MaxClasses - 1;
+        }
+        const auto idx = count_++;
+        classes_[idx].key = key;
+        classes_[idx].weight = weights_.weight(key);
+        slots_[i] = idx + 1;
+        return idx;
+    }
+
+    FairWeights weights_;
+    std::array<Class, MaxClasses> classes_;
+    // Class index + 1, or 0 for a free slot.
+    std::array<uint32_t, kSlots> slots_{};
+    uint32_t count_{0};
+    // Classes with queued tasks, in the order of their turns.
+    std::queue<uint32_t> active_;
+    size_t size_{0};
+    mutable std::mutex queue_access_;
+};
+
+}; // namespace catbus
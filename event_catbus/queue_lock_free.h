@@ -3,6 +3,7 @@
 #include "task_wrapper.h"
 
 #include <atomic>
+#include <thread>
 
 namespace catbus {
 
@@ -12,26 +13,16 @@ namespace catbus {
 // event handlers. When there are handlers that can block for significant amount of time,
 // performance difference is small to nonobservable.
 //
-// Also, in case of extremely quick event handling, queue is very succeptible to any thread being
-// evicted. My theory is that, since processing is quick, some other thread inevitably arriving
-// to the same slot (after masked counter wraps around) and two consumer threads start yielding
-// while waiting on the same atomic flag. What happens next is up to chance but test runs show
-// that one of the threads may end up reading invalid value and crashing. Setting queue to a
-// larger size i.e. 65536 helped against it.
+// Consumers claim a slot with compare-exchange only while it is below the produced counter, so
+// a consumer never waits for a slot that no producer has taken yet. Previously the counter was
+// incremented blindly after the emptiness check, and two consumers racing for the last task
+// could leave one of them waiting (and, after the masked counter wrapped, reading a slot that
+// belonged to somebody else).
 template <size_t N = 4096>
 class SimpleLockFreeQueue {
+    static_assert(N > 0 && (N & (N - 1)) == 0, "Queue size must be a power of 2.");
 public:
 
-    ~SimpleLockFreeQueue()
-    {
-        // A hack to avoid a worker thread getting stuck after it was stopped in case it's waiting
-        // for the ready flag in yield cycle. This logic kind of belongs to EventBus, but on the
-        // other hand it's only relevant to this type of queue.
-        while(size() <= 1) {
-            enqueue(TaskWrapper{});
-        }
-    }
-
     void enqueue(TaskWrapper task) {
         unsigned prod = produced_.fetch_add(1, std::memory_order_relaxed) & mask_;
         while (buffer_[prod].ready.load(std::memory_order_acquire)) {
@@ -41,11 +32,33 @@ public:
         buffer_[prod].ready.store(true, std::memory_order_release);
     }
 
-    TaskWrapper try_dequeue() {
-        if (consumed_.load(std::memory_order_relaxed) >= produced_.load(std::memory_order_relaxed)) {
-            return TaskWrapper{};
+    // Reserves slots for up to N tasks with one increment, so the tasks of one call are
+    // contiguous and other producers don't contend on the counter for each of them.
+    void enqueue_bulk(TaskWrapper* tasks, size_t n) {
+        while (n != 0) {
+            unsigned count = static_cast<unsigned>(n < N ? n : N);
+            unsigned prod = produced_.fetch_add(count, std::memory_order_relaxed);
+            for (unsigned i = 0; i < count; ++i) {
+                auto& slot = buffer_[(prod + i) & mask_];
+                while (slot.ready.load(std::memory_order_acquire)) {
+                    std::this_thread::yield();
+                }
+                slot.t = std::move(tasks[i]);
+                slot.ready.store(true, std::memory_order_release);
+            }
+            tasks += count;
+            n -= count;
         }
-        unsigned current = consumed_.fetch_add(1, std::memory_order_relaxed) & mask_;
+    }
+
+    TaskWrapper try_dequeue() {
+        unsigned claimed = consumed_.load(std::memory_order_relaxed);
+        do {
+            if (static_cast<int>(produced_.load(std::memory_order_relaxed) - claimed) <= 0) {
+                return TaskWrapper{};
+            }
+        } while (!consumed_.compare_exchange_weak(claimed, claimed + 1, std::memory_order_relaxed));
+        unsigned current = claimed & mask_;
         while (!buffer_[current].ready.load(std::memory_order_acquire)) {
             std::this_thread::yield();
         }
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+namespace catbus {
+
+namespace _detail {
+
+    inline unsigned count_trailing_zeros(uint64_t v) {
+#if defined(_MSC_VER)
+        unsigned long idx;
+        _BitScanForward64(&idx, v);
+        return static_cast<unsigned>(idx);
+#else
+        return static_cast<unsigned>(__builtin_ctzll(v));
+#endif
+    }
+
+}; // namespace _detail
+
+// Bitmap of queues that may contain tasks. Bits are set by producers after enqueue and cleared by
+// workers when they find a queue empty, so an idle worker can locate work with a single load and
+// count-trailing-zeros instead of calling try_dequeue() on every queue.
+//
+// The mask is a hint, not a guarantee: a bit may be set for an empty queue (the worker will clear
+// it) and, in a narrow race between clear() and a concurrent enqueue, a bit may be missing for a
+// non-empty queue. Workers compensate for the latter with a periodic full sweep.
+//
+// For more than 64 queues there is a second level: one summary bit per 64-bit word, so lookup
+// still costs one load in the common case.
+template <size_t N>
+class QueueMask {
+public:
+    static constexpr size_t kWords = (N + 63) / 64;
+    static_assert(kWords <= 64, "QueueMask supports up to 4096 queues.");
+
+    void set(size_t i) {
+        auto& word = words_[i / 64];
+        const uint64_t bit = uint64_t{1} << (i % 64);
+        // Plain load first, so producers feeding an already busy queue don't fight over the line.
+        if (word.load(std::memory_order_relaxed) & bit) {
+            return;
+        }
+        auto prev = word.fetch_or(bit, std::memory_order_acq_rel);
+        if constexpr (kWords > 1) {
+            if (prev == 0) {
+                summary_.fetch_or(uint64_t{1} << (i / 64), std::memory_order_acq_rel);
+            }
+        }
+    }
+
+    // Returns true if the bit was set.
+    bool clear(size_t i) {
+        auto& word = words_[i / 64];
+        const uint64_t bit = uint64_t{1} << (i % 64);
+        if (!(word.load(std::memory_order_relaxed) & bit)) {
+            return false;
+        }
+        auto prev = word.fetch_and(~bit, std::memory_order_acq_rel);
+        if constexpr (kWords > 1) {
+            if ((prev & ~bit) == 0) {
+                const uint64_t summary_bit = uint64_t{1} << (i / 64);
+                summary_.fetch_and(~summary_bit, std::memory_order_acq_rel);
+                // Somebody could set a bit in this word between the two operations above.
+                if (word.load(std::memory_order_acquire) != 0) {
+                    summary_.fetch_or(summary_bit, std::memory_order_acq_rel);
+                }
+            }
+        }
+        return (prev & bit) != 0;
+    }
+
+    bool test(size_t i) const {
+        return words_[i / 64].load(std::memory_order_relaxed) & (uint64_t{1} << (i % 64));
+    }
+
+    bool empty() const {
+        if constexpr (kWords > 1) {
+            return summary_.load(std::memory_order_relaxed) == 0;
+        } else {
+            return words_[0].load(std::memory_order_relaxed) == 0;
+        }
+    }
+
+    // Returns index of the first set bit at or after 'from', wrapping around, or N if none.
+    size_t find(size_t from) const {
+        if constexpr (kWords == 1) {
+            uint64_t m = words_[0].load(std::memory_order_relaxed);
+            if (m == 0) {
+                return N;
+            }
+            uint64_t upper = m & (~uint64_t{0} << from);
+            return _detail::count_trailing_zeros(upper ? upper : m);
+        } else {
+            const size_t first_word = from / 64;
+            uint64_t m = words_[first_word].load(std::memory_order_relaxed)
+                & (~uint64_t{0} << (from % 64));
+            if (m) {
+                return first_word * 64 + _detail::count_trailing_zeros(m);
+            }
+            uint64_t candidates = summary_.load(std::memory_order_relaxed);
+            // Words strictly after the first one are visited first, then we wrap around, which
+            // includes the lower part of the first word.
+            uint64_t after = first_word + 1 < 64 ? ~uint64_t{0} << (first_word + 1) : 0;
+            while (candidates) {
+                uint64_t preferred = candidates & after;
+                size_t w = _detail::count_trailing_zeros(preferred ? preferred : candidates);
+                uint64_t bits = words_[w].load(std::memory_order_relaxed);
+                if (bits) {
+                    return w * 64 + _detail::count_trailing_zeros(bits);
+                }
+                candidates &= ~(uint64_t{1} << w);  // stale summary bit
+            }
+            return N;
+        }
+    }
+
+private:
+    std::array<std::atomic<uint64_t>, kWords> words_{};
+    std::atomic<uint64_t> summary_{};
+};
+
+}; // namespace catbus
@@ -15,6 +15,14 @@ public:
       queue_.push(std::move(task));
     }
 
+    // Moves 'n' tasks in under one lock.
+    void enqueue_bulk(TaskWrapper* tasks, size_t n) {
+      auto lock = std::unique_lock<std::mutex>{ queue_access_ };
+      for (size_t i = 0; i < n; ++i) {
+        queue_.push(std::move(tasks[i]));
+      }
+    }
+
     TaskWrapper try_dequeue() {
         auto lock = std::unique_lock<std::mutex>{ queue_access_, std::defer_lock };
         if (lock.try_lock()) {
@@ -0,0 +1,411 @@
+#pragma once
+
+#if defined(__linux__)
+
+#include "dispatch_utils.h"
+#include "task_wrapper.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <typeinfo>
+#include <vector>
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace catbus {
+
+namespace _detail {
+
+    // Hash of the mangled type name, so it is the same in every process built with the same
+    // compiler ABI, unlike type_info::hash_code(), which is only known to match within one
+    // program.
+    inline uint64_t shm_type_id(const std::type_info& type) {
+        uint64_t hash = 0xcbf29ce484222325ull;
+        for (const char* c = type.name(); *c != '\0'; ++c) {
+            hash = (hash ^ static_cast<unsigned char>(*c)) * 0x100000001b3ull;
+        }
+        return hash;
+    }
+
+    // Hashing the name on every send would be slow, so the last type a thread sent is cached.
+    struct ShmTypeCache {
+        const std::type_info* type{nullptr};
+        uint64_t id{0};
+    };
+
+    inline thread_local ShmTypeCache shm_type_cache;
+
+}; // namespace _detail
+
+// Binds events taken out of a SharedMemoryQueue to the handlers of the consumer process, see
+// make_shm_registry(). Events travel as a type id and their bytes, without handler addresses,
+// so producer and consumer can be different programs.
+class ShmRegistry {
+public:
+    ShmRegistry(const ShmRegistry&) = delete;
+    ShmRegistry& operator=(const ShmRegistry&) = delete;
+
+    // Puts the event into a task for its handler. Returns false if the type is not bound or has
+    // another size, or no consumer has id_ equal to the target of the event.
+    bool bind(uint64_t type, size_t size, const void* data, TaskWrapper& task) const {
+        auto it = std::lower_bound(entries_.begin(), entries_.end(), type,
+            [](const Entry& e, uint64_t type) { return e.type < type; });
+        if (it == entries_.end() || it->type != type || it->size != size) {
+            return false;
+        }
+        return it->bind(consumers_.get(), data, task);
+    }
+
+private:
+    template<typename... Events, class... Consumers>
+    friend std::shared_ptr<const ShmRegistry> make_shm_registry(Consumers&... consumers);
+
+    struct Entry {
+        uint64_t type;
+        size_t size;
+        bool (*bind)(const void* consumers, const void* data, TaskWrapper& task);
+    };
+
+    ShmRegistry() = default;
+
+    template<typename Event, class... Consumers>
+    static bool bind_event(const void* consumers, const void* data, TaskWrapper& task) {
+        const auto& list = *static_cast<const std::tuple<Consumers*...>*>(consumers);
+        const auto& ev = *static_cast<const Event*>(data);
+        if constexpr (has_target<Event>::value) {
+            return std::apply([&](auto*... c) { return (bind_targeted(ev, *c, task) || ...); },
+                list);
+        } else {
+            constexpr auto idx = find_handler_idx<Event, Consumers...>();
+            static_assert(sizeof...(Consumers) > idx, "Handler not found!");
+            task = TaskWrapper{std::get<idx>(list), ev};
+            return true;
+        }
+    }
+
+    template<typename Event, class Consumer>
+    static bool bind_targeted(const Event& ev, Consumer& c, TaskWrapper& task) {
+        if constexpr (has_handler<Consumer, Event>::value && has_id<Consumer>::value) {
+            if (c.id_ == ev.target) {
+                task = TaskWrapper{&c, ev};
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Sorted by type.
+    std::vector<Entry> entries_;
+    std::shared_ptr<const void> consumers_;
+};
+
+// Builds the registry a consumer process gives its SharedMemoryQueues. Events of the given types
+// go to the consumer static_dispatch() would pick, or, if they have a target, to the one with
+// id_ equal to it, like with dynamic_dispatch().
+template<typename... Events, class... Consumers>
+std::shared_ptr<const ShmRegistry> make_shm_registry(Consumers&... consumers) {
+    static_assert(sizeof...(Events) > 0, "Specify event types to bind.");
+    static_assert((std::is_trivially_copyable_v<Events> && ...),
+        "Only trivially copyable events go through shared memory.");
+    static_assert((!has_affinity<Consumers>::value && ...),
+        "Pinned consumers can't take events from shared memory.");
+    std::shared_ptr<ShmRegistry> registry{new ShmRegistry{}};
+    registry->consumers_ = std::make_shared<const std::tuple<Consumers*...>>(&consumers...);
+    registry->entries_ = {ShmRegistry::Entry{_detail::shm_type_id(typeid(Events)), sizeof(Events),
+        &ShmRegistry::bind_event<Events, Consumers...>}...};
+    std::sort(registry->entries_.begin(), registry->entries_.end(),
+        [](const ShmRegistry::Entry& a, const ShmRegistry::Entry& b) { return a.type < b.type; });
+    return registry;
+}
+
+// Queue which keeps its ring buffer in a named POSIX shared memory segment, so that two processes
+// can exchange tasks through it with no copies besides the one into the ring, and no syscalls on
+// the hot path. An idle consumer sleeps on a futex in the segment and producers wake it up.
+//
+// Usage: both processes create EventCatbus<SharedMemoryQueue<N>, NQ, NWrk> with the same name.
+// The consuming one also passes a registry (see make_shm_registry()), the other one doesn't, so
+// its workers never take tasks from the shared rings. Each queue of the bus gets its own segment,
+// 'name.<index>'. The segment is created by whichever process comes first and unlinked by its
+// creator.
+//
+// Only the event goes through the ring, as an id of its type and its bytes, so it must be
+// trivially copyable, and enqueueing anything else throws std::invalid_argument. The consumer
+// binds it to a handler of its own through the registry, so the processes don't need to share
+// an address layout, or even the binary; the event types just have to be the same. Wrappers of
+// the producer's handler, like cancellation (see cancel.h), stay behind. Events the registry
+// doesn't bind are dropped and counted, see unbound(). A segment of another size, left by a queue
+// with another N, is rejected with std::runtime_error, and so is one its creator doesn't set up
+// within kTimeout, or a ring that stays full that long because the consumer is gone.
+template <size_t N = 4096>
+class SharedMemoryQueue {
+    static_assert(N > 0 && (N & (N - 1)) == 0, "Queue size must be a power of 2.");
+public:
+    // Marks queues which can receive tasks that didn't go through the local bus, so it must not
+    // trust its mask of non-empty queues for them.
+    static constexpr bool kExternalProducers = true;
+
+    static constexpr std::chrono::seconds kTimeout{5};
+
+    // Producer side, only enqueues, try_dequeue() always returns an empty task.
+    explicit SharedMemoryQueue(const std::string& name, size_t index = 0)
+      : SharedMemoryQueue{name, nullptr, index}
+    {}
+
+    // Consumer side, enqueues and dequeues.
+    SharedMemoryQueue(const std::string& name, std::shared_ptr<const ShmRegistry> registry,
+        size_t index = 0)
+      : name_{name + "." + std::to_string(index)}, registry_{std::move(registry)}
+    {
+        int fd = shm_open(name_.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+        if (fd >= 0) {
+            creator_ = true;
+            if (ftruncate(fd, sizeof(Segment)) != 0) {
+                auto err = errno;
+                close(fd);
+                shm_unlink(name_.c_str());
+                throw std::system_error(err, std::generic_category(), "ftruncate");
+            }
+        } else if (errno == EEXIST) {
+            fd = shm_open(name_.c_str(), O_RDWR, 0600);
+            if (fd < 0) {
+                throw std::system_error(errno, std::generic_category(), "shm_open");
+            }
+            check_size(fd);
+        } else {
+            throw std::system_error(errno, std::generic_category(), "shm_open");
+        }
+        void* mem = mmap(nullptr, sizeof(Segment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (mem == MAP_FAILED) {
+            throw std::system_error(errno, std::generic_category(), "mmap");
+        }
+        segment_ = static_cast<Segment*>(mem);
+        if (creator_) {
+            // Fresh segment is zero-filled, only slot sequence numbers need initialization.
+            for (size_t i = 0; i < N; ++i) {
+                segment_->slots[i].seq.store(i, std::memory_order_relaxed);
+            }
+            segment_->ready.store(kReady, std::memory_order_release);
+        } else {
+            const auto deadline = std::chrono::steady_clock::now() + kTimeout;
+            while (segment_->ready.load(std::memory_order_acquire) != kReady) {
+                if (std::chrono::steady_clock::now() > deadline) {
+                    munmap(segment_, sizeof(Segment));
+                    throw std::runtime_error("Shared memory segment " + name_
+                        + " was not set up by its creator.");
+                }
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    ~SharedMemoryQueue() {
+        munmap(segment_, sizeof(Segment));
+        if (creator_) {
+            shm_unlink(name_.c_str());
+        }
+    }
+
+    SharedMemoryQueue(const SharedMemoryQueue&) = delete;
+    SharedMemoryQueue& operator=(const SharedMemoryQueue&) = delete;
+
+    void enqueue(TaskWrapper task) {
+        if (!task.is_event_trivially_copyable()) {
+            throw std::invalid_argument("SharedMemoryQueue accepts only trivially copyable events.");
+        }
+        auto& cache = _detail::shm_type_cache;
+        if (cache.type != &task.event_type()) {
+            cache.type = &task.event_type();
+            cache.id = _detail::shm_type_id(*cache.type);
+        }
+        uint64_t pos = segment_->head.load(std::memory_order_relaxed);
+        Slot* slot;
+        std::chrono::steady_clock::time_point deadline{};
+        for (;;) {
+            slot = &segment_->slots[pos & mask_];
+            uint64_t seq = slot->seq.load(std::memory_order_acquire);
+            auto diff = static_cast<int64_t>(seq - pos);
+            if (diff == 0) {
+                if (segment_->head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                // Full, wait for consumers same way SimpleLockFreeQueue does, but not for ever:
+                // the consumer process may be gone.
+                const auto now = std::chrono::steady_clock::now();
+                if (deadline == std::chrono::steady_clock::time_point{}) {
+                    deadline = now + kTimeout;
+                } else if (now > deadline) {
+                    throw std::runtime_error("Shared memory queue " + name_ + " stays full.");
+                }
+                std::this_thread::yield();
+                pos = segment_->head.load(std::memory_order_relaxed);
+            } else {
+                pos = segment_->head.load(std::memory_order_relaxed);
+            }
+        }
+        slot->type = cache.id;
+        slot->size = static_cast<uint32_t>(task.event_size());
+        std::memcpy(slot->data, task.event_data(), task.event_size());
+        slot->seq.store(pos + 1, std::memory_order_release);
+        // Pairs with the fence in wait_for_task(), so either the consumer sees the task or we see
+        // the waiter.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (segment_->waiters.load(std::memory_order_relaxed) != 0) {
+            segment_->futex.fetch_add(1, std::memory_order_relaxed);
+            futex(FUTEX_WAKE, INT_MAX, nullptr);
+        }
+    }
+
+    // Skips the events the registry doesn't bind.
+    TaskWrapper try_dequeue() {
+        if (!registry_) {
+            return TaskWrapper{};
+        }
+        uint64_t pos = segment_->tail.load(std::memory_order_relaxed);
+        for (;;) {
+            Slot& slot = segment_->slots[pos & mask_];
+            uint64_t seq = slot.seq.load(std::memory_order_acquire);
+            auto diff = static_cast<int64_t>(seq - (pos + 1));
+            if (diff == 0) {
+                if (segment_->tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    const auto type = slot.type;
+                    const size_t size = std::min<size_t>(slot.size, sizeof(slot.data));
+                    alignas(16) unsigned char data[sizeof(slot.data)];
+                    std::memcpy(data, slot.data, size);
+                    slot.seq.store(pos + N, std::memory_order_release);
+                    TaskWrapper result;
+                    if (registry_->bind(type, size, data, result)) {
+                        return result;
+                    }
+                    unbound_.fetch_add(1, std::memory_order_relaxed);
+                    pos = segment_->tail.load(std::memory_order_relaxed);
+                }
+            } else if (diff < 0) {
+                return TaskWrapper{};
+            } else {
+                pos = segment_->tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    size_t size() const {
+        auto tail = segment_->tail.load(std::memory_order_relaxed);
+        auto head = segment_->head.load(std::memory_order_relaxed);
+        return head > tail ? static_cast<size_t>(head - tail) : 0;
+    }
+
+    // Events this consumer took out of the ring and dropped, because the registry has no handler
+    // for their type or target.
+    size_t unbound() const {
+        return unbound_.load(std::memory_order_relaxed);
+    }
+
+    // Called by idle workers instead of spinning: sleeps on the segment futex until a producer
+    // (possibly in another process) enqueues something, or the timeout expires.
+    void wait_for_task(std::chrono::microseconds timeout) {
+        if (!registry_) {
+            std::this_thread::sleep_for(timeout);
+            return;
+        }
+        auto observed = segment_->futex.load(std::memory_order_relaxed);
+        segment_->waiters.fetch_add(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (size() == 0) {
+            auto secs = std::chrono::duration_cast<std::chrono::seconds>(timeout);
+            struct timespec ts{};
+            ts.tv_sec = static_cast<time_t>(secs.count());
+            ts.tv_nsec = static_cast<long>(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(timeout - secs).count());
+            futex(FUTEX_WAIT, observed, &ts);
+        }
+        segment_->waiters.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+private:
+    static constexpr uint32_t kReady = 0x43415442;  // 'CATB'
+    static constexpr uint64_t mask_ = N - 1;
+
+    // An event, see _detail::shm_type_id(). It fits a task, so it fits here too.
+    struct Slot {
+        std::atomic<uint64_t> seq;
+        uint64_t type;
+        uint32_t size;
+        alignas(16) unsigned char data[TaskWrapper::kBufferSize];
+    };
+
+    // Lives in shared memory, so it only contains address-free lock-free atomics and plain data.
+    struct Segment {
+        std::atomic<uint32_t> ready;
+        alignas(64) std::atomic<uint64_t> head;
+        alignas(64) std::atomic<uint64_t> tail;
+        alignas(64) std::atomic<uint32_t> futex;
+        std::atomic<uint32_t> waiters;
+        alignas(64) Slot slots[N];
+    };
+
+    static_assert(std::atomic<uint64_t>::is_always_lock_free, "Need address-free atomics.");
+    static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "Futex word must be 32 bit.");
+
+    // Waits until the creator has sized the segment, which it does with one call, and checks that
+    // it was sized for this queue.
+    void check_size(int fd) {
+        const auto deadline = std::chrono::steady_clock::now() + kTimeout;
+        struct stat st{};
+        for (;;) {
+            if (fstat(fd, &st) != 0) {
+                auto err = errno;
+                close(fd);
+                throw std::system_error(err, std::generic_category(), "fstat");
+            }
+            if (st.st_size != 0) {
+                break;
+            }
+            if (std::chrono::steady_clock::now() > deadline) {
+                close(fd);
+                throw std::runtime_error("Shared memory segment " + name_
+                    + " was not set up by its creator.");
+            }
+            std::this_thread::yield();
+        }
+        if (static_cast<size_t>(st.st_size) != sizeof(Segment)) {
+            close(fd);
+            throw std::runtime_error("Shared memory segment " + name_
+                + " was created for a queue of another size.");
+        }
+    }
+
+    long futex(int op, uint32_t val, const struct timespec* timeout) {
+        // Not FUTEX_PRIVATE_FLAG: waiters and wakers are in different processes.
+        return syscall(SYS_futex, reinterpret_cast<uint32_t*>(&segment_->futex), op, val, timeout,
+            nullptr, 0);
+    }
+
+    std::string name_;
+    // Null on the producer side.
+    std::shared_ptr<const ShmRegistry> registry_;
+    bool creator_{false};
+    Segment* segment_{nullptr};
+    std::atomic<size_t> unbound_{0};
+};
+
+}; // namespace catbus
+
+#endif // __linux__
@@ -0,0 +1,216 @@
+#pragma once
+
+#if defined(__linux__)
+
+#include "task_wrapper.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace catbus {
+
+// Unbounded queue which keeps at most about HighWater tasks in memory. When producers outrun
+// consumers, tasks over the high-water mark are collected into batches of BatchSize, and batches
+// of trivially copyable tasks are written to a memory-mapped temporary file and unmapped, so
+// neither the producers block nor the memory grows. As the queue drains, batches are paged back
+// in FIFO order and their space in the file is reused.
+//
+// Batches containing tasks that are not trivially copyable stay in memory, so only the queues
+// with such events can still grow without bound. Spilled tasks hold handler addresses, which is
+// fine because the file never outlives the process.
+//
+// Like MutexProtectedQueue, it is protected by a mutex. The file I/O happens once per batch.
+template <size_t HighWater = 65536, size_t BatchSize = 512>
+class SpillingQueue {
+    static_assert(BatchSize > 0, "Batch must contain at least one task.");
+public:
+    // 'dir' is where the temporary file is created, 'index' is given by EventCatbus when the
+    // directory is passed to its constructor, and is not used.
+    explicit SpillingQueue(const std::string& dir = "/tmp", size_t index = 0) {
+        (void)index;
+        std::string path = dir + "/catbus_spill.XXXXXX";
+        fd_ = mkstemp(&path[0]);
+        if (fd_ < 0) {
+            throw std::system_error(errno, std::generic_category(), "mkstemp");
+        }
+        // Nobody else needs the file, and this way it's removed even if the process crashes.
+        unlink(path.c_str());
+    }
+
+    ~SpillingQueue() {
+        close(fd_);
+    }
+
+    SpillingQueue(const SpillingQueue&) = delete;
+    SpillingQueue& operator=(const SpillingQueue&) = delete;
+
+    void enqueue(TaskWrapper task) {
+        auto lock = std::unique_lock<std::mutex>{ queue_access_ };
+        if (batches_.empty() && tail_.empty() && head_.size() < HighWater) {
+            head_.push_back(std::move(task));
+            return;
+        }
+        tail_.push_back(std::move(task));
+        if (tail_.size() == BatchSize) {
+            seal_tail();
+        }
+    }
+
+    TaskWrapper try_dequeue() {
+        auto lock = std::unique_lock<std::mutex>{ queue_access_, std::defer_lock };
+        if (!lock.try_lock()) {
+            return TaskWrapper{};
+        }
+        if (head_.empty()) {
+            if (!batches_.empty()) {
+                load_front_batch();
+            } else {
+                for (auto& task : tail_) {
+                    head_.push_back(std::move(task));
+                }
+                tail_.clear();
+            }
+            if (head_.empty()) {
+                return TaskWrapper{};
+            }
+        }
+        auto result = std::move(head_.front());
+        head_.pop_front();
+        return result;
+    }
+
+    size_t size() const {
+        auto lock = std::unique_lock<std::mutex>{ queue_access_ };
+        return head_.size() + batched_ + tail_.size();
+    }
+
+    // Number of tasks currently in the file.
+    size_t spilled() const {
+        auto lock = std::unique_lock<std::mutex>{ queue_access_ };
+        return spilled_;
+    }
+
+    // Total number of tasks that were written to the file.
+    size_t spilled_total() const {
+        auto lock = std::unique_lock<std::mutex>{ queue_access_ };
+        return spilled_total_;
+    }
+
+private:
+    // Chunk of the file holding one batch, rounded up to whole pages, so it can be mapped alone.
+    static size_t chunk_size() {
+        static const size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        return (BatchSize * TaskWrapper::kTrivialSize + page - 1) / page * page;
+    }
+
+    struct Batch {
+        // Offset of the chunk in the file, or kInMemory if the tasks are in 'tasks'.
+        size_t offset;
+        size_t count;
+        std::vector<TaskWrapper> tasks;
+    };
+
+    static constexpr size_t kInMemory = static_cast<size_t>(-1);
+
+    // Called under the mutex.
+    void seal_tail() {
+        batched_ += tail_.size();
+        const bool trivial = std::all_of(tail_.begin(), tail_.end(),
+            [](const TaskWrapper& t) { return t.is_trivially_copyable(); });
+        if (trivial) {
+            auto offset = write_chunk();
+            if (offset != kInMemory) {
+                batches_.push_back(Batch{offset, tail_.size(), {}});
+                spilled_ += tail_.size();
+                spilled_total_ += tail_.size();
+                tail_.clear();
+                return;
+            }
+        }
+        // Not spillable or the file can't grow: keep the batch in memory rather than lose it.
+        batches_.push_back(Batch{kInMemory, tail_.size(), std::move(tail_)});
+        tail_ = std::vector<TaskWrapper>{};
+        tail_.reserve(BatchSize);
+    }
+
+    // Returns the offset the tail was written to, or kInMemory on failure.
+    size_t write_chunk() {
+        size_t offset;
+        if (!free_chunks_.empty()) {
+            offset = free_chunks_.back();
+            free_chunks_.pop_back();
+        } else {
+            offset = file_size_;
+            if (ftruncate(fd_, static_cast<off_t>(file_size_ + chunk_size())) != 0) {
+                return kInMemory;
+            }
+            file_size_ += chunk_size();
+        }
+        void* mem = mmap(nullptr, chunk_size(), PROT_WRITE, MAP_SHARED, fd_,
+            static_cast<off_t>(offset));
+        if (mem == MAP_FAILED) {
+            free_chunks_.push_back(offset);
+            return kInMemory;
+        }
+        auto* raw = static_cast<char*>(mem);
+        for (auto& task : tail_) {
+            task.copy_trivial_to(raw);
+            raw += TaskWrapper::kTrivialSize;
+        }
+        munmap(mem, chunk_size());
+        return offset;
+    }
+
+    // Called under the mutex, when head is empty.
+    void load_front_batch() {
+        auto& batch = batches_.front();
+        if (batch.offset == kInMemory) {
+            for (auto& task : batch.tasks) {
+                head_.push_back(std::move(task));
+            }
+            batched_ -= batch.count;
+            batches_.pop_front();
+            return;
+        }
+        void* mem = mmap(nullptr, chunk_size(), PROT_READ, MAP_SHARED, fd_,
+            static_cast<off_t>(batch.offset));
+        if (mem == MAP_FAILED) {
+            // Keep the batch, the next try_dequeue() will retry.
+            return;
+        }
+        const auto* raw = static_cast<const char*>(mem);
+        for (size_t i = 0; i < batch.count; ++i) {
+            head_.push_back(TaskWrapper::copy_trivial_from(raw + i * TaskWrapper::kTrivialSize));
+        }
+        munmap(mem, chunk_size());
+        free_chunks_.push_back(batch.offset);
+        batched_ -= batch.count;
+        spilled_ -= batch.count;
+        batches_.pop_front();
+    }
+
+    // Tasks are ordered as head_, then batches_, then tail_.
+    std::deque<TaskWrapper> head_;
+    std::deque<Batch> batches_;
+    std::vector<TaskWrapper> tail_;
+    size_t batched_{0};
+    size_t spilled_{0};
+    size_t spilled_total_{0};
+    std::vector<size_t> free_chunks_;
+    size_t file_size_{0};
+    int fd_{-1};
+    mutable std::mutex queue_access_;
+};
+
+}; // namespace catbus
+
+#endif // __linux__
@@ -0,0 +1,148 @@
+#pragma once
+
+#include "dispatch_utils.h"
+#include "exception.h"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace catbus {
+
+// Immutable routing table for a set of consumers on a bus. It is built once, by setup_dispatch()
+// or make_registry(), and shared by pointer between all the senders, so setup is O(N) in time and
+// memory no matter how many consumers have senders, and there is no limit on the number of
+// consumers.
+//
+// Events without target are still dispatched at compile time. For events with target, consumer
+// ids are kept in a table sorted by id, so lookup is a binary search followed by a call through
+// a per-event-type table of send functions, instead of comparing ids of every consumer in turn.
+template<typename Bus, typename... Consumer>
+class ConsumerRegistry {
+public:
+    explicit ConsumerRegistry(Bus& bus, Consumer&... consumers)
+      : bus_{&bus}, consumers_{&consumers...}
+    {
+        add_ids(std::index_sequence_for<Consumer...>{});
+        // Stable, so among consumers with the same id the first one in the pack wins, same as in
+        // dynamic_dispatch().
+        std::stable_sort(ids_.begin(), ids_.end(),
+            [](const IdEntry& a, const IdEntry& b) { return a.id < b.id; });
+    }
+
+    ConsumerRegistry(const ConsumerRegistry&) = delete;
+    ConsumerRegistry& operator=(const ConsumerRegistry&) = delete;
+
+    Bus& bus() const {
+        return *bus_;
+    }
+
+    // Sends event to the consumer selected the same way as static_dispatch() or
+    // dynamic_dispatch() would do it. Throws dispatch_error if there is no consumer for target.
+    template<typename Event>
+    void route(size_t q, Event ev) const noexcept(false) {
+        if constexpr (has_target<Event>::value) {
+            if (!route_targeted(q, ev)) {
+                throw dispatch_error{ev.target};
+            }
+        } else {
+            constexpr auto idx = find_handler_idx<Event, Consumer...>();
+            static_assert(sizeof...(Consumer) > idx, "Handler not found!");
+            _detail::send_task(*bus_, q, std::move(ev), *std::get<idx>(consumers_));
+        }
+    }
+
+    // Same as route(), but events with unknown target go to the bus dead letter queue instead of
+    // throwing. Errors of the queue are still thrown, like with try_dynamic_dispatch().
+    template<typename Event>
+    dispatch_status try_route(size_t q, Event ev) const {
+        if constexpr (has_target<Event>::value) {
+            if (route_targeted(q, ev)) {
+                return dispatch_status::delivered;
+            }
+            auto target = ev.target;
+            return bus_->dead_letters().push(target, std::move(ev))
+                ? dispatch_status::dead_lettered : dispatch_status::dropped;
+        } else {
+            route(q, std::move(ev));
+            return dispatch_status::delivered;
+        }
+    }
+
+    // Returns false if there is no consumer with id_ equal to target and a handler for the event.
+    template<typename Event>
+    bool route_targeted(size_t q, Event& ev) const {
+        static_assert(has_target<Event>::value, "Event does not have 'size_t target' member.");
+        constexpr auto table = make_send_table<Event>(std::index_sequence_for<Consumer...>{});
+        auto it = std::lower_bound(ids_.begin(), ids_.end(), ev.target,
+            [](const IdEntry& e, size_t id) { return e.id < id; });
+        for(; it != ids_.end() && it->id == ev.target; ++it) {
+            if (table[it->index](*bus_, q, ev, consumers_)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    using consumers_type = std::tuple<Consumer*...>;
+
+    template<typename Event>
+    using send_fn = bool (*)(Bus&, size_t, Event&, const consumers_type&);
+
+    struct IdEntry {
+        size_t id;
+        uint32_t index;
+    };
+
+    template<size_t... I>
+    void add_ids(std::index_sequence<I...>) {
+        ids_.reserve(sizeof...(I));
+        (add_id<I>(), ...);
+    }
+
+    template<size_t I>
+    void add_id() {
+        using C = std::tuple_element_t<I, std::tuple<Consumer...>>;
+        if constexpr (has_id<C>::value) {
+            ids_.push_back(IdEntry{std::get<I>(consumers_)->id_, static_cast<uint32_t>(I)});
+        }
+    }
+
+    template<typename Event, size_t I>
+    static bool send_to(Bus& bus, size_t q, Event& ev, const consumers_type& consumers) {
+        using C = std::tuple_element_t<I, std::tuple<Consumer...>>;
+        if constexpr (has_handler<C, Event>::value) {
+            _detail::send_task(bus, q, std::move(ev), *std::get<I>(consumers));
+            return true;
+        } else {
+            return false;
+        }
+    }
+
+    template<typename Event, size_t... I>
+    static constexpr std::array<send_fn<Event>, sizeof...(I)> make_send_table(
+        std::index_sequence<I...>)
+    {
+        return {&send_to<Event, I>...};
+    }
+
+    Bus* bus_;
+    consumers_type consumers_;
+    std::vector<IdEntry> ids_;
+};
+
+// Builds a registry that can be shared between any number of EventSenders.
+template<typename Bus, typename... Consumer>
+std::shared_ptr<const ConsumerRegistry<Bus, Consumer...>> make_registry(
+    Bus& bus, Consumer&... consumers)
+{
+    return std::make_shared<const ConsumerRegistry<Bus, Consumer...>>(bus, consumers...);
+}
+
+}; // namespace catbus
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstddef>
+
+namespace catbus {
+
+// View of a contiguous run of objects, the part of C++20 std::span the library needs. Batch
+// handlers get their events in it (see task_wrapper.h).
+template<typename T>
+class Span {
+public:
+    constexpr Span() noexcept = default;
+
+    constexpr Span(T* data, std::size_t size) noexcept
+      : data_{data}, size_{size}
+    {}
+
+    constexpr T* data() const noexcept {
+        return data_;
+    }
+
+    constexpr std::size_t size() const noexcept {
+        return size_;
+    }
+
+    constexpr bool empty() const noexcept {
+        return size_ == 0;
+    }
+
+    constexpr T& operator[](std::size_t i) const noexcept {
+        return data_[i];
+    }
+
+    constexpr T* begin() const noexcept {
+        return data_;
+    }
+
+    constexpr T* end() const noexcept {
+        return data_ + size_;
+    }
+
+private:
+    T* data_{nullptr};
+    std::size_t size_{0};
+};
+
+}; // namespace catbus
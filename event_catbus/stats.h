@@ -0,0 +1,122 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+namespace catbus {
+
+struct QueueStats {
+    uint64_t depth;
+    // Deepest the queue has been since statistics were enabled, see EventCatbus::enable_stats().
+    uint64_t high_water;
+};
+
+struct WorkerStats {
+    uint64_t tasks;
+    // Tasks taken from queues other than the worker's primary queue.
+    uint64_t steals;
+    // Visits to queues that turned out to be empty.
+    uint64_t empty_scans;
+    uint64_t idle_ns;
+    // Cancelled tasks dropped without running, see cancel.h.
+    uint64_t cancelled;
+};
+
+template<size_t NQ, size_t NWrk>
+struct BusStats {
+    std::array<QueueStats, NQ> queues;
+    std::array<WorkerStats, NWrk> workers;
+    // Tasks run by threads calling poll(), like the ones of an executor, all together.
+    WorkerStats polled;
+};
+
+namespace _detail {
+
+    inline uint64_t steady_now_ns() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // Counters of one worker. Only the worker writes them, so increments are a relaxed load and
+    // store, and any thread can read them. Counters written by several threads, like the ones of
+    // threads calling poll(), are marked 'shared' and use atomic adds.
+    struct alignas(64) WorkerCounters {
+        std::atomic<uint64_t> tasks{0};
+        std::atomic<uint64_t> steals{0};
+        std::atomic<uint64_t> empty_scans{0};
+        std::atomic<uint64_t> idle_ns{0};
+        std::atomic<uint64_t> cancelled{0};
+        // Start of the current idle stretch, or 0 while the worker is busy.
+        std::atomic<uint64_t> idle_since{0};
+
+        bool shared{false};
+
+        void add(std::atomic<uint64_t>& counter, uint64_t value) {
+            if (shared) {
+                counter.fetch_add(value, std::memory_order_relaxed);
+            } else {
+                counter.store(counter.load(std::memory_order_relaxed) + value,
+                    std::memory_order_relaxed);
+            }
+        }
+
+        void begin_idle(uint64_t now) {
+            idle_since.store(now, std::memory_order_relaxed);
+        }
+
+        void end_idle(uint64_t now) {
+            auto since = idle_since.load(std::memory_order_relaxed);
+            if (since != 0) {
+                idle_since.store(0, std::memory_order_relaxed);
+                add(idle_ns, now - since);
+            }
+        }
+
+        // Idle time includes the current idle stretch, so a worker that stays idle is reported
+        // as such before it gets a task.
+        WorkerStats load() const {
+            auto idle = idle_ns.load(std::memory_order_relaxed);
+            auto since = idle_since.load(std::memory_order_relaxed);
+            auto now = steady_now_ns();
+            if (since != 0 && now > since) {
+                idle += now - since;
+            }
+            return WorkerStats{tasks.load(std::memory_order_relaxed),
+                steals.load(std::memory_order_relaxed),
+                empty_scans.load(std::memory_order_relaxed),
+                idle,
+                cancelled.load(std::memory_order_relaxed)};
+        }
+    };
+
+    // Depth counters of one queue, kept by the bus while statistics are enabled, so the depth
+    // can be read without the queue's lock. Producers add to 'enqueued' and raise the high-water
+    // mark, workers add to 'dequeued', which has a cache line of its own.
+    struct alignas(64) QueueCounters {
+        std::atomic<uint64_t> enqueued{0};
+        std::atomic<uint64_t> high_water{0};
+        alignas(64) std::atomic<uint64_t> dequeued{0};
+
+        // 'dropped' is the number of tasks the queue dropped by itself, see DeadlineQueue::shed().
+        // The counters are read one after the other, so a depth can be off for a moment.
+        uint64_t depth(uint64_t dropped = 0) const {
+            auto out = dequeued.load(std::memory_order_relaxed) + dropped;
+            auto in = enqueued.load(std::memory_order_relaxed);
+            return in > out ? in - out : 0;
+        }
+
+        // Most sends only load the mark.
+        void raise(uint64_t depth) {
+            auto prev = high_water.load(std::memory_order_relaxed);
+            while (depth > prev
+                && !high_water.compare_exchange_weak(prev, depth, std::memory_order_relaxed))
+            {}
+        }
+    };
+
+}; // namespace _detail
+
+}; // namespace catbus
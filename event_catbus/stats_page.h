@@ -0,0 +1,295 @@
+#pragma once
+
+#if defined(__linux__)
+
+#include "stats.h"
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace catbus {
+
+// Statistics of a bus as read from a stats page, see StatsReader.
+struct StatsSnapshot {
+    uint32_t pid;
+    // Steady clock time of the publication, comparable with other processes on the same host.
+    uint64_t updated_ns;
+    std::vector<QueueStats> queues;
+    std::vector<WorkerStats> workers;
+};
+
+namespace _detail {
+
+    constexpr uint64_t kStatsPageMagic = 0x5441545353554243; // "CBUSSTAT"
+    constexpr uint32_t kStatsPageVersion = 2;
+
+    // The page is the header followed by 2 values per queue and 5 per worker, in the order of
+    // QueueStats and WorkerStats fields.
+    struct StatsPageHeader {
+        std::atomic<uint64_t> magic;
+        uint32_t version;
+        uint32_t queues;
+        uint32_t workers;
+        uint32_t pid;
+        // Seqlock: odd while the publisher writes the values.
+        std::atomic<uint64_t> seq;
+        std::atomic<uint64_t> updated_ns;
+    };
+
+    constexpr size_t kQueueValues = sizeof(QueueStats) / sizeof(uint64_t);
+    constexpr size_t kWorkerValues = sizeof(WorkerStats) / sizeof(uint64_t);
+
+    inline size_t stats_page_size(size_t queues, size_t workers) {
+        return sizeof(StatsPageHeader)
+            + (queues * kQueueValues + workers * kWorkerValues) * sizeof(uint64_t);
+    }
+
+    inline std::atomic<uint64_t>* stats_page_values(StatsPageHeader* header) {
+        return reinterpret_cast<std::atomic<uint64_t>*>(header + 1);
+    }
+
+}; // namespace _detail
+
+// Publishes statistics of a bus (see EventCatbus::stats()) to a named POSIX shared memory
+// segment, so that other processes, like the catbus_stat tool, can watch the bus live. Readers
+// never block the publisher: the values are guarded by a sequence lock, and a reader which saw
+// them change while copying just tries again.
+//
+// A thread publishes every 'period', and publish() can be called for an immediate update.
+// Creating the publisher enables the queue counters of the bus (see EventCatbus::enable_stats()),
+// so publishing doesn't lock the queues. The bus must outlive it.
+// The segment is unlinked by the destructor. A segment left by a process that no longer runs is
+// replaced, one of a running process makes the constructor throw.
+template<typename Bus>
+class StatsPublisher {
+public:
+    StatsPublisher(Bus& bus, const std::string& name,
+        std::chrono::milliseconds period = std::chrono::milliseconds{100})
+      : bus_{bus}, name_{name}, period_{period}
+    {
+        bus_.enable_stats();
+        auto stats = bus_.stats();
+        queues_ = stats.queues.size();
+        workers_ = stats.workers.size();
+        size_ = _detail::stats_page_size(queues_, workers_);
+        int fd = create();
+        if (ftruncate(fd, static_cast<off_t>(size_)) != 0) {
+            auto err = errno;
+            close(fd);
+            shm_unlink(name_.c_str());
+            throw std::system_error(err, std::generic_category(), "ftruncate");
+        }
+        void* mem = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (mem == MAP_FAILED) {
+            auto err = errno;
+            shm_unlink(name_.c_str());
+            throw std::system_error(err, std::generic_category(), "mmap");
+        }
+        header_ = static_cast<_detail::StatsPageHeader*>(mem);
+        header_->version = _detail::kStatsPageVersion;
+        header_->queues = static_cast<uint32_t>(queues_);
+        header_->workers = static_cast<uint32_t>(workers_);
+        header_->pid = static_cast<uint32_t>(getpid());
+        header_->magic.store(_detail::kStatsPageMagic, std::memory_order_release);
+        publish();
+        thread_ = std::thread([this] { run(); });
+    }
+
+    ~StatsPublisher() {
+        {
+            auto lock = std::unique_lock<std::mutex>{ stop_access_ };
+            stop_ = true;
+        }
+        stop_cv_.notify_one();
+        thread_.join();
+        munmap(header_, size_);
+        shm_unlink(name_.c_str());
+    }
+
+    StatsPublisher(const StatsPublisher&) = delete;
+    StatsPublisher& operator=(const StatsPublisher&) = delete;
+
+    void publish() {
+        auto stats = bus_.stats();
+        auto lock = std::unique_lock<std::mutex>{ publish_access_ };
+        auto* values = _detail::stats_page_values(header_);
+        auto seq = header_->seq.load(std::memory_order_relaxed);
+        header_->seq.store(seq + 1, std::memory_order_relaxed);
+        // Keeps the stores of the values after the odd sequence number.
+        std::atomic_thread_fence(std::memory_order_release);
+        for (auto& q : stats.queues) {
+            (values++)->store(q.depth, std::memory_order_relaxed);
+            (values++)->store(q.high_water, std::memory_order_relaxed);
+        }
+        for (auto& w : stats.workers) {
+            (values++)->store(w.tasks, std::memory_order_relaxed);
+            (values++)->store(w.steals, std::memory_order_relaxed);
+            (values++)->store(w.empty_scans, std::memory_order_relaxed);
+            (values++)->store(w.idle_ns, std::memory_order_relaxed);
+            (values++)->store(w.cancelled, std::memory_order_relaxed);
+        }
+        header_->updated_ns.store(_detail::steady_now_ns(), std::memory_order_relaxed);
+        header_->seq.store(seq + 2, std::memory_order_release);
+    }
+
+private:
+    int create() {
+        for (;;) {
+            int fd = shm_open(name_.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+            if (fd >= 0) {
+                return fd;
+            }
+            if (errno != EEXIST) {
+                throw std::system_error(errno, std::generic_category(), "shm_open");
+            }
+            if (owner_alive()) {
+                throw std::system_error(EEXIST, std::generic_category(),
+                    "stats page " + name_ + " is published by a running process");
+            }
+            shm_unlink(name_.c_str());
+        }
+    }
+
+    bool owner_alive() const {
+        int fd = shm_open(name_.c_str(), O_RDONLY, 0);
+        if (fd < 0) {
+            return false;
+        }
+        bool alive = false;
+        struct stat st{};
+        if (fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) >= sizeof(_detail::StatsPageHeader)) {
+            void* mem = mmap(nullptr, sizeof(_detail::StatsPageHeader), PROT_READ, MAP_SHARED, fd, 0);
+            if (mem != MAP_FAILED) {
+                auto* header = static_cast<const _detail::StatsPageHeader*>(mem);
+                auto pid = static_cast<pid_t>(header->pid);
+                alive = header->magic.load(std::memory_order_acquire) == _detail::kStatsPageMagic
+                    && pid != 0 && (kill(pid, 0) == 0 || errno == EPERM);
+                munmap(mem, sizeof(_detail::StatsPageHeader));
+            }
+        }
+        close(fd);
+        return alive;
+    }
+
+    void run() {
+        auto lock = std::unique_lock<std::mutex>{ stop_access_ };
+        while (!stop_cv_.wait_for(lock, period_, [this] { return stop_; })) {
+            lock.unlock();
+            publish();
+            lock.lock();
+        }
+    }
+
+    Bus& bus_;
+    std::string name_;
+    std::chrono::milliseconds period_;
+    size_t queues_{0};
+    size_t workers_{0};
+    size_t size_{0};
+    _detail::StatsPageHeader* header_{nullptr};
+    std::mutex publish_access_;
+    std::mutex stop_access_;
+    std::condition_variable stop_cv_;
+    bool stop_{false};
+    std::thread thread_;
+};
+
+// Reads a stats page published by StatsPublisher, possibly in another process. Throws
+// std::system_error if the page doesn't exist or isn't a stats page.
+class StatsReader {
+public:
+    explicit StatsReader(const std::string& name) {
+        int fd = shm_open(name.c_str(), O_RDONLY, 0);
+        if (fd < 0) {
+            throw std::system_error(errno, std::generic_category(), "shm_open " + name);
+        }
+        struct stat st{};
+        if (fstat(fd, &st) != 0) {
+            auto err = errno;
+            close(fd);
+            throw std::system_error(err, std::generic_category(), "fstat");
+        }
+        size_ = static_cast<size_t>(st.st_size);
+        void* mem = size_ >= sizeof(_detail::StatsPageHeader)
+            ? mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+        auto err = errno;
+        close(fd);
+        if (mem == MAP_FAILED) {
+            throw std::system_error(size_ == 0 ? EINVAL : err, std::generic_category(), "mmap");
+        }
+        header_ = static_cast<_detail::StatsPageHeader*>(mem);
+        if (header_->magic.load(std::memory_order_acquire) != _detail::kStatsPageMagic
+            || header_->version != _detail::kStatsPageVersion
+            || _detail::stats_page_size(header_->queues, header_->workers) > size_)
+        {
+            munmap(header_, size_);
+            throw std::system_error(EINVAL, std::generic_category(), name + " is not a stats page");
+        }
+    }
+
+    ~StatsReader() {
+        munmap(header_, size_);
+    }
+
+    StatsReader(const StatsReader&) = delete;
+    StatsReader& operator=(const StatsReader&) = delete;
+
+    // Returns false if no consistent copy could be taken, e.g. because the publisher died in the
+    // middle of an update.
+    bool read(StatsSnapshot& snapshot) const {
+        snapshot.pid = header_->pid;
+        snapshot.queues.resize(header_->queues);
+        snapshot.workers.resize(header_->workers);
+        for (int attempt = 0; attempt < kMaxAttempts; ++attempt) {
+            auto seq = header_->seq.load(std::memory_order_acquire);
+            if (seq & 1) {
+                std::this_thread::yield();
+                continue;
+            }
+            const auto* values = _detail::stats_page_values(header_);
+            for (auto& q : snapshot.queues) {
+                q.depth = (values++)->load(std::memory_order_relaxed);
+                q.high_water = (values++)->load(std::memory_order_relaxed);
+            }
+            for (auto& w : snapshot.workers) {
+                w.tasks = (values++)->load(std::memory_order_relaxed);
+                w.steals = (values++)->load(std::memory_order_relaxed);
+                w.empty_scans = (values++)->load(std::memory_order_relaxed);
+                w.idle_ns = (values++)->load(std::memory_order_relaxed);
+                w.cancelled = (values++)->load(std::memory_order_relaxed);
+            }
+            snapshot.updated_ns = header_->updated_ns.load(std::memory_order_relaxed);
+            // Keeps the loads of the values before the second load of the sequence number.
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (header_->seq.load(std::memory_order_relaxed) == seq) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    static constexpr int kMaxAttempts = 1000;
+
+    _detail::StatsPageHeader* header_{nullptr};
+    size_t size_{0};
+};
+
+}; // namespace catbus
+
+#endif // __linux__
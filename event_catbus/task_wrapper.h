@@ -1,21 +1,156 @@
 #pragma once
 
+#include "span.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <new>
 #include <type_traits>
+#include <typeinfo>
 #include <utility>
 
 namespace catbus {
 
 namespace _detail {
+    // Most tasks a worker passes to one handle_batch() call.
+    inline constexpr std::size_t kMaxBatch = 64;
+
     struct vtable {
         void (*run)(void* ptr, std::size_t q);
 
         void (*destroy_)(void* ptr);
         void (*clone)(void* storage, const void* ptr);
         void (*move_clone)(void* storage, void* ptr);
+
+        // Handler and event can be copied bytewise, e.g. into shared memory.
+        bool trivially_copyable;
+        std::size_t handler_size;
+
+        // Access to the event alone, e.g. for journaling.
+        const std::type_info* event_type;
+        std::size_t event_size;
+        bool event_trivially_copyable;
+        const void* (*event)(const void* ptr);
+
+        // Null unless the handler has 'bool claim()', which decides whether the task still has to
+        // run, e.g. it returns false for cancelled tasks (see cancel.h).
+        bool (*claim)(void* ptr);
+
+        // Null unless the handler has 'void discard()', which undoes what sending the task did,
+        // like giving back a credit or a pending count, when the task is dropped without running.
+        void (*discard)(void* ptr);
+
+        // Null unless the handler has 'handle_batch(Span<Event>, size_t)'. Runs 'n' tasks which
+        // lie 'stride' bytes apart and have equal handlers, with one call.
+        void (*run_batch)(void* first, std::size_t stride, std::size_t n, std::size_t q);
+
+        // Null unless the event has 'uint64_t deadline_ns', see queue_deadline.h.
+        std::uint64_t (*deadline)(const void* ptr);
     };
 
+    template<typename Handler, typename = void>
+    struct has_claim : std::false_type {};
+
+    template<typename Handler>
+    struct has_claim<Handler, std::void_t<decltype(bool{std::declval<Handler&>().claim()})>>
+        : std::true_type {};
+
+    template<typename Handler, typename Event>
+    constexpr bool (*claim_for())(void*) {
+        if constexpr (has_claim<Handler>::value) {
+            return [](void* ptr) {
+                return static_cast<std::pair<Handler, Event>*>(ptr)->first.claim();
+            };
+        } else {
+            return nullptr;
+        }
+    }
+
+    template<typename Handler, typename = void>
+    struct has_discard : std::false_type {};
+
+    template<typename Handler>
+    struct has_discard<Handler, std::void_t<decltype(std::declval<Handler&>().discard())>>
+        : std::true_type {};
+
+    template<typename Handler, typename Event>
+    constexpr void (*discard_for())(void*) {
+        if constexpr (has_discard<Handler>::value) {
+            return [](void* ptr) {
+                static_cast<std::pair<Handler, Event>*>(ptr)->first.discard();
+            };
+        } else {
+            return nullptr;
+        }
+    }
+
+    template<typename Event, typename = void>
+    struct has_deadline : std::false_type {};
+
+    template<typename Event>
+    struct has_deadline<Event, std::void_t<std::enable_if_t<
+        std::is_same_v<decltype(Event::deadline_ns), std::uint64_t>>>> : std::true_type {};
+
     template<typename Handler, typename Event>
-    constexpr vtable vtable_for {
+    constexpr std::uint64_t (*deadline_for())(const void*) {
+        if constexpr (has_deadline<Event>::value) {
+            return [](const void* ptr) {
+                return static_cast<const std::pair<Handler, Event>*>(ptr)->second.deadline_ns;
+            };
+        } else {
+            return nullptr;
+        }
+    }
+
+    template<typename Handler, typename Event, typename = void>
+    struct has_batch_handler : std::false_type {};
+
+    template<typename Handler, typename Event>
+    struct has_batch_handler<Handler, Event, std::void_t<decltype(
+        std::declval<Handler&>()->handle_batch(std::declval<Span<Event>>(), std::size_t{}))>>
+        : std::true_type {};
+
+    // Handlers are compared bytewise to find tasks for the same consumer, so only trivially
+    // copyable ones (pointers and the library's wrappers of them) are batched. Handlers which
+    // decide per task whether it runs (see cancel.h) are not.
+    template<typename Handler, typename Event>
+    constexpr void (*batch_for())(void*, std::size_t, std::size_t, std::size_t) {
+        if constexpr (has_batch_handler<Handler, Event>::value
+            && std::is_trivially_copyable_v<Handler> && !has_claim<Handler>::value)
+        {
+            return [](void* first, std::size_t stride, std::size_t n, std::size_t q) {
+                using Task = std::pair<Handler, Event>;
+                // Events are moved out of the tasks into a contiguous array for the span.
+                struct Events {
+                    std::aligned_storage_t<sizeof(Event), alignof(Event)> storage[kMaxBatch];
+                    std::size_t size{0};
+
+                    Event* data() {
+                        return reinterpret_cast<Event*>(storage);
+                    }
+
+                    ~Events() {
+                        for (std::size_t i = 0; i < size; ++i) {
+                            data()[i].~Event();
+                        }
+                    }
+                } events;
+                for (; events.size < n; ++events.size) {
+                    auto* task = static_cast<Task*>(static_cast<void*>(
+                        static_cast<char*>(first) + events.size * stride));
+                    new (&events.storage[events.size]) Event{std::move(task->second)};
+                }
+                static_cast<Task*>(first)->first->handle_batch(
+                    Span<Event>{events.data(), n}, q);
+            };
+        } else {
+            return nullptr;
+        }
+    }
+
+    template<typename Handler, typename Event>
+    inline constexpr vtable vtable_for {
         [](void* ptr, std::size_t q) {
             auto* p = static_cast<std::pair<Handler, Event>*>(ptr);
             p->first->handle(std::move(p->second), q);
@@ -31,7 +166,24 @@ namespace _detail {
         [](void* storage, void* ptr) {
             new (storage) std::pair<Handler, Event>{
                 std::move(*static_cast<std::pair<Handler, Event>*>(ptr))};
-        }
+        },
+
+        std::is_trivially_copyable_v<Handler> && std::is_trivially_copyable_v<Event>,
+        sizeof(Handler),
+
+        &typeid(Event),
+        sizeof(Event),
+        std::is_trivially_copyable_v<Event>,
+        [](const void* ptr) -> const void* {
+            return &static_cast<const std::pair<Handler, Event>*>(ptr)->second;
+        },
+
+        claim_for<Handler, Event>(),
+        discard_for<Handler, Event>(),
+
+        batch_for<Handler, Event>(),
+
+        deadline_for<Handler, Event>()
     };
 };  // namespace detail
 
@@ -49,8 +201,7 @@ public:
     TaskWrapper(Handler x, Event c)
         : vtable_{&_detail::vtable_for<Handler, Event>}
     {
-        static_assert(sizeof(std::pair<Handler, Event>) <= sizeof(buf_),
-            "Wrapper buffer is too small!");
+        static_assert(fits<Handler, Event>, "Wrapper buffer is too small!");
         new(&buf_) std::pair<Handler, Event>{std::move(x), std::move(c)};
     }
 
@@ -60,13 +211,21 @@ public:
         }
     }
 
-    TaskWrapper(const TaskWrapper& other) {
-        other.vtable_->clone(&buf_, &other.buf_);
+    TaskWrapper(const TaskWrapper& other)
+        : enqueued_ns_{other.enqueued_ns_}
+    {
+        if (other.vtable_) {
+            other.vtable_->clone(&buf_, &other.buf_);
+        }
         vtable_ = other.vtable_;
     }
 
-    TaskWrapper(TaskWrapper&& other) noexcept {
-        other.vtable_->move_clone(&buf_, &other.buf_);
+    TaskWrapper(TaskWrapper&& other) noexcept
+        : enqueued_ns_{other.enqueued_ns_}
+    {
+        if (other.vtable_) {
+            other.vtable_->move_clone(&buf_, &other.buf_);
+        }
         vtable_ = other.vtable_;
         other.vtable_ = nullptr;
     }
@@ -79,6 +238,7 @@ public:
             other.vtable_->clone(&buf_, &other.buf_);
         }
         vtable_ = other.vtable_;
+        enqueued_ns_ = other.enqueued_ns_;
         return *this;
     }
 
@@ -90,6 +250,7 @@ public:
             other.vtable_->move_clone(&buf_, &other.buf_);
         }
         vtable_ = other.vtable_;
+        enqueued_ns_ = other.enqueued_ns_;
         other.vtable_ = nullptr;
         return *this;
     }
@@ -102,9 +263,132 @@ public:
         return vtable_ != nullptr;
     }
 
+    // Called by the worker before run(). When it returns false the task must be dropped without
+    // running. Most tasks don't have a check, it costs them a load from the vtable.
+    bool claim() {
+        return vtable_->claim == nullptr || vtable_->claim(&buf_);
+    }
+
+    // Called instead of run() by whoever drops a task without running it, e.g. a queue shedding
+    // late tasks. claim() returning false already counts as dropped, and must not be followed by
+    // discard().
+    void discard() {
+        if (vtable_->discard) {
+            vtable_->discard(&buf_);
+        }
+    }
+
+    bool is_trivially_copyable() const {
+        return vtable_ == nullptr || vtable_->trivially_copyable;
+    }
+
+    // Most tasks run_batch() takes at once.
+    static constexpr std::size_t kMaxBatch = _detail::kMaxBatch;
+
+    // Room for the handler and the event.
+    static constexpr std::size_t kBufferSize = 64;
+
+    // True if a task can carry the event to the handler.
+    template<typename Handler, typename Event>
+    static constexpr bool fits = sizeof(std::pair<Handler, Event>) <= kBufferSize;
+
+    // True if the handler has a batch handler for the event, the task must be valid.
+    bool can_batch() const {
+        return vtable_->run_batch != nullptr;
+    }
+
+    // True if both tasks carry the same event type to the same batch handler, so they can go
+    // to one run_batch() call.
+    bool batches_with(const TaskWrapper& other) const {
+        return vtable_ == other.vtable_ && vtable_ != nullptr && vtable_->run_batch != nullptr
+            && std::memcmp(&buf_, &other.buf_, vtable_->handler_size) == 0;
+    }
+
+    // Runs up to kMaxBatch tasks, which all batch with the first one, with a single call of
+    // the handler's handle_batch(). The events are moved out, the tasks still have to be
+    // destroyed.
+    static void run_batch(TaskWrapper* tasks, std::size_t n, std::size_t q) {
+        tasks->vtable_->run_batch(&tasks->buf_, sizeof(TaskWrapper), n, q);
+    }
+
+    // Address of the consumer the task goes to, e.g. to tell consumers apart. Handlers made by
+    // the library are the consumer pointer or wrappers which start with it. The task must be
+    // valid.
+    const void* consumer() const {
+        const void* result;
+        std::memcpy(&result, &buf_, sizeof(result));
+        return result;
+    }
+
+    // Returned by deadline_ns() for events without a deadline.
+    static constexpr std::uint64_t kNoDeadline = UINT64_MAX;
+
+    // Deadline of the event on the steady clock, in nanoseconds, or kNoDeadline. The task must
+    // be valid.
+    std::uint64_t deadline_ns() const {
+        return vtable_->deadline ? vtable_->deadline(&buf_) : kNoDeadline;
+    }
+
+    // Size of the raw representation used by copy_trivial_to() and copy_trivial_from().
+    static constexpr std::size_t kTrivialSize = kBufferSize + sizeof(const _detail::vtable*);
+
+    // Writes the task as raw bytes, only valid if is_trivially_copyable() is true. The bytes
+    // contain the handler and vtable addresses, so they can only be turned back into a task by a
+    // process with the same address layout, e.g. a fork of the same parent.
+    void copy_trivial_to(void* raw) const {
+        std::memcpy(raw, &buf_, kBufferSize);
+        std::memcpy(static_cast<char*>(raw) + kBufferSize, &vtable_, sizeof(vtable_));
+    }
+
+    static TaskWrapper copy_trivial_from(const void* raw) {
+        TaskWrapper result;
+        std::memcpy(&result.buf_, raw, kBufferSize);
+        std::memcpy(&result.vtable_, static_cast<const char*>(raw) + kBufferSize,
+            sizeof(result.vtable_));
+        return result;
+    }
+
+    // Type, size and address of the stored event, the task must be valid.
+    const std::type_info& event_type() const {
+        return *vtable_->event_type;
+    }
+
+    std::size_t event_size() const {
+        return vtable_->event_size;
+    }
+
+    bool is_event_trivially_copyable() const {
+        return vtable_->event_trivially_copyable;
+    }
+
+    const void* event_data() const {
+        return vtable_->event(&buf_);
+    }
+
+    // Time the task was sent, set by EventCatbus only while tracing (see trace.h). It takes what
+    // used to be tail padding, so the size of the wrapper doesn't change.
+    void set_enqueued_ns(std::uint64_t ns) {
+        enqueued_ns_ = ns;
+    }
+
+    std::uint64_t enqueued_ns() const {
+        return enqueued_ns_;
+    }
+
+    // Returns stored handler and event if they have given types, nullptr otherwise. Works like
+    // std::function::target().
+    template<typename Handler, typename Event>
+    std::pair<Handler, Event>* target() {
+        if (vtable_ != &_detail::vtable_for<Handler, Event>) {
+            return nullptr;
+        }
+        return reinterpret_cast<std::pair<Handler, Event>*>(&buf_);
+    }
+
 private:
-    std::aligned_storage_t<64> buf_;
+    std::aligned_storage_t<kBufferSize> buf_;
     const _detail::vtable* vtable_;
+    std::uint64_t enqueued_ns_{0};
 };
 
 };
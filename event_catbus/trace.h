@@ -0,0 +1,252 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <type_traits>
+#include <typeinfo>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__GNUG__)
+#include <cxxabi.h>
+#endif
+
+namespace catbus {
+
+// One handled task. Times are steady clock nanoseconds.
+struct TraceRecord {
+    const std::type_info* event_type;
+    uint64_t enqueued_ns;
+    uint64_t start_ns;
+    uint64_t end_ns;
+    uint32_t queue;
+    uint32_t primary;
+};
+
+// Collects a record of every task handled by a bus that traces to it, see
+// EventCatbus::trace_to(). Each thread that handles tasks gets a ring of its own the first time
+// it records, without locks or shared cache lines, so workers, threads that poll() and the
+// workers of several buses can share a tracer. When a ring is full the oldest records are
+// overwritten; threads that come after all rings are taken are not recorded, see lost(). The
+// rings can be exported in Chrome trace-event JSON, which chrome://tracing and Perfetto open:
+// every thread is a track with a span per task, and the time each task waited in its queue is
+// shown as an async span on a per-queue track.
+class Tracer {
+public:
+    // 'threads' is the number of rings, one per thread that handles tasks.
+    explicit Tracer(size_t threads, size_t capacity = 65536)
+      : id_{next_id().fetch_add(1, std::memory_order_relaxed) + 1}
+      , rings_(threads == 0 ? 1 : threads)
+    {
+        for (auto& ring : rings_) {
+            ring.capacity = capacity == 0 ? 1 : capacity;
+            ring.records = std::make_unique<Slot[]>(ring.capacity);
+        }
+    }
+
+    Tracer(const Tracer&) = delete;
+    Tracer& operator=(const Tracer&) = delete;
+
+    static uint64_t now_ns() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // Writes to the ring of the calling thread.
+    void record(const TraceRecord& record) {
+        const auto index = ring_of_thread();
+        if (index >= rings_.size()) {
+            lost_.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        auto& ring = rings_[index];
+        auto head = ring.head.load(std::memory_order_relaxed);
+        auto& slot = ring.records[head % ring.capacity];
+        // The sequence is odd while the record is written, and 2 * (position + 1) after.
+        slot.seq.store(2 * head + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        uint64_t words[kWords];
+        std::memcpy(words, &record, sizeof(record));
+        for (size_t i = 0; i < kWords; ++i) {
+            slot.words[i].store(words[i], std::memory_order_relaxed);
+        }
+        slot.seq.store(2 * head + 2, std::memory_order_release);
+        ring.head.store(head + 1, std::memory_order_release);
+    }
+
+    // Takes a consistent copy of the records of one ring, oldest first. Records overwritten
+    // while copying are left out.
+    std::vector<TraceRecord> snapshot(size_t ring_index) const {
+        const auto& ring = rings_[ring_index % rings_.size()];
+        auto head = ring.head.load(std::memory_order_acquire);
+        auto first = head > ring.capacity ? head - ring.capacity : 0;
+        std::vector<TraceRecord> result;
+        result.reserve(head - first);
+        for (auto i = first; i < head; ++i) {
+            const auto& slot = ring.records[i % ring.capacity];
+            if (slot.seq.load(std::memory_order_acquire) != 2 * i + 2) {
+                continue;
+            }
+            uint64_t words[kWords];
+            for (size_t w = 0; w < kWords; ++w) {
+                words[w] = slot.words[w].load(std::memory_order_relaxed);
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (slot.seq.load(std::memory_order_relaxed) != 2 * i + 2) {
+                continue;
+            }
+            TraceRecord record;
+            std::memcpy(&record, words, sizeof(record));
+            result.push_back(record);
+        }
+        return result;
+    }
+
+    // Number of rings.
+    size_t rings() const {
+        return rings_.size();
+    }
+
+    // Rings taken by threads so far.
+    size_t threads() const {
+        return std::min(next_ring_.load(std::memory_order_relaxed), rings_.size());
+    }
+
+    // Records not written because all rings were taken.
+    uint64_t lost() const {
+        return lost_.load(std::memory_order_relaxed);
+    }
+
+    void write_chrome_json(std::ostream& out) const {
+        std::vector<std::vector<TraceRecord>> records;
+        uint64_t origin = UINT64_MAX;
+        for (size_t w = 0; w < threads(); ++w) {
+            records.push_back(snapshot(w));
+            for (auto& r : records.back()) {
+                origin = std::min(origin, r.enqueued_ns ? r.enqueued_ns : r.start_ns);
+            }
+        }
+        auto us = [origin](uint64_t ns) { return std::to_string((ns - origin) / 1000.0); };
+        std::unordered_map<const std::type_info*, std::string> names;
+        const char* sep = "";
+        out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+        for (size_t w = 0; w < records.size(); ++w) {
+            out << sep << "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":" << w
+                << ",\"args\":{\"name\":\"thread " << w << "\"}}";
+            sep = ",\n";
+            uint64_t seq = 0;
+            for (auto& r : records[w]) {
+                auto it = names.find(r.event_type);
+                if (it == names.end()) {
+                    it = names.emplace(r.event_type, type_name(*r.event_type)).first;
+                }
+                const auto& name = it->second;
+                out << sep << "{\"ph\":\"X\",\"cat\":\"task\",\"name\":\"" << name
+                    << "\",\"pid\":1,\"tid\":" << w << ",\"ts\":" << us(r.start_ns)
+                    << ",\"dur\":" << (r.end_ns - r.start_ns) / 1000.0
+                    << ",\"args\":{\"queue\":" << r.queue
+                    << ",\"stolen\":" << (r.queue != r.primary ? "true" : "false") << "}}";
+                if (r.enqueued_ns != 0 && r.enqueued_ns <= r.start_ns) {
+                    auto id = (static_cast<uint64_t>(w) << 48) | seq++;
+                    out << sep << "{\"ph\":\"b\",\"cat\":\"queue\",\"name\":\"" << name
+                        << "\",\"id\":" << id << ",\"pid\":2,\"tid\":" << r.queue
+                        << ",\"ts\":" << us(r.enqueued_ns) << "}";
+                    out << sep << "{\"ph\":\"e\",\"cat\":\"queue\",\"name\":\"" << name
+                        << "\",\"id\":" << id << ",\"pid\":2,\"tid\":" << r.queue
+                        << ",\"ts\":" << us(r.start_ns) << "}";
+                }
+            }
+        }
+        out << sep << "{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":1,"
+            << "\"args\":{\"name\":\"threads\"}},\n"
+            << "{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":2,"
+            << "\"args\":{\"name\":\"queue wait\"}}]}\n";
+    }
+
+    // Returns false if the file can't be written.
+    bool write_chrome_json(const std::string& path) const {
+        std::ofstream out{path};
+        write_chrome_json(out);
+        return static_cast<bool>(out);
+    }
+
+private:
+    static_assert(sizeof(TraceRecord) % sizeof(uint64_t) == 0
+        && std::is_trivially_copyable<TraceRecord>::value, "Records are copied as words.");
+    static constexpr size_t kWords = sizeof(TraceRecord) / sizeof(uint64_t);
+
+    // A record is stored as atomic words under a sequence number, so that a snapshot taken
+    // while the ring wraps around sees either the whole record or that it changed.
+    struct Slot {
+        std::atomic<uint64_t> seq{0};
+        std::atomic<uint64_t> words[kWords];
+    };
+
+    struct alignas(64) Ring {
+        std::unique_ptr<Slot[]> records;
+        size_t capacity{0};
+        std::atomic<uint64_t> head{0};
+    };
+
+    // Tracers are told apart by an id rather than their address, which a new one can reuse.
+    static std::atomic<uint64_t>& next_id() {
+        static std::atomic<uint64_t> id{0};
+        return id;
+    }
+
+    // Index of the calling thread's ring in this tracer, handed out on its first record. The
+    // last tracer is looked up first, a thread usually records to one.
+    size_t ring_of_thread() {
+        struct Known {
+            uint64_t tracer;
+            size_t ring;
+        };
+        static thread_local Known last{0, 0};
+        static thread_local std::vector<Known> known;
+        if (last.tracer == id_) {
+            return last.ring;
+        }
+        auto it = std::find_if(known.begin(), known.end(),
+            [this](const Known& k) { return k.tracer == id_; });
+        if (it == known.end()) {
+            known.push_back(Known{id_, next_ring_.fetch_add(1, std::memory_order_relaxed)});
+            it = known.end() - 1;
+        }
+        last = *it;
+        return last.ring;
+    }
+
+    static std::string type_name(const std::type_info& type) {
+        std::string name = type.name();
+#if defined(__GNUG__)
+        int status = 0;
+        if (char* demangled = abi::__cxa_demangle(type.name(), nullptr, nullptr, &status)) {
+            name = demangled;
+            std::free(demangled);
+        }
+#endif
+        std::string escaped;
+        for (char c : name) {
+            if (c == '"' || c == '\\') {
+                escaped += '\\';
+            }
+            escaped += c;
+        }
+        return escaped;
+    }
+
+    const uint64_t id_;
+    std::vector<Ring> rings_;
+    std::atomic<size_t> next_ring_{0};
+    std::atomic<uint64_t> lost_{0};
+};
+
+}; // namespace catbus
@@ -0,0 +1,212 @@
+#pragma once
+
+#include "executor.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace catbus {
+
+// One set of worker threads for many buses. Every bus has its own threads otherwise, so a process
+// with many buses (e.g. one per OrderedEventsProcessor-like consumer) ends up with far more
+// threads than cores, all polling. Buses created with NWrk == 0 have no threads and can be
+// attached here instead:
+//
+//     SharedWorkerPool pool;  // a thread per core
+//     EventCatbus<MutexProtectedQueue, 4, 0> a, b;
+//     pool.attach(a);
+//     pool.attach(b, 3);
+//
+// Each thread goes over the attached buses in rounds and lets every bus run up to weight *
+// kQuantum tasks per round, so under load a bus with weight 3 gets three times the share of one
+// with weight 1. Threads that find nothing to do for a while sleep until a task is sent to one of
+// the buses. A bus detaches itself in its destructor. A bus must not be attached or detached
+// from a handler running on the pool.
+class SharedWorkerPool : public Executor {
+public:
+    static constexpr size_t kQuantum = 16;
+
+    explicit SharedWorkerPool(size_t threads = std::thread::hardware_concurrency())
+      : entries_{std::make_shared<const std::vector<Entry>>()}
+    {
+        threads_.resize(threads == 0 ? 1 : threads);
+        rounds_ = std::make_unique<Round[]>(threads_.size());
+        for (size_t i = 0; i < threads_.size(); ++i) {
+            threads_[i] = std::thread([this, i] { work(i); });
+        }
+    }
+
+    ~SharedWorkerPool() {
+        {
+            auto lock = std::unique_lock<std::mutex>{ sleep_access_ };
+            stop_.store(true, std::memory_order_relaxed);
+        }
+        sleep_cv_.notify_all();
+        for (auto& t : threads_) {
+            t.join();
+        }
+        auto lock = std::unique_lock<std::mutex>{ entries_access_ };
+        for (auto& entry : *entries_) {
+            entry.unbind(entry.bus);
+        }
+    }
+
+    SharedWorkerPool(const SharedWorkerPool&) = delete;
+    SharedWorkerPool& operator=(const SharedWorkerPool&) = delete;
+
+    template<typename Bus>
+    void attach(Bus& bus, size_t weight = 1) {
+        auto lock = std::unique_lock<std::mutex>{ entries_access_ };
+        auto entries = std::make_shared<std::vector<Entry>>(*entries_);
+        entries->push_back(Entry{&bus,
+            [](void* bus, size_t budget, size_t worker) {
+                return static_cast<Bus*>(bus)->poll(budget, worker);
+            },
+            [](void* bus) { return static_cast<Bus*>(bus)->has_tasks(); },
+            [](void* bus) { static_cast<Bus*>(bus)->set_executor(nullptr); },
+            std::max<size_t>(weight, 1) * kQuantum});
+        std::atomic_store(&entries_, std::shared_ptr<const std::vector<Entry>>{std::move(entries)});
+        bus.set_executor(this);
+        notify();
+    }
+
+    template<typename Bus>
+    void detach(Bus& bus) {
+        detach_bus(&bus);
+    }
+
+    size_t threads() const {
+        return threads_.size();
+    }
+
+    void notify() override {
+        // Pairs with the fence in sleep(): either the thread sees the task, or this sees the
+        // sleeper.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleepers_.load(std::memory_order_relaxed) != 0) {
+            auto lock = std::unique_lock<std::mutex>{ sleep_access_ };
+            sleep_cv_.notify_one();
+        }
+    }
+
+    // Returns when no thread runs tasks of the bus anymore.
+    void detach_bus(const void* bus) override {
+        {
+            auto lock = std::unique_lock<std::mutex>{ entries_access_ };
+            auto entries = std::make_shared<std::vector<Entry>>();
+            for (auto& entry : *entries_) {
+                if (entry.bus == bus) {
+                    entry.unbind(entry.bus);
+                } else {
+                    entries->push_back(entry);
+                }
+            }
+            std::atomic_store(&entries_,
+                std::shared_ptr<const std::vector<Entry>>{std::move(entries)});
+        }
+        // A thread in a round may have any list from before, not just the last one, so every
+        // round that started before the store has to end. Pairs with the fence in begin_round():
+        // either this sees the round, or the round sees the new list.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        // Acquire, like the wait below: a round seen ended is over for the caller as well.
+        for (size_t i = 0; i < threads_.size(); ++i) {
+            const auto seen = rounds_[i].count.load(std::memory_order_acquire);
+            if (seen % 2 == 1) {
+                while (rounds_[i].count.load(std::memory_order_acquire) == seen) {
+                    std::this_thread::yield();
+                }
+            }
+        }
+    }
+
+private:
+    struct Entry {
+        void* bus;
+        size_t (*poll)(void* bus, size_t budget, size_t worker);
+        bool (*has_tasks)(void* bus);
+        void (*unbind)(void* bus);
+        size_t budget;
+    };
+
+    // Odd while the thread uses a list of buses, see detach_bus().
+    struct alignas(64) Round {
+        std::atomic<uint64_t> count{0};
+    };
+
+    void begin_round(size_t worker) {
+        rounds_[worker].count.fetch_add(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+
+    void end_round(size_t worker) {
+        rounds_[worker].count.fetch_add(1, std::memory_order_release);
+    }
+
+    // Empty rounds before a thread goes to sleep, and how long it sleeps at most, in case a
+    // wake-up was missed in a race with attach().
+    static constexpr size_t kIdleRounds = 256;
+    static constexpr std::chrono::milliseconds kSleepTimeout{10};
+
+    void work(size_t worker) {
+        size_t idle_rounds = 0;
+        while (!stop_.load(std::memory_order_relaxed)) {
+            size_t ran = 0;
+            begin_round(worker);
+            {
+                auto entries = std::atomic_load(&entries_);
+                const size_t n = entries->size();
+                // Threads start their rounds at different buses.
+                for (size_t i = 0; i < n; ++i) {
+                    auto& entry = (*entries)[(i + worker) % n];
+                    ran += entry.poll(entry.bus, entry.budget, worker);
+                }
+            }
+            end_round(worker);
+            if (ran != 0) {
+                idle_rounds = 0;
+            } else if (++idle_rounds >= kIdleRounds) {
+                sleep(worker);
+                idle_rounds = 0;
+            }
+        }
+    }
+
+    void sleep(size_t worker) {
+        auto lock = std::unique_lock<std::mutex>{ sleep_access_ };
+        sleepers_.fetch_add(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        // Checks the buses after registering as a sleeper, so a task sent just before isn't missed.
+        bool found = false;
+        begin_round(worker);
+        {
+            auto entries = std::atomic_load(&entries_);
+            for (auto& entry : *entries) {
+                found = found || entry.has_tasks(entry.bus);
+            }
+        }
+        end_round(worker);
+        if (!found && !stop_.load(std::memory_order_relaxed)) {
+            sleep_cv_.wait_for(lock, kSleepTimeout);
+        }
+        sleepers_.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    std::mutex entries_access_;
+    std::shared_ptr<const std::vector<Entry>> entries_;
+    std::atomic_bool stop_{};
+    std::atomic<size_t> sleepers_{0};
+    std::mutex sleep_access_;
+    std::condition_variable sleep_cv_;
+    std::vector<std::thread> threads_;
+    std::unique_ptr<Round[]> rounds_;
+};
+
+}; // namespace catbus
@@ -0,0 +1,97 @@
+// Batch handlers: a producer sends small numeric samples to one consumer, which adds them into
+// running sums. The per-event consumer does it in handle(), the batch consumer also has
+// handle_batch(), where the loop over a run of samples can be vectorised and the shared counter
+// is updated once per run. Reports throughput and the average number of events per call.
+
+#include "bench_utils.h"
+#include "dispatch_utils.h"
+#include "event_bus.h"
+#include "queue_lock_free.h"
+#include "queue_mutex.h"
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <thread>
+
+using namespace std::chrono_literals;
+
+constexpr size_t kLanes = 8;
+
+// --------------------------------------------------
+
+struct Sample {
+    float values[kLanes];
+};
+
+// --------------------------------------------------
+
+class PerEventConsumer
+{
+public:
+    std::atomic<uint64_t> counter_{0};
+    std::atomic<uint64_t> calls_{0};
+    float sums_[kLanes]{};
+
+    void handle(Sample evt, size_t)
+    {
+        for (size_t i = 0; i < kLanes; ++i) {
+            sums_[i] += evt.values[i];
+        }
+        calls_.fetch_add(1, std::memory_order_relaxed);
+        counter_.fetch_add(1, std::memory_order_relaxed);
+    }
+};
+
+class BatchConsumer : public PerEventConsumer
+{
+public:
+    void handle_batch(catbus::Span<Sample> events, size_t)
+    {
+        float sums[kLanes]{};
+        for (const auto& evt : events) {
+            for (size_t i = 0; i < kLanes; ++i) {
+                sums[i] += evt.values[i];
+            }
+        }
+        for (size_t i = 0; i < kLanes; ++i) {
+            sums_[i] += sums[i];
+        }
+        calls_.fetch_add(1, std::memory_order_relaxed);
+        counter_.fetch_add(events.size(), std::memory_order_relaxed);
+    }
+};
+
+// --------------------------------------------------
+
+template<typename Queue, typename Consumer>
+void run(const char* name, uint64_t count) {
+    Consumer consumer;
+    uint64_t elapsed{};
+    {
+        auto bus = std::make_unique<catbus::EventCatbus<Queue, 1, 1>>();
+        Sample sample{};
+        auto start = bench::now_ns();
+        for (uint64_t i = 0; i < count; ++i) {
+            sample.values[i % kLanes] += 1.0f;
+            catbus::static_dispatch(*bus, 0, sample, consumer);
+        }
+        while (consumer.counter_.load(std::memory_order_relaxed) < count) {
+            std::this_thread::sleep_for(1ms);
+        }
+        elapsed = bench::now_ns() - start;
+        bus->stop();
+    }
+    auto calls = consumer.calls_.load();
+    std::cout << "## " << name << ": " << count * 1'000'000'000 / elapsed << " events/s, "
+        << static_cast<double>(count) / calls << " events per call\n";
+}
+
+int main(int argc, char** argv) {
+    constexpr uint64_t count = 4'000'000;
+    run<catbus::SimpleLockFreeQueue<65536>, PerEventConsumer>("lock-free, handle()", count);
+    run<catbus::SimpleLockFreeQueue<65536>, BatchConsumer>("lock-free, handle_batch()", count);
+    run<catbus::MutexProtectedQueue, PerEventConsumer>("mutex, handle()", count);
+    run<catbus::MutexProtectedQueue, BatchConsumer>("mutex, handle_batch()", count);
+}
@@ -0,0 +1,124 @@
+// Two-stage pipeline, producer -> parser bus -> sink bus, where the sink takes a couple of
+// microseconds per event and is the bottleneck. Forwarded with plain static_dispatch(), the
+// backlog piles up in the sink's queue; through bridges with credits, every stage holds at most
+// its credits and the producer slows down to the pace of the sink. Reports the deepest queues,
+// the end-to-end latency and the throughput.
+
+#include "bench_utils.h"
+#include "bridge.h"
+#include "dispatch_utils.h"
+#include "event_bus.h"
+#include "queue_mutex.h"
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <thread>
+
+using namespace std::chrono_literals;
+
+constexpr size_t kCredits = 256;
+constexpr size_t kBuffer = 1024;
+
+// --------------------------------------------------
+
+struct Raw {
+    uint64_t sent_ns;
+    uint64_t value;
+};
+
+struct Parsed {
+    uint64_t sent_ns;
+    uint64_t value;
+};
+
+// --------------------------------------------------
+
+using Bus = catbus::EventCatbus<catbus::MutexProtectedQueue, 1, 1>;
+using Bridge = catbus::BusBridge<Bus, kCredits, kBuffer>;
+
+class Sink
+{
+public:
+    std::atomic<uint64_t> counter_{0};
+    bench::LatencyHistogram latency_;
+
+    void handle(Parsed evt, size_t)
+    {
+        auto until = bench::now_ns() + 2'000;
+        while (bench::now_ns() < until) {
+        }
+        latency_.record(bench::now_ns() - evt.sent_ns);
+        counter_.fetch_add(1, std::memory_order_relaxed);
+    }
+};
+
+// Forwards to the sink directly, or through a bridge if it has one.
+class Parser
+{
+public:
+    Parser(Bus& sink_bus, Sink& sink, Bridge* bridge)
+      : sink_bus_{sink_bus}, sink_{sink}, bridge_{bridge}
+    {}
+
+    void handle(Raw evt, size_t)
+    {
+        Parsed parsed{evt.sent_ns, evt.value * 3};
+        if (bridge_) {
+            catbus::static_dispatch_bridged(*bridge_, 0, parsed, sink_);
+        } else {
+            catbus::static_dispatch(sink_bus_, 0, parsed, sink_);
+        }
+    }
+
+private:
+    Bus& sink_bus_;
+    Sink& sink_;
+    Bridge* bridge_;
+};
+
+// --------------------------------------------------
+
+void run(const char* name, uint64_t count, bool bridged) {
+    Sink sink;
+    uint64_t elapsed{}, parser_depth{}, sink_depth{};
+    {
+        // Bridges first, they must outlive the buses.
+        Bridge to_parser, to_sink;
+        auto sink_bus = std::make_unique<Bus>();
+        auto parser_bus = std::make_unique<Bus>();
+        sink_bus->enable_stats();
+        parser_bus->enable_stats();
+        to_sink.connect(*sink_bus);
+        to_parser.connect(*parser_bus);
+        Parser parser{*sink_bus, sink, bridged ? &to_sink : nullptr};
+        auto start = bench::now_ns();
+        for (uint64_t i = 0; i < count; ++i) {
+            Raw raw{bench::now_ns(), i};
+            if (bridged) {
+                catbus::static_dispatch_bridged(to_parser, 0, raw, parser);
+            } else {
+                catbus::static_dispatch(*parser_bus, 0, raw, parser);
+            }
+        }
+        while (sink.counter_.load(std::memory_order_relaxed) < count) {
+            std::this_thread::sleep_for(1ms);
+        }
+        elapsed = bench::now_ns() - start;
+        parser_depth = parser_bus->stats().queues[0].high_water;
+        sink_depth = sink_bus->stats().queues[0].high_water;
+        parser_bus->stop();
+        sink_bus->stop();
+    }
+    std::cout << "## " << name << ": deepest queues " << parser_depth << " / " << sink_depth
+        << ", latency p50 " << sink.latency_.percentile(50) / 1000 << "mcs p99 "
+        << sink.latency_.percentile(99) / 1000 << "mcs, "
+        << count * 1'000'000'000 / elapsed << " events/s\n";
+}
+
+int main(int argc, char** argv) {
+    constexpr uint64_t count = 200'000;
+    run("static_dispatch() between stages", count, false);
+    run("bridges with 256 credits, 1024 waiting", count, true);
+}
@@ -0,0 +1,91 @@
+// Ingest of a large batch of targeted events: a million events for eight consumers are sent
+// one by one with try_dynamic_dispatch(), and at once with try_dynamic_dispatch_bulk(), which
+// partitions them by consumer and enqueues each consumer's run with one call. Only sending is
+// timed, the bus has no workers and is drained after each round.
+
+#include "bench_utils.h"
+#include "dispatch_utils.h"
+#include "event_bus.h"
+#include "queue_mutex.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <vector>
+
+// --------------------------------------------------
+
+struct Update {
+    size_t target;
+    uint64_t key;
+    double value;
+};
+
+// --------------------------------------------------
+
+class UpdateConsumer
+{
+public:
+    explicit UpdateConsumer(size_t id) : id_{id} {}
+
+    const size_t id_;
+    double sum_{0};
+
+    void handle(Update evt, size_t)
+    {
+        sum_ += evt.value;
+    }
+};
+
+// --------------------------------------------------
+
+using Bus = catbus::EventCatbus<catbus::MutexProtectedQueue, 8, 0>;
+
+std::vector<Update> make_updates(size_t count) {
+    std::mt19937_64 random{42};
+    std::vector<Update> result(count);
+    for (size_t i = 0; i < count; ++i) {
+        // One target in 64 has no consumer.
+        auto r = random();
+        result[i] = Update{r % 64 == 0 ? 100 : r % 8, i, 1.0};
+    }
+    return result;
+}
+
+// Sends the batch a few times, draining the bus in between, and reports the fastest round, so
+// that page faults of the first round don't count.
+template<typename Send>
+void run(const char* name, size_t count, Send send) {
+    constexpr int kRounds = 5;
+    auto bus = std::make_unique<Bus>();
+    UpdateConsumer c0{0}, c1{1}, c2{2}, c3{3}, c4{4}, c5{5}, c6{6}, c7{7};
+    uint64_t best = UINT64_MAX;
+    for (int round = 0; round < kRounds; ++round) {
+        auto updates = make_updates(count);
+        auto start = bench::now_ns();
+        send(*bus, updates, c0, c1, c2, c3, c4, c5, c6, c7);
+        best = std::min(best, bench::now_ns() - start);
+        while (bus->poll(4096) != 0) {
+        }
+    }
+    std::cout << "## " << name << ": " << count * 1'000'000'000 / best << " events/s, "
+        << best / 1'000'000 << "ms for " << count << " events, "
+        << bus->dead_letters().misrouted() / kRounds << " dead letters\n";
+}
+
+int main(int argc, char** argv) {
+    constexpr size_t count = 1'000'000;
+    run("try_dynamic_dispatch() per event", count,
+        [](Bus& bus, std::vector<Update>& updates, auto&... consumers) {
+            for (auto& update : updates) {
+                catbus::try_dynamic_dispatch(bus, catbus::ROUND_ROBIN, update, consumers...);
+            }
+        });
+    run("try_dynamic_dispatch_bulk()", count,
+        [](Bus& bus, std::vector<Update>& updates, auto&... consumers) {
+            catbus::try_dynamic_dispatch_bulk(bus, catbus::ROUND_ROBIN,
+                catbus::Span<Update>{updates.data(), updates.size()}, consumers...);
+        });
+}
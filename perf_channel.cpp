@@ -0,0 +1,81 @@
+// Small plain events, 16 bytes each, from a producer thread to one consumer: through the generic
+// lock-free queue, where every event travels in an 80-byte task, and through a typed channel,
+// which keeps only the events in its ring. Reports throughput and queue bytes per event.
+
+#include "bench_utils.h"
+#include "channel.h"
+#include "dispatch_utils.h"
+#include "event_bus.h"
+#include "queue_lock_free.h"
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <thread>
+
+using namespace std::chrono_literals;
+
+constexpr size_t kRing = 65536;
+
+// --------------------------------------------------
+
+struct Tick {
+    uint64_t instrument;
+    double price;
+};
+
+// --------------------------------------------------
+
+class TickConsumer
+{
+public:
+    std::atomic<uint64_t> counter_{0};
+    double last_{0};
+
+    void handle(Tick evt, size_t)
+    {
+        last_ = evt.price;
+        counter_.fetch_add(1, std::memory_order_relaxed);
+    }
+};
+
+using Bus = catbus::EventCatbus<catbus::SimpleLockFreeQueue<kRing>, 1, 1>;
+using Channel = catbus::TypedChannel<TickConsumer, Tick, kRing>;
+
+// --------------------------------------------------
+
+template<typename Send>
+void run(const char* name, uint64_t count, size_t bytes_per_event, Send send) {
+    TickConsumer consumer;
+    uint64_t elapsed{};
+    {
+        // The channel must outlive the bus.
+        auto channel = std::make_unique<Channel>(consumer);
+        auto bus = std::make_unique<Bus>();
+        bus->attach_channel(*channel);
+        auto start = bench::now_ns();
+        for (uint64_t i = 0; i < count; ++i) {
+            send(*bus, *channel, consumer, Tick{i & 255, static_cast<double>(i)});
+        }
+        while (consumer.counter_.load(std::memory_order_relaxed) < count) {
+            std::this_thread::sleep_for(1ms);
+        }
+        elapsed = bench::now_ns() - start;
+        bus->stop();
+    }
+    std::cout << "## " << name << ": " << count * 1'000'000'000 / elapsed << " events/s, "
+        << bytes_per_event << " queue bytes per event\n";
+}
+
+int main(int argc, char** argv) {
+    constexpr uint64_t count = 10'000'000;
+    run("lock-free queue", count, sizeof(catbus::TaskWrapper) + 8,
+        [](Bus& bus, Channel&, TickConsumer& consumer, Tick tick) {
+            catbus::static_dispatch(bus, 0, tick, consumer);
+        });
+    run("typed channel", count, sizeof(Tick) + sizeof(uint32_t),
+        [](Bus&, Channel& channel, TickConsumer&, Tick tick) {
+            channel.send(tick);
+        });
+}
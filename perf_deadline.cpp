@@ -0,0 +1,107 @@
+// Deadline and bulk traffic on one worker: bursts of bulk events, each taking a couple of
+// microseconds to handle, so a burst is about 1.2ms of work, with urgent events mixed in that
+// have to be handled within 500us. A FIFO queue makes the urgent events wait behind the bulk work
+// sent before them, the deadline queue serves them first. Reports latency of the urgent events, how many missed the deadline,
+// and the total time.
+
+#include "bench_utils.h"
+#include "dispatch_utils.h"
+#include "event_bus.h"
+#include "queue_deadline.h"
+#include "queue_mutex.h"
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <thread>
+
+using namespace std::chrono_literals;
+
+constexpr uint64_t kBursts = 200;
+constexpr uint64_t kBurst = 600;
+constexpr uint64_t kBulk = kBursts * kBurst;
+constexpr uint64_t kUrgentEvery = 50;
+constexpr uint64_t kBudgetNs = 500'000;
+
+// --------------------------------------------------
+
+struct Bulk {
+    uint64_t seq;
+};
+
+struct Urgent {
+    uint64_t deadline_ns;
+    uint64_t sent_ns;
+};
+
+// --------------------------------------------------
+
+class Consumer
+{
+public:
+    std::atomic<uint64_t> counter_{0};
+    bench::LatencyHistogram urgent_latency_;
+    uint64_t missed_{0};
+
+    void handle(Bulk, size_t)
+    {
+        // Some work.
+        auto until = bench::now_ns() + 2'000;
+        while (bench::now_ns() < until) {
+        }
+        counter_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void handle(Urgent evt, size_t)
+    {
+        auto now = bench::now_ns();
+        urgent_latency_.record(now - evt.sent_ns);
+        if (now > evt.deadline_ns) {
+            ++missed_;
+        }
+        counter_.fetch_add(1, std::memory_order_relaxed);
+    }
+};
+
+// --------------------------------------------------
+
+template<typename Queue>
+void run(const char* name) {
+    Consumer consumer;
+    const uint64_t total = kBulk + kBulk / kUrgentEvery;
+    uint64_t elapsed{};
+    {
+        auto bus = std::make_unique<catbus::EventCatbus<Queue, 1, 1>>();
+        auto start = bench::now_ns();
+        for (uint64_t i = 0; i < kBulk; ++i) {
+            if (i % kBurst == 0) {
+                // Lets the worker catch up, so the backlog doesn't grow from burst to burst.
+                while (consumer.counter_.load(std::memory_order_relaxed) < i + i / kUrgentEvery) {
+                    std::this_thread::sleep_for(100us);
+                }
+            }
+            catbus::static_dispatch(*bus, 0, Bulk{i}, consumer);
+            if (i % kUrgentEvery == 0) {
+                auto now = bench::now_ns();
+                // Both clocks are steady_clock.
+                catbus::static_dispatch(*bus, 0, Urgent{now + kBudgetNs, now}, consumer);
+            }
+        }
+        while (consumer.counter_.load(std::memory_order_relaxed) < total) {
+            std::this_thread::sleep_for(1ms);
+        }
+        elapsed = bench::now_ns() - start;
+        bus->stop();
+    }
+    std::cout << "## " << name << ": urgent p50 "
+        << consumer.urgent_latency_.percentile(50) / 1000 << "mcs"
+        << " p99 " << consumer.urgent_latency_.percentile(99) / 1000 << "mcs"
+        << ", " << consumer.missed_ << " of " << kBulk / kUrgentEvery << " missed the deadline"
+        << ", total " << elapsed / 1'000'000 << "ms\n";
+}
+
+int main(int argc, char** argv) {
+    run<catbus::MutexProtectedQueue>("FIFO (mutex)");
+    run<catbus::DeadlineQueue<>>("earliest deadline first");
+}
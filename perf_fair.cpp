@@ -0,0 +1,108 @@
+// A chatty consumer and a quiet one share one worker: bursts of events for the chatty consumer,
+// each taking a microsecond to handle, with a few events for the quiet consumer sent right after
+// each burst. With a FIFO queue the quiet events wait for the whole burst, the fair queue serves
+// them in the next round. Reports latency of the quiet events, and throughput of trivial events
+// through both queues to show the cost of the scheduling.
+
+#include "bench_utils.h"
+#include "dispatch_utils.h"
+#include "event_bus.h"
+#include "queue_fair.h"
+#include "queue_mutex.h"
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <thread>
+
+using namespace std::chrono_literals;
+
+constexpr uint64_t kBursts = 200;
+constexpr uint64_t kBurst = 1000;
+constexpr uint64_t kQuietPerBurst = 4;
+
+// --------------------------------------------------
+
+struct Work {
+    uint64_t sent_ns;
+};
+
+// --------------------------------------------------
+
+class Consumer
+{
+public:
+    explicit Consumer(uint64_t work_ns) : work_ns_{work_ns} {}
+
+    std::atomic<uint64_t> counter_{0};
+    bench::LatencyHistogram latency_;
+
+    void handle(Work evt, size_t)
+    {
+        auto now = bench::now_ns();
+        latency_.record(now - evt.sent_ns);
+        auto until = now + work_ns_;
+        while (bench::now_ns() < until) {
+        }
+        counter_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+private:
+    const uint64_t work_ns_;
+};
+
+// --------------------------------------------------
+
+template<typename Queue>
+void run_mixed(const char* name) {
+    Consumer chatty{1'000}, quiet{0};
+    {
+        auto bus = std::make_unique<catbus::EventCatbus<Queue, 1, 1>>();
+        for (uint64_t burst = 0; burst < kBursts; ++burst) {
+            for (uint64_t i = 0; i < kBurst; ++i) {
+                catbus::static_dispatch(*bus, 0, Work{bench::now_ns()}, chatty);
+            }
+            for (uint64_t i = 0; i < kQuietPerBurst; ++i) {
+                catbus::static_dispatch(*bus, 0, Work{bench::now_ns()}, quiet);
+            }
+            while (chatty.counter_.load(std::memory_order_relaxed) < (burst + 1) * kBurst
+                || quiet.counter_.load(std::memory_order_relaxed) < (burst + 1) * kQuietPerBurst)
+            {
+                std::this_thread::sleep_for(100us);
+            }
+        }
+        bus->stop();
+    }
+    std::cout << "## " << name << ": quiet consumer p50 " << quiet.latency_.percentile(50) / 1000
+        << "mcs p99 " << quiet.latency_.percentile(99) / 1000 << "mcs, chatty consumer p50 "
+        << chatty.latency_.percentile(50) / 1000 << "mcs\n";
+}
+
+template<typename Queue>
+void run_throughput(const char* name, uint64_t count) {
+    Consumer a{0}, b{0};
+    uint64_t elapsed{};
+    {
+        auto bus = std::make_unique<catbus::EventCatbus<Queue, 1, 1>>();
+        auto start = bench::now_ns();
+        for (uint64_t i = 0; i < count; ++i) {
+            catbus::static_dispatch(*bus, 0, Work{0}, i % 2 == 0 ? a : b);
+        }
+        while (a.counter_.load(std::memory_order_relaxed)
+            + b.counter_.load(std::memory_order_relaxed) < count)
+        {
+            std::this_thread::sleep_for(1ms);
+        }
+        elapsed = bench::now_ns() - start;
+        bus->stop();
+    }
+    std::cout << "## " << name << ": " << count * 1'000'000'000 / elapsed << " events/s\n";
+}
+
+int main(int argc, char** argv) {
+    run_mixed<catbus::MutexProtectedQueue>("FIFO (mutex)");
+    run_mixed<catbus::FairQueue<>>("fair");
+    run_throughput<catbus::MutexProtectedQueue>("FIFO (mutex) throughput", 4'000'000);
+    run_throughput<catbus::FairQueue<>>("fair throughput", 4'000'000);
+}
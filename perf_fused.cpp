@@ -0,0 +1,114 @@
+// Fused handlers: a three-stage linear pipeline, parse -> enrich -> store, where each stage sends
+// its result to the next one with EventSender. With the stages fused, a worker that takes a raw
+// message runs the whole chain as nested calls; with fuse_depth(0) every hop is a queue round
+// trip. Reports throughput of messages through the whole chain.
+
+#include "bench_utils.h"
+#include "dispatch_utils.h"
+#include "event_bus.h"
+#include "event_sender.h"
+#include "queue_lock_free.h"
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <thread>
+
+using namespace std::chrono_literals;
+
+// --------------------------------------------------
+
+struct Raw {
+    uint64_t seq;
+    uint64_t bytes;
+};
+
+struct Parsed {
+    uint64_t seq;
+    uint64_t value;
+};
+
+struct Enriched {
+    uint64_t seq;
+    uint64_t value;
+    uint64_t weight;
+};
+
+template<> struct catbus::fused_event<Parsed> : std::true_type {};
+template<> struct catbus::fused_event<Enriched> : std::true_type {};
+
+// --------------------------------------------------
+
+class Parser
+{
+public:
+    catbus::EventSender<Parsed> sender_;
+
+    void handle(Raw evt, size_t q)
+    {
+        sender_.send(Parsed{evt.seq, evt.bytes * 31 + 7}, q);
+    }
+};
+
+class Enricher
+{
+public:
+    catbus::EventSender<Enriched> sender_;
+
+    void handle(Parsed evt, size_t q)
+    {
+        sender_.send(Enriched{evt.seq, evt.value, evt.value & 15}, q);
+    }
+};
+
+class Store
+{
+public:
+    std::atomic<uint64_t> counter_{0};
+    uint64_t total_{0};
+
+    void handle(Enriched evt, size_t)
+    {
+        total_ += evt.value * evt.weight;
+        counter_.fetch_add(1, std::memory_order_relaxed);
+    }
+};
+
+using Bus = catbus::EventCatbus<catbus::SimpleLockFreeQueue<65536>, 1, 1>;
+
+constexpr uint64_t kInFlight = 16384;
+
+// --------------------------------------------------
+
+void run(const char* name, uint64_t count, size_t fuse_depth) {
+    Parser parser;
+    Enricher enricher;
+    Store store;
+    uint64_t elapsed{};
+    {
+        auto bus = std::make_unique<Bus>();
+        bus->fuse_depth(fuse_depth);
+        catbus::setup_dispatch(*bus, parser, enricher, store);
+        auto start = bench::now_ns();
+        for (uint64_t i = 0; i < count; ++i) {
+            // Stages send from the worker, which would wait forever on a full queue.
+            while (i - store.counter_.load(std::memory_order_relaxed) >= kInFlight) {
+                std::this_thread::yield();
+            }
+            catbus::static_dispatch(*bus, 0, Raw{i, i & 1023}, parser);
+        }
+        while (store.counter_.load(std::memory_order_relaxed) < count) {
+            std::this_thread::sleep_for(1ms);
+        }
+        elapsed = bench::now_ns() - start;
+        bus->stop();
+    }
+    std::cout << "## " << name << ": " << count * 1'000'000'000 / elapsed << " messages/s\n";
+}
+
+int main(int argc, char** argv) {
+    constexpr uint64_t count = 4'000'000;
+    run("queue hop per stage", count, 0);
+    run("fused stages", count, 8);
+}
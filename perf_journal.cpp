@@ -0,0 +1,104 @@
+// Measures the cost of journaling on the send path and the speed of replay. First the same
+// stream of events is sent with and without a journal attached, then the journal is replayed
+// into a fresh bus at full speed, which is how a recorded production stream can be used as
+// benchmark load, and once more with the original timing.
+
+#include "dispatch_utils.h"
+#include "event_bus.h"
+#include "journal.h"
+#include "queue_lock_free.h"
+#include "registry.h"
+
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+
+using namespace std::chrono_literals;
+
+// --------------------------------------------------
+
+struct Order {
+    uint64_t id;
+    uint64_t price;
+    uint32_t quantity;
+};
+
+// --------------------------------------------------
+
+class OrderConsumer
+{
+public:
+    std::atomic<uint64_t> counter_{0};
+
+    void handle(Order, size_t)
+    {
+        counter_.fetch_add(1, std::memory_order_relaxed);
+    }
+};
+
+using Bus = catbus::EventCatbus<catbus::SimpleLockFreeQueue<65536>, 4, 4>;
+
+// --------------------------------------------------
+
+void wait_for(const OrderConsumer& consumer, uint64_t count) {
+    while (consumer.counter_.load(std::memory_order_relaxed) < count) {
+        std::this_thread::yield();
+    }
+}
+
+void send_orders(catbus::Journal* journal, uint64_t count) {
+    OrderConsumer consumer;
+    auto bus = std::make_unique<Bus>();
+    if (journal) {
+        bus->journal_to(journal);
+    }
+    auto start = std::chrono::steady_clock::now();
+    for(uint64_t i = 0; i < count; ++i) {
+        catbus::static_dispatch(*bus, catbus::ROUND_ROBIN, Order{i, 100 + i % 7, 10}, consumer);
+        if ((i & 1023) == 0) {
+            // Gives the recording some gaps, so replay with original timing is not just a burst.
+            std::this_thread::sleep_for(100us);
+        }
+    }
+    wait_for(consumer, count);
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    bus->stop();
+    std::cout << "## send " << (journal ? "with" : "without") << " journal: " << count
+        << " events in " << elapsed << "ms\n";
+}
+
+void replay_orders(const std::string& dir, catbus::ReplaySpeed speed, uint64_t count) {
+    OrderConsumer consumer;
+    auto bus = std::make_unique<Bus>();
+    auto start = std::chrono::steady_clock::now();
+    auto replayed = catbus::replay<Order>(dir, catbus::make_registry(*bus, consumer), speed);
+    wait_for(consumer, replayed);
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    bus->stop();
+    std::cout << "## replay " << (speed == catbus::ReplaySpeed::full ? "at full speed" :
+        "with original timing") << ": " << replayed << " of " << count << " events in "
+        << elapsed << "ms\n";
+}
+
+int main(int argc, char** argv) {
+    constexpr uint64_t count = 2'000'000;
+    const auto dir = (std::filesystem::temp_directory_path() / "catbus_perf_journal").string();
+    std::filesystem::remove_all(dir);
+
+    send_orders(nullptr, count);
+    {
+        catbus::Journal journal{dir};
+        send_orders(&journal, count);
+        std::cout << "## skipped: " << journal.skipped() << "\n";
+    }
+    replay_orders(dir, catbus::ReplaySpeed::full, count);
+    replay_orders(dir, catbus::ReplaySpeed::original, count);
+
+    std::filesystem::remove_all(dir);
+}
@@ -0,0 +1,128 @@
+// Open-loop load generator. Producer threads send events at a fixed or Poisson schedule that
+// doesn't wait for the handlers, unlike performance.cpp where each handler sends the next event.
+// Latency is measured from the intended send time, so when a queue backs up, or a producer is
+// stuck in a full queue, the delay of every event that should have been sent meanwhile is counted
+// (the coordinated omission correction). Latency from the actual send time is shown next to it
+// for comparison.
+//
+// For every queue backend the offered load is doubled until the bus can't keep up, which shows
+// where the knee is. Usage: perf_loadgen [fixed|poisson] [seconds per step]
+
+#include "bench_utils.h"
+#include "dispatch_utils.h"
+#include "event_bus.h"
+#include "queue_lock_free.h"
+#include "queue_mutex.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <vector>
+
+// --------------------------------------------------
+
+struct Timed {
+    uint64_t intended_ns;
+    uint64_t sent_ns;
+};
+
+// --------------------------------------------------
+
+class TimedConsumer
+{
+public:
+    bench::LatencyHistogram intended_;
+    bench::LatencyHistogram actual_;
+    std::atomic<uint64_t> counter_{0};
+
+    void handle(Timed evt, size_t)
+    {
+        auto now = bench::now_ns();
+        intended_.record(now - evt.intended_ns);
+        actual_.record(now - evt.sent_ns);
+        // A bit of work, so the bus saturates at a rate the producers can reach.
+        while (bench::now_ns() < now + 1000) {
+        }
+        counter_.fetch_add(1, std::memory_order_relaxed);
+    }
+};
+
+struct StepResult {
+    double offered;
+    double achieved;
+    uint64_t p99_ns;
+};
+
+constexpr size_t kProducers = 2;
+
+// --------------------------------------------------
+
+template<typename Queue>
+StepResult step(double rate, bool poisson, double seconds) {
+    TimedConsumer consumer;
+    auto bus = std::make_unique<catbus::EventCatbus<Queue, 4, 4>>();
+    const uint64_t start = bench::now_ns() + 10'000'000;
+    const uint64_t end = start + static_cast<uint64_t>(seconds * 1e9);
+    std::atomic<uint64_t> sent{0};
+    std::vector<std::thread> producers;
+    for (size_t p = 0; p < kProducers; ++p) {
+        producers.emplace_back([&, p] {
+            bench::OpenLoopSchedule schedule{rate / kProducers, poisson, start, unsigned(p + 1)};
+            uint64_t count = 0;
+            for (auto intended = schedule.next(); intended < end; intended = schedule.next()) {
+                bench::wait_until_ns(intended);
+                catbus::static_dispatch(*bus, catbus::ROUND_ROBIN,
+                    Timed{intended, bench::now_ns()}, consumer);
+                ++count;
+            }
+            sent.fetch_add(count);
+        });
+    }
+    for (auto& t : producers) {
+        t.join();
+    }
+    while (consumer.counter_.load(std::memory_order_relaxed) < sent.load()) {
+        std::this_thread::yield();
+    }
+    auto elapsed = bench::now_ns() - start;
+    bus->stop();
+    double achieved = sent.load() * 1e9 / elapsed;
+    std::cout << "   offered " << uint64_t(rate) << "/s, achieved " << uint64_t(achieved) << "/s"
+        << ", intended p50 " << consumer.intended_.percentile(50) / 1000 << "mcs"
+        << " p99 " << consumer.intended_.percentile(99) / 1000 << "mcs"
+        << " p99.9 " << consumer.intended_.percentile(99.9) / 1000 << "mcs"
+        << " max " << consumer.intended_.max() / 1000 << "mcs"
+        << " | actual p99 " << consumer.actual_.percentile(99) / 1000 << "mcs\n";
+    return StepResult{rate, achieved, consumer.intended_.percentile(99)};
+}
+
+template<typename Queue>
+void sweep(const char* name, bool poisson, double seconds) {
+    std::cout << "## " << name << "\n";
+    uint64_t base_p99 = 0;
+    for (double rate = 25'000; rate <= 3'200'000; rate *= 2) {
+        auto result = step<Queue>(rate, poisson, seconds);
+        if (base_p99 == 0) {
+            base_p99 = result.p99_ns;
+        }
+        // Past the knee the queues grow for the whole step, so the tail explodes.
+        if (result.achieved < 0.9 * result.offered || result.p99_ns > 100 * base_p99 + 1'000'000) {
+            std::cout << "   saturated, knee between " << uint64_t(rate / 2) << " and "
+                << uint64_t(rate) << " events/s\n";
+            return;
+        }
+    }
+}
+
+int main(int argc, char** argv) {
+    bool poisson = argc > 1 && std::strcmp(argv[1], "poisson") == 0;
+    double seconds = argc > 2 ? std::atof(argv[2]) : 1.0;
+    std::cout << (poisson ? "Poisson" : "fixed") << " schedule, " << kProducers
+        << " producers, " << seconds << "s per step\n";
+    sweep<catbus::SimpleLockFreeQueue<65536>>("lock-free ring", poisson, seconds);
+    sweep<catbus::MutexProtectedQueue>("mutex-protected queue", poisson, seconds);
+}
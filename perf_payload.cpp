@@ -0,0 +1,97 @@
+// Events with heap payloads of mixed sizes, allocated on one worker and freed on another: every
+// handler sums the vector it got and sends a new one, mostly small but up to 4KB, to the next
+// queue. Compares std::vector with malloc against PooledVector with the per-thread payload pools,
+// and reports throughput and the time spent building payloads.
+
+#include "bench_utils.h"
+#include "dispatch_utils.h"
+#include "event_bus.h"
+#include "payload.h"
+#include "queue_lock_free.h"
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <vector>
+
+using namespace std::chrono_literals;
+
+constexpr size_t kQueues = 4;
+constexpr size_t kInFlight = 256;
+
+// --------------------------------------------------
+
+template<typename Vec>
+struct Payload {
+    uint32_t seed;
+    Vec data;
+};
+
+// --------------------------------------------------
+
+template<typename Vec, typename Bus>
+class PayloadConsumer
+{
+public:
+    explicit PayloadConsumer(Bus& bus) : bus_{bus} {}
+
+    std::atomic<uint64_t> counter_{0};
+    std::atomic<uint64_t> build_ns_{0};
+    std::atomic<bool> stop_{false};
+
+    void handle(Payload<Vec> evt, size_t q)
+    {
+        long sum = 0;
+        for (auto v : evt.data) {
+            sum += v;
+        }
+        counter_.fetch_add(1, std::memory_order_relaxed);
+        if (stop_.load(std::memory_order_relaxed)) {
+            return;
+        }
+        uint32_t seed = evt.seed * 1103515245u + 12345u + static_cast<uint32_t>(sum & 1);
+        // Mostly small payloads, every 16th one up to 4KB.
+        size_t size = 1 + (seed >> 16) % ((seed & 0xf0) == 0 ? 512 : 32);
+        auto begin = bench::now_ns();
+        Vec data(size, static_cast<long>(seed & 255));
+        build_ns_.fetch_add(bench::now_ns() - begin, std::memory_order_relaxed);
+        catbus::static_dispatch(bus_, (q + 1) % kQueues, Payload<Vec>{seed, std::move(data)},
+            *this);
+    }
+
+private:
+    Bus& bus_;
+};
+
+// --------------------------------------------------
+
+template<typename Vec>
+void run(const char* name, uint64_t count) {
+    using Bus = catbus::EventCatbus<catbus::SimpleLockFreeQueue<4096>, kQueues, kQueues>;
+    auto bus = std::make_unique<Bus>();
+    PayloadConsumer<Vec, Bus> consumer{*bus};
+    auto start = bench::now_ns();
+    for (uint32_t i = 0; i < kInFlight; ++i) {
+        catbus::static_dispatch(*bus, i % kQueues, Payload<Vec>{i, Vec(16, 1)}, consumer);
+    }
+    while (consumer.counter_.load(std::memory_order_relaxed) < count) {
+        std::this_thread::sleep_for(10ms);
+    }
+    auto elapsed = bench::now_ns() - start;
+    auto handled = consumer.counter_.load(std::memory_order_relaxed);
+    consumer.stop_.store(true, std::memory_order_relaxed);
+    std::this_thread::sleep_for(50ms);
+    bus->stop();
+    bus.reset();
+    std::cout << "## " << name << ": " << handled * 1'000'000'000 / elapsed << " events/s, "
+        << elapsed / handled << "ns per event, building payload "
+        << consumer.build_ns_.load() / handled << "ns\n";
+}
+
+int main(int argc, char** argv) {
+    constexpr uint64_t count = 2'000'000;
+    run<std::vector<long>>("std::vector (malloc)", count);
+    run<catbus::PooledVector<long>>("PooledVector (payload pools)", count);
+}
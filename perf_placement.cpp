@@ -0,0 +1,98 @@
+// Compares placement policies for events sent without explicit queue index on a workload with
+// skewed handler costs: a steady stream of quick events, with every 32nd one followed by a slow
+// event that keeps its worker busy for a while. Blind round robin keeps putting quick events
+// behind the slow ones, load-aware policies route around them, which shows in the tail latency.
+
+#include "bench_utils.h"
+#include "dispatch_utils.h"
+#include "event_bus.h"
+#include "event_sender.h"
+#include "placement.h"
+#include "queue_lock_free.h"
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <thread>
+
+using namespace std::chrono_literals;
+
+// --------------------------------------------------
+
+struct Quick {
+    uint64_t created_ns;
+};
+
+struct Slow {
+    uint64_t created_ns;
+};
+
+// --------------------------------------------------
+
+class QuickConsumer
+{
+public:
+    catbus::EventSender<Quick, Slow> sender_;
+    bench::LatencyHistogram latency_;
+    std::atomic_long counter_{0};
+
+    void handle(Quick evt, size_t)
+    {
+        auto now = bench::now_ns();
+        latency_.record(now - evt.created_ns);
+        auto count = counter_.fetch_add(1, std::memory_order_relaxed);
+        if ((count & 31) == 0) {
+            sender_.send(Slow{now});
+        }
+        sender_.send(Quick{now});
+    }
+};
+
+class SlowConsumer
+{
+public:
+    void handle(Slow, size_t)
+    {
+        auto until = bench::now_ns() + 200'000;
+        while (bench::now_ns() < until) {
+        }
+    }
+};
+
+// --------------------------------------------------
+
+template<typename Placement>
+void run(const char* name) {
+    constexpr size_t NQ = 4;
+    constexpr size_t NWrk = 4;
+    QuickConsumer quick;
+    SlowConsumer slow;
+    {
+        auto bus_ptr = std::make_unique<
+            catbus::EventCatbus<catbus::SimpleLockFreeQueue<4096>, NQ, NWrk, Placement>>();
+        auto& bus = *bus_ptr;
+        catbus::setup_dispatch(bus, quick, slow);
+        for(size_t i = 0; i < 64; ++i) {
+            catbus::static_dispatch(bus, catbus::ROUND_ROBIN, Quick{bench::now_ns()}, quick);
+        }
+        std::this_thread::sleep_for(200ms);
+        quick.latency_.reset();
+        auto start_count = quick.counter_.load();
+        std::this_thread::sleep_for(2s);
+        auto count = quick.counter_.load() - start_count;
+        bus.stop();
+        std::cout << "## " << name << ": " << count / 2 << " quick events/s"
+            << ", p50 " << quick.latency_.percentile(50) / 1000 << "mcs"
+            << ", p99 " << quick.latency_.percentile(99) / 1000 << "mcs"
+            << ", p99.9 " << quick.latency_.percentile(99.9) / 1000 << "mcs"
+            << ", max " << quick.latency_.max() / 1000 << "mcs\n";
+    }
+}
+
+int main(int argc, char** argv) {
+    run<catbus::GlobalRoundRobin>("global round robin");
+    run<catbus::PerThreadRoundRobin>("per-thread round robin");
+    run<catbus::PowerOfTwoChoices>("power of two choices");
+    run<catbus::PreferLocal<64>>("prefer local");
+}
@@ -0,0 +1,94 @@
+// Request/response ping-pong between two consumers, where every reply is a local send to the
+// queue the handler was given: through the shared queue, and through the run-next slot of the
+// worker (run_next_local()), which keeps each exchange on one worker without touching the queue.
+// Reports round trips per second.
+
+#include "bench_utils.h"
+#include "dispatch_utils.h"
+#include "event_bus.h"
+#include "event_sender.h"
+#include "queue_lock_free.h"
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <thread>
+
+using namespace std::chrono_literals;
+
+constexpr size_t kWorkers = 2;
+constexpr uint64_t kConversations = 64;
+
+// --------------------------------------------------
+
+struct Request {
+    uint64_t left;
+};
+
+struct Response {
+    uint64_t left;
+};
+
+// --------------------------------------------------
+
+class Client
+{
+public:
+    catbus::EventSender<Request> sender_;
+    std::atomic<uint64_t> finished_{0};
+    std::atomic<uint64_t> round_trips_{0};
+
+    void handle(Response evt, size_t q)
+    {
+        round_trips_.fetch_add(1, std::memory_order_relaxed);
+        if (evt.left == 0) {
+            finished_.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        sender_.send(Request{evt.left - 1}, q);
+    }
+};
+
+class Server
+{
+public:
+    catbus::EventSender<Response> sender_;
+
+    void handle(Request evt, size_t q)
+    {
+        sender_.send(Response{evt.left}, q);
+    }
+};
+
+using Bus = catbus::EventCatbus<catbus::SimpleLockFreeQueue<4096>, kWorkers, kWorkers>;
+
+// --------------------------------------------------
+
+void run(const char* name, uint64_t exchanges, bool run_next) {
+    Client client;
+    Server server;
+    uint64_t elapsed{};
+    {
+        auto bus = std::make_unique<Bus>();
+        bus->run_next_local(run_next);
+        catbus::setup_dispatch(*bus, client, server);
+        auto start = bench::now_ns();
+        for (uint64_t i = 0; i < kConversations; ++i) {
+            catbus::static_dispatch(*bus, i % kWorkers, Request{exchanges}, server);
+        }
+        while (client.finished_.load(std::memory_order_relaxed) < kConversations) {
+            std::this_thread::sleep_for(1ms);
+        }
+        elapsed = bench::now_ns() - start;
+        bus->stop();
+    }
+    std::cout << "## " << name << ": "
+        << client.round_trips_.load() * 1'000'000'000 / elapsed << " round trips/s\n";
+}
+
+int main(int argc, char** argv) {
+    constexpr uint64_t exchanges = 50'000;
+    run("shared queue", exchanges, false);
+    run("run-next slot", exchanges, true);
+}
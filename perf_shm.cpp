@@ -0,0 +1,93 @@
+// Measures one-way latency of events sent to another process through SharedMemoryQueue. The
+// child runs a consumer bus which binds the events to its consumer through a registry, while the
+// parent sends them through a producer bus. Steady clock is system-wide, so timestamps taken in
+// the parent are valid in the child.
+//
+// The saturated run shows the ring throughput, the paced ones include the futex wake-up of an
+// idle consumer worker.
+
+#include "bench_utils.h"
+#include "dispatch_utils.h"
+#include "event_bus.h"
+#include "queue_shm.h"
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace std::chrono_literals;
+
+// --------------------------------------------------
+
+struct Stamped {
+    uint64_t created_ns;
+};
+
+// --------------------------------------------------
+
+class LatencyConsumer
+{
+public:
+    bench::LatencyHistogram latency_;
+    std::atomic<uint64_t> counter_{0};
+
+    void handle(Stamped evt, size_t)
+    {
+        latency_.record(bench::now_ns() - evt.created_ns);
+        counter_.fetch_add(1, std::memory_order_release);
+    }
+};
+
+using ShmBus = catbus::EventCatbus<catbus::SharedMemoryQueue<4096>, 1, 1>;
+
+// --------------------------------------------------
+
+void run(const char* name, uint64_t count, uint64_t interval_ns) {
+    const auto shm_name = "/catbus_perf_" + std::to_string(getpid()) + "_" + std::to_string(count);
+    auto child = fork();
+    if (child == 0) {
+        LatencyConsumer consumer;
+        auto bus = std::make_unique<ShmBus>(shm_name,
+            catbus::make_shm_registry<Stamped>(consumer));
+        auto start = bench::now_ns();
+        while (consumer.counter_.load(std::memory_order_acquire) < count) {
+            std::this_thread::sleep_for(1ms);
+        }
+        auto elapsed = bench::now_ns() - start;
+        bus->stop();
+        std::cout << "## " << name << ": " << count * 1'000'000'000 / elapsed << " events/s"
+            << ", p50 " << consumer.latency_.percentile(50) / 1000.0 << "mcs"
+            << ", p99 " << consumer.latency_.percentile(99) / 1000.0 << "mcs"
+            << ", p99.9 " << consumer.latency_.percentile(99.9) / 1000.0 << "mcs"
+            << ", max " << consumer.latency_.max() / 1000.0 << "mcs\n";
+        std::cout.flush();
+        _exit(0);
+    }
+    {
+        // Only picks the event type, the handler that runs is the child's.
+        LatencyConsumer consumer;
+        auto bus = std::make_unique<ShmBus>(shm_name);
+        auto next = bench::now_ns();
+        for(uint64_t i = 0; i < count; ++i) {
+            if (interval_ns != 0) {
+                next += interval_ns;
+                while (bench::now_ns() < next) {
+                }
+            }
+            catbus::static_dispatch(*bus, 0, Stamped{bench::now_ns()}, consumer);
+        }
+        waitpid(child, nullptr, 0);
+    }
+}
+
+int main(int argc, char** argv) {
+    run("saturated", 1'000'000, 0);
+    run("one event per 10mcs", 100'000, 10'000);
+    run("one event per 1ms", 2'000, 1'000'000);
+}
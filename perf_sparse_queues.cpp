@@ -0,0 +1,82 @@
+// Sparse load over many queues: only a handful of events are in flight, and each handler sends
+// the next one to an arbitrary queue. With NQ >> NWrk most queues are empty most of the time, so
+// the cost of an idle worker finding the next non-empty queue dominates.
+
+#include "dispatch_utils.h"
+#include "event_bus.h"
+#include "event_sender.h"
+#include "queue_mutex.h"
+#include "queue_lock_free.h"
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <thread>
+
+using namespace std::chrono_literals;
+
+// --------------------------------------------------
+
+struct Hop {
+    unsigned seed;
+};
+
+// --------------------------------------------------
+
+template<size_t NQ>
+class HopConsumer
+{
+public:
+    catbus::EventSender<Hop> sender_;
+    std::atomic_long counter_{0};
+
+    void handle(Hop evt, size_t)
+    {
+        counter_.fetch_add(1, std::memory_order_relaxed);
+        // xorshift, so the next queue is spread over the whole range.
+        evt.seed ^= evt.seed << 13;
+        evt.seed ^= evt.seed >> 17;
+        evt.seed ^= evt.seed << 5;
+        sender_.send(evt, evt.seed % NQ);
+    }
+};
+
+// --------------------------------------------------
+
+template<typename Queue, size_t NQ, size_t NWrk>
+void run(const char* name, size_t in_flight) {
+    HopConsumer<NQ> consumer;
+    double rate{};
+    {
+        // Too big for the stack with many lock-free rings.
+        auto bus_ptr = std::make_unique<catbus::EventCatbus<Queue, NQ, NWrk>>();
+        auto& bus = *bus_ptr;
+        catbus::setup_dispatch(bus, consumer);
+        for(size_t i = 0; i < in_flight; ++i) {
+            catbus::static_dispatch(bus, i % NQ, Hop{static_cast<unsigned>(i * 2654435761u + 1)},
+                consumer);
+        }
+        std::this_thread::sleep_for(100ms);
+        auto start_count = consumer.counter_.load();
+        auto begin = std::chrono::high_resolution_clock::now();
+        std::this_thread::sleep_for(1s);
+        auto end = std::chrono::high_resolution_clock::now();
+        auto count = consumer.counter_.load() - start_count;
+        bus.stop();
+        auto elapsed_seconds =
+            std::chrono::duration_cast<std::chrono::duration<double>>(end - begin);
+        rate = count / elapsed_seconds.count();
+    }
+    std::cout << "## " << name << " NQ=" << NQ << " NWrk=" << NWrk << " in flight="
+        << in_flight << ": " << rate << " events/s\n";
+}
+
+int main(int argc, char** argv) {
+    run<catbus::SimpleLockFreeQueue<1024>, 4, 4>("lock-free", 2);
+    run<catbus::SimpleLockFreeQueue<1024>, 64, 4>("lock-free", 2);
+    run<catbus::SimpleLockFreeQueue<1024>, 256, 4>("lock-free", 2);
+    run<catbus::MutexProtectedQueue, 4, 4>("mutex", 2);
+    run<catbus::MutexProtectedQueue, 64, 4>("mutex", 2);
+    run<catbus::MutexProtectedQueue, 256, 4>("mutex", 2);
+}
@@ -0,0 +1,99 @@
+// Sustained overload: the producer sends a burst of events much faster than the single worker can
+// handle them. The lock-free ring makes the producer wait for free slots, the mutex-protected
+// queue grows in memory, and the spilling queue writes everything over its high-water mark to a
+// file, so the producer keeps going and memory stays bounded. Reports how long the producer was
+// busy sending, drain throughput, latency and peak RSS growth during the run.
+
+#include "bench_utils.h"
+#include "dispatch_utils.h"
+#include "event_bus.h"
+#include "queue_lock_free.h"
+#include "queue_mutex.h"
+#include "queue_spill.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <memory>
+#include <thread>
+
+#include <unistd.h>
+
+using namespace std::chrono_literals;
+
+// --------------------------------------------------
+
+struct Stamped {
+    uint64_t created_ns;
+    uint64_t payload[5];
+};
+
+// --------------------------------------------------
+
+class SlowConsumer
+{
+public:
+    bench::LatencyHistogram latency_;
+    std::atomic<uint64_t> counter_{0};
+
+    void handle(Stamped evt, size_t)
+    {
+        auto now = bench::now_ns();
+        latency_.record(now - evt.created_ns);
+        while (bench::now_ns() < now + 200) {
+        }
+        counter_.fetch_add(1, std::memory_order_relaxed);
+    }
+};
+
+size_t resident_bytes() {
+    size_t pages = 0;
+    size_t resident = 0;
+    if (auto* f = std::fopen("/proc/self/statm", "r")) {
+        if (std::fscanf(f, "%zu %zu", &pages, &resident) != 2) {
+            resident = 0;
+        }
+        std::fclose(f);
+    }
+    return resident * static_cast<size_t>(sysconf(_SC_PAGESIZE));
+}
+
+// --------------------------------------------------
+
+template<typename Queue>
+void run(const char* name, uint64_t count) {
+    SlowConsumer consumer;
+    auto baseline = resident_bytes();
+    size_t peak = baseline;
+    {
+        auto bus = std::make_unique<catbus::EventCatbus<Queue, 1, 1>>();
+        auto start = bench::now_ns();
+        for(uint64_t i = 0; i < count; ++i) {
+            catbus::static_dispatch(*bus, 0, Stamped{bench::now_ns(), {}}, consumer);
+            if ((i & 65535) == 0) {
+                peak = std::max(peak, resident_bytes());
+            }
+        }
+        auto sent = bench::now_ns();
+        while (consumer.counter_.load(std::memory_order_relaxed) < count) {
+            peak = std::max(peak, resident_bytes());
+            std::this_thread::sleep_for(10ms);
+        }
+        auto done = bench::now_ns();
+        bus->stop();
+        std::cout << "## " << name << ": producer busy " << (sent - start) / 1'000'000 << "ms"
+            << ", " << count * 1'000'000'000 / (done - start) << " events/s"
+            << ", p50 " << consumer.latency_.percentile(50) / 1'000'000 << "ms"
+            << ", p99 " << consumer.latency_.percentile(99) / 1'000'000 << "ms"
+            << ", RSS growth " << (peak - baseline) / (1024 * 1024) << "MB\n";
+    }
+}
+
+int main(int argc, char** argv) {
+    constexpr uint64_t count = 3'000'000;
+    // Mutex-protected queue goes last, since the allocator may keep its memory resident.
+    run<catbus::SpillingQueue<65536>>("spilling queue", count);
+    run<catbus::SimpleLockFreeQueue<65536>>("lock-free ring", count);
+    run<catbus::MutexProtectedQueue>("mutex-protected queue", count);
+}
@@ -3,10 +3,14 @@
 #include "event_sender.h"
 #include "queue_mutex.h"
 #include "queue_lock_free.h"
+#include "stats_page.h"
+#include "trace.h"
 
 #include <atomic>
 #include <chrono>
+#include <cstring>
 #include <iostream>
+#include <memory>
 #include <thread>
 #include <vector>
 
@@ -162,10 +166,27 @@ public:
 
 // --------------------------------------------------
 
+// Workers may still be recording when main() returns, so the tracer is destroyed after the bus
+// has joined them.
+std::unique_ptr<catbus::Tracer> tracer;
+
 catbus::EventCatbus<catbus::SimpleLockFreeQueue<65536>, 15, 15> bus;
 //catbus::EventCatbus<catbus::MutexProtectedQueue, 15, 15> bus;
 
+// 'performance --trace file.json' records the last tasks of every worker and writes them in Chrome
+// trace-event format. 'performance --stats /name' publishes a stats page, so the run can be
+// watched with 'catbus_stat /name'.
 int main(int argc, char** argv) {
+    if (argc > 2 && std::strcmp(argv[1], "--trace") == 0) {
+        tracer = std::make_unique<catbus::Tracer>(15);
+        bus.trace_to(tracer.get());
+    }
+#if defined(__linux__)
+    std::unique_ptr<catbus::StatsPublisher<decltype(bus)>> stats;
+    if (argc > 2 && std::strcmp(argv[1], "--stats") == 0) {
+        stats = std::make_unique<catbus::StatsPublisher<decltype(bus)>>(bus, argv[2]);
+    }
+#endif
     SmallEvtConsumer A;
     MediumEvtConsumer B;
     LongEvtConsumer C;
@@ -188,8 +209,15 @@ int main(int argc, char** argv) {
         }
         std::cout << "]\n\n";
     }
+#if defined(__linux__)
+    stats.reset();
+#endif
     bus.stop();
     auto end = std::chrono::high_resolution_clock::now();
+    if (tracer) {
+        bus.trace_to(nullptr);
+        tracer->write_chrome_json(std::string{argv[2]});
+    }
     auto count = A.counter_.load(std::memory_order_relaxed);
     auto countB = B.counter_.load(std::memory_order_relaxed);
     auto countC = C.counter_.load(std::memory_order_relaxed);